@@ -0,0 +1,545 @@
+#include "aot.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+
+namespace {
+	const char *const argRegisters[] = { "edi", "esi", "edx", "ecx", "r8d", "r9d" };
+	constexpr std::uint32_t registerArgs = 6;
+
+	// Operand stack value the generated code has not pushed yet
+	struct Operand {
+		enum Kind : std::uint8_t {
+			STACK,	// already on the machine stack
+			EAX,	// computed, at most one pending value is in eax
+			ECX,	// right operand moved out of eax
+			IMM,
+			LOCAL,
+		} kind = STACK;
+		std::int32_t value = 0;	// constant or slot
+	};
+
+	std::string Name(const std::string &signature) {
+		return signature.substr(0, signature.find('('));
+	}
+
+	struct FunctionState {
+		std::string symbol;
+		std::vector<JitInstruction> insts;
+		bool supported = false;
+		std::string text;
+	};
+
+	// Assembly for one function, none when the operand stack does not line up at some jump target
+	std::optional<std::string> WriteFunction(const Program &program, std::uint32_t funcIdx, const std::vector<FunctionState> &functions, const std::vector<ReturnKind> &returnKinds) {
+		const auto &func = functions[funcIdx];
+		const auto arity = program.GetFunction(funcIdx)->arity;
+		const auto size = static_cast<std::uint32_t>(program.GetFunction(funcIdx)->size);
+		const auto prefix = ".L" + std::to_string(funcIdx);
+		std::ostringstream out;
+		auto line = [&](const std::string &text) { out << '\t' << text << '\n'; };
+
+		std::vector<bool> targets(size + 1);
+		std::uint32_t frameSize = arity;
+		for (const auto &inst : func.insts) {
+			if (IsSlotInstruction(inst.code)) {
+				frameSize = std::max(frameSize, inst.a + 1);
+			}
+			if (auto target = JumpTarget(inst, size)) {
+				targets[target.value()] = true;
+			}
+		}
+		const auto frameBytes = (frameSize * sizeof(std::int32_t) + 15) & ~std::size_t{ 15 };
+		auto local = [](std::int32_t slot) { return "dword ptr [rbp - " + std::to_string((slot + 1) * sizeof(std::int32_t)) + "]"; };
+		auto label = [&](std::uint32_t pos) { return prefix + "_" + std::to_string(pos); };
+		auto imm = [](std::int32_t value) { return std::to_string(value); };
+
+		// Values stay pending like in the baseline JIT, the machine stack
+		// depth is known everywhere so calls can keep it aligned
+		std::vector<Operand> pending;
+		std::int64_t depth = 0;
+		std::vector<std::int64_t> labelDepths(size + 1, -1);
+		bool consistent = true;
+		auto spill = [&]() {
+			for (const auto &operand : pending) {
+				switch (operand.kind) {
+					case Operand::EAX: line("push rax"); break;
+					case Operand::IMM: line("push " + imm(operand.value)); break;
+					case Operand::LOCAL: line("push qword ptr [rbp - " + std::to_string((operand.value + 1) * sizeof(std::int32_t)) + "]"); break;
+					default: break;
+				}
+				++depth;
+			}
+			pending.clear();
+		};
+		auto jumpTo = [&](std::uint32_t target) {
+			if (labelDepths[target] >= 0 && labelDepths[target] != depth) {
+				consistent = false;
+			}
+			labelDepths[target] = depth;
+			return label(target);
+		};
+		auto pop = [&]() {
+			if (pending.empty()) {
+				return Operand{};
+			}
+			auto operand = pending.back();
+			pending.pop_back();
+			return operand;
+		};
+		auto freeEax = [&]() {
+			if (std::any_of(pending.begin(), pending.end(), [](const Operand &operand) { return operand.kind == Operand::EAX; })) {
+				spill();
+			}
+		};
+		auto spillIfReads = [&](std::int32_t slot) {
+			if (std::any_of(pending.begin(), pending.end(), [&](const Operand &operand) { return operand.kind == Operand::LOCAL && operand.value == slot; })) {
+				spill();
+			}
+		};
+		auto toEax = [&](const Operand &operand) {
+			switch (operand.kind) {
+				case Operand::STACK: line("pop rax"); --depth; break;
+				case Operand::IMM: line("mov eax, " + imm(operand.value)); break;
+				case Operand::LOCAL: line("mov eax, " + local(operand.value)); break;
+				default: break;
+			}
+		};
+		auto binaryOperands = [&]() {
+			auto right = pop(), left = pop();
+			if (right.kind == Operand::STACK) {
+				line("pop rcx");
+				line("pop rax");
+				depth -= 2;
+				right.kind = Operand::ECX;
+			}
+			else if (right.kind == Operand::EAX) {
+				line("mov ecx, eax");
+				right.kind = Operand::ECX;
+				toEax(left);
+			}
+			else if (left.kind != Operand::EAX) {
+				freeEax();
+				toEax(left);
+			}
+			return right;
+		};
+		auto source = [&](const Operand &operand) {
+			return operand.kind == Operand::IMM ? imm(operand.value) : operand.kind == Operand::LOCAL ? local(operand.value) : std::string("ecx");
+		};
+		// Arguments in registers, the rest pushed again in reverse order. Calls pop them all
+		auto call = [&](const std::string &target, std::uint32_t params, bool tail) {
+			spill();
+			const auto argDisp = [&](std::uint32_t arg, std::int64_t extra) { return "dword ptr [rsp + " + std::to_string((params - 1 - arg) * 8 + extra) + "]"; };
+			for (std::uint32_t arg = 0; arg < params && arg < registerArgs; ++arg) {
+				line(std::string("mov ") + argRegisters[arg] + ", " + argDisp(arg, 0));
+			}
+			if (tail && params <= registerArgs) {
+				line("leave");
+				line("jmp " + target);
+				return;
+			}
+
+			const std::uint32_t stacked = params > registerArgs ? params - registerArgs : 0;
+			const bool pad = (depth + stacked) % 2 != 0;
+			if (pad) {
+				line("sub rsp, 8");
+			}
+			for (std::uint32_t arg = params; arg-- > registerArgs;) {
+				line("push qword ptr [rsp + " + std::to_string((params - 1 - arg) * 8 + (pad + (params - 1 - arg)) * 8) + "]");
+			}
+			line("call " + target);
+			const auto drop = (params + stacked + pad) * 8;
+			if (drop) {
+				line("add rsp, " + std::to_string(drop));
+			}
+			depth -= params;
+		};
+
+		out << "\t.globl " << func.symbol << '\n';
+		out << "\t.type " << func.symbol << ", @function\n";
+		out << func.symbol << ":\n";
+		out << prefix << ":\n";
+		line("push rbp");
+		line("mov rbp, rsp");
+		if (frameBytes) {
+			line("sub rsp, " + std::to_string(frameBytes));
+		}
+		for (std::uint32_t arg = 0; arg < arity; ++arg) {
+			if (arg < registerArgs) {
+				line("mov " + local(arg) + ", " + argRegisters[arg]);
+			}
+			else {
+				line("mov eax, dword ptr [rbp + " + std::to_string(16 + (arg - registerArgs) * 8) + "]");
+				line("mov " + local(arg) + ", eax");
+			}
+		}
+		out << prefix << "_body:\n";
+
+		bool reachable = true;
+		for (std::size_t i = 0; i < func.insts.size(); ++i) {
+			const auto &inst = func.insts[i];
+			if (targets[inst.pos]) {
+				spill();
+				if (!reachable) {
+					depth = std::max<std::int64_t>(labelDepths[inst.pos], 0);
+				}
+				jumpTo(inst.pos);
+				out << label(inst.pos) << ":\n";
+				reachable = true;
+			}
+			if (!reachable) {
+				continue;
+			}
+
+			const auto slot = static_cast<std::int32_t>(inst.a);
+			switch (inst.code) {
+				case InstructionCode::SKIP:
+				case InstructionCode::BACK:
+					spill();
+					line("jmp " + jumpTo(JumpTarget(inst, size).value()));
+					reachable = false;
+					break;
+				case InstructionCode::ICONST:
+					pending.push_back(Operand{ Operand::IMM, slot });
+					break;
+				case InstructionCode::ILOAD:
+					pending.push_back(Operand{ Operand::LOCAL, slot });
+					break;
+				case InstructionCode::ISTORE: {
+					auto value = pop();
+					spillIfReads(slot);
+					switch (value.kind) {
+						case Operand::EAX: line("mov " + local(slot) + ", eax"); break;
+						case Operand::IMM: line("mov " + local(slot) + ", " + imm(value.value)); break;
+						case Operand::LOCAL:
+							if (value.value != slot) {
+								line("mov ecx, " + local(value.value));
+								line("mov " + local(slot) + ", ecx");
+							}
+							break;
+						default:
+							line("pop rcx");
+							--depth;
+							line("mov " + local(slot) + ", ecx");
+							break;
+					}
+					break;
+				}
+				case InstructionCode::POP:
+					if (pending.empty()) {
+						line("add rsp, 8");
+						--depth;
+					}
+					else {
+						pending.pop_back();
+					}
+					break;
+				case InstructionCode::DUP: {
+					auto top = pop();
+					if (top.kind == Operand::IMM || top.kind == Operand::LOCAL) {
+						pending.push_back(top);
+						pending.push_back(top);
+						break;
+					}
+					if (top.kind == Operand::EAX) {
+						pending.push_back(top);
+						spill();
+					}
+					else {
+						line("mov rax, qword ptr [rsp]");
+					}
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+
+				case InstructionCode::IADD:
+				case InstructionCode::ISUB:
+				case InstructionCode::IMUL: {
+					auto right = binaryOperands();
+					if (inst.code == InstructionCode::IMUL && right.kind == Operand::IMM) {
+						line("imul eax, eax, " + imm(right.value));
+					}
+					else {
+						const char *op = inst.code == InstructionCode::IADD ? "add" : inst.code == InstructionCode::ISUB ? "sub" : "imul";
+						line(std::string(op) + " eax, " + source(right));
+					}
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+				case InstructionCode::IDIV:
+				case InstructionCode::MOD: {
+					auto right = binaryOperands();
+					if (right.kind == Operand::IMM) {
+						line("mov ecx, " + imm(right.value));
+						right.kind = Operand::ECX;
+					}
+					line("cdq");
+					line("idiv " + source(right));
+					if (inst.code == InstructionCode::MOD) {
+						line("mov eax, edx");
+					}
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+				case InstructionCode::INC:
+				case InstructionCode::DEC:
+				case InstructionCode::INCBY: {
+					const int step = inst.code == InstructionCode::INC ? 1 : inst.code == InstructionCode::DEC ? -1 : static_cast<int>(inst.b);
+					spillIfReads(slot);
+					line("add " + local(slot) + ", " + imm(step));
+					break;
+				}
+				case InstructionCode::LOOP: {
+					auto limit = pop();
+					if (limit.kind == Operand::EAX) {
+						line("mov ecx, eax");
+					}
+					else if (limit.kind == Operand::LOCAL) {
+						line("mov ecx, " + local(limit.value));
+					}
+					else if (limit.kind == Operand::STACK) {
+						line("pop rcx");
+						--depth;
+					}
+					if (limit.kind != Operand::IMM) {
+						limit.kind = Operand::ECX;
+					}
+					spill();
+					line("mov eax, " + local(slot));
+					line("add eax, 1");
+					line("mov " + local(slot) + ", eax");
+					line("cmp eax, " + source(limit));
+					line("jl " + jumpTo(JumpTarget(inst, size).value()));
+					break;
+				}
+
+				case InstructionCode::IEQ:
+				case InstructionCode::ILE:
+				case InstructionCode::IGE: {
+					const std::string cond = inst.code == InstructionCode::IEQ ? "e" : inst.code == InstructionCode::ILE ? "l" : "g";
+					const std::string inverse = inst.code == InstructionCode::IEQ ? "ne" : inst.code == InstructionCode::ILE ? "ge" : "le";
+					auto right = binaryOperands();
+					line("cmp eax, " + source(right));
+
+					// A compare feeding a branch jumps on the flags directly
+					const auto *next = i + 1 < func.insts.size() ? &func.insts[i + 1] : nullptr;
+					const bool branch = next && !targets[next->pos] &&
+						(next->code == InstructionCode::IF || next->code == InstructionCode::WHILE || next->code == InstructionCode::FOR);
+					if (branch) {
+						spill();
+						line("j" + inverse + " " + jumpTo(JumpTarget(*next, size).value()));
+						++i;
+						break;
+					}
+					line("set" + cond + " al");
+					line("movzx eax, al");
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+				case InstructionCode::IF:
+				case InstructionCode::WHILE:
+				case InstructionCode::FOR: {
+					auto cond = pop();
+					spill();
+					const auto target = JumpTarget(inst, size).value();
+					switch (cond.kind) {
+						case Operand::IMM:
+							if (!cond.value) {
+								line("jmp " + jumpTo(target));
+							}
+							break;
+						case Operand::LOCAL:
+							line("cmp " + local(cond.value) + ", 0");
+							line("je " + jumpTo(target));
+							break;
+						default:
+							toEax(cond);
+							line("test eax, eax");
+							line("je " + jumpTo(target));
+							break;
+					}
+					break;
+				}
+
+				case InstructionCode::IRET:
+					toEax(pop());
+					pending.clear();
+					line("jmp " + prefix + "_ret");
+					reachable = false;
+					break;
+				case InstructionCode::FUNCTIONCALL:
+				case InstructionCode::MEMOCALL:
+					call(".L" + std::to_string(inst.a), inst.b, false);
+					if (returnKinds[inst.a].value) {
+						pending.push_back(Operand{ Operand::EAX });
+					}
+					break;
+				case InstructionCode::TAILCALL:
+					if (inst.a == funcIdx) {
+						// Arguments replace the locals, then start over
+						spill();
+						for (std::uint32_t arg = 0; arg < inst.b; ++arg) {
+							line("mov eax, dword ptr [rsp + " + std::to_string((inst.b - 1 - arg) * 8) + "]");
+							line("mov " + local(arg) + ", eax");
+						}
+						line("lea rsp, [rbp - " + std::to_string(frameBytes) + "]");
+						line("jmp " + prefix + "_body");
+					}
+					else {
+						call(".L" + std::to_string(inst.a), inst.b, true);
+						if (inst.b > registerArgs) {
+							line("jmp " + prefix + "_ret");
+						}
+					}
+					depth = 0;
+					reachable = false;
+					break;
+				case InstructionCode::NATIVECALL: {
+					const auto &native = program.GetNative(inst.a);
+					call(native.name + "@PLT", inst.b, false);
+					if (native.returnsValue) {
+						pending.push_back(Operand{ Operand::EAX });
+					}
+					break;
+				}
+				default:
+					break;
+			}
+		}
+		if (!consistent) {
+			return std::nullopt;
+		}
+
+		// Falling off the end returns nothing
+		spill();
+		out << label(size) << ":\n";
+		line("xor eax, eax");
+		out << prefix << "_ret:\n";
+		line("leave");
+		line("ret");
+		out << "\t.size " << func.symbol << ", .-" << func.symbol << "\n\n";
+		return out.str();
+	}
+}
+
+std::vector<std::string> WriteAssembly(std::ostream &out, const Program &program) {
+	const auto count = program.FunctionCount();
+	const auto returnKinds = FindReturnKinds(program);
+	std::vector<FunctionState> functions(count);
+
+	// Symbols are the script names, overloads after the first get their index appended
+	std::unordered_map<std::string, std::uint32_t> names;
+	for (std::uint32_t i = 0; i < count; ++i) {
+		const auto *func = program.GetFunction(i);
+		const auto name = Name(program.GetSignature(FunctionHandle{ i, func->arity }));
+		functions[i].symbol = names.emplace(name, i).second ? name : name + "_" + std::to_string(i);
+
+		// Integers only, like the baseline JIT
+		auto &state = functions[i];
+		state.supported = IntParams(program.GetSignature(FunctionHandle{ i, func->arity })) && !returnKinds[i].isFloat;
+		for (std::size_t pos = 0; state.supported && pos < func->size;) {
+			auto inst = DecodeInstruction(func->code, func->size, pos);
+			if (!inst) {
+				state.supported = false;
+				break;
+			}
+			pos = inst->next;
+			state.insts.push_back(inst.value());
+
+			switch (inst->code) {
+				case InstructionCode::NOP:
+				case InstructionCode::ELSE:
+				case InstructionCode::ENDIF:
+				case InstructionCode::SKIP:
+				case InstructionCode::BACK:
+				case InstructionCode::ICONST:
+				case InstructionCode::ILOAD:
+				case InstructionCode::ISTORE:
+				case InstructionCode::POP:
+				case InstructionCode::DUP:
+				case InstructionCode::IADD:
+				case InstructionCode::ISUB:
+				case InstructionCode::IMUL:
+				case InstructionCode::IDIV:
+				case InstructionCode::MOD:
+				case InstructionCode::INC:
+				case InstructionCode::DEC:
+				case InstructionCode::INCBY:
+				case InstructionCode::LOOP:
+				case InstructionCode::IEQ:
+				case InstructionCode::ILE:
+				case InstructionCode::IGE:
+				case InstructionCode::IRET:
+				case InstructionCode::IF:
+				case InstructionCode::WHILE:
+				case InstructionCode::FOR:
+					break;
+				case InstructionCode::FUNCTIONCALL:
+				case InstructionCode::MEMOCALL:
+				case InstructionCode::TAILCALL:
+					state.supported = inst->a < count && program.GetFunction(inst->a)->arity == inst->b;
+					break;
+				case InstructionCode::NATIVECALL: {
+					const auto &native = program.GetNative(inst->a);
+					state.supported = native.paramTypes.size() == inst->b && (native.returnType == "int" || native.returnType == "void") &&
+						std::all_of(native.paramTypes.begin(), native.paramTypes.end(), [](const std::string &type) { return type == "int"; });
+					break;
+				}
+				default:
+					state.supported = false;
+					break;
+			}
+		}
+
+		// Jumps have to land on an instruction
+		std::vector<bool> starts(func->size + 1);
+		starts[func->size] = true;
+		for (const auto &inst : state.insts) {
+			starts[inst.pos] = true;
+		}
+		state.supported = state.supported && std::all_of(state.insts.begin(), state.insts.end(), [&](const JitInstruction &inst) {
+			const auto target = JumpTarget(inst, static_cast<std::uint32_t>(func->size));
+			return !target || starts[target.value()];
+		});
+	}
+
+	// Functions calling something left out are left out too
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (std::uint32_t i = 0; i < count; ++i) {
+			auto &state = functions[i];
+			if (!state.supported) {
+				continue;
+			}
+			const bool callsOut = std::any_of(state.insts.begin(), state.insts.end(), [&](const JitInstruction &inst) {
+				return (inst.code == InstructionCode::FUNCTIONCALL || inst.code == InstructionCode::MEMOCALL || inst.code == InstructionCode::TAILCALL) && !functions[inst.a].supported;
+			});
+			auto text = callsOut ? std::nullopt : WriteFunction(program, i, functions, returnKinds);
+			if (!text) {
+				state.supported = false;
+				changed = true;
+				continue;
+			}
+			state.text = std::move(text.value());
+		}
+	}
+
+	std::vector<std::string> skipped;
+	out << "\t.intel_syntax noprefix\n";
+	out << "\t.text\n\n";
+	for (std::uint32_t i = 0; i < count; ++i) {
+		const auto signature = program.GetSignature(FunctionHandle{ i, program.GetFunction(i)->arity });
+		if (!functions[i].supported) {
+			skipped.push_back(signature);
+			continue;
+		}
+		out << "# " << (returnKinds[i].value ? "int " : "void ") << signature << '\n';
+		out << functions[i].text;
+	}
+	out << "\t.section .note.GNU-stack,\"\",@progbits\n";
+	return skipped;
+}
\ No newline at end of file
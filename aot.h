@@ -0,0 +1,23 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+class Program;
+
+// Ahead of time compilation for scripts that are fixed at build time.
+// Every function of program that only uses integers becomes x86-64
+// assembly for the GNU assembler, exported as a C function of the same
+// name with the System V ABI:
+//
+//	c_compiler script.c --aot script.s
+//	cc -shared -o libscript.so script.s
+//
+//	auto *add = reinterpret_cast<int (*)(int, int)>(dlsym(handle, "add"));
+//
+// Natives are called as C functions of their script name that the host
+// exports. There are no script errors, natives can not raise them and a
+// division by zero traps like it would in C. Returns the signatures that
+// were left out, functions using floats and whatever calls them.
+std::vector<std::string> WriteAssembly(std::ostream &out, const Program &program);
\ No newline at end of file
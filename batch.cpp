@@ -0,0 +1,133 @@
+#include "batch.h"
+#include <atomic>
+#include <thread>
+#include <sstream>
+#include <algorithm>
+
+namespace {
+	// Most invocations a worker claims at once, enough to keep the shared
+	// counter cold while long batches still balance between workers
+	constexpr std::size_t maxChunkSize = 64;
+
+	std::vector<std::string> ParamTypes(const std::string &signature) {
+		std::vector<std::string> types;
+		auto begin = signature.find('(') + 1;
+		auto end = signature.find(')', begin);
+
+		std::string type;
+		std::istringstream list{ signature.substr(begin, end - begin) };
+		while (std::getline(list, type, ',')) {
+			types.push_back(type);
+		}
+		return types;
+	}
+}
+
+std::vector<BatchResult> RunBatch(std::shared_ptr<const Program> program, const std::string &entry,
+	const std::vector<std::vector<VarType>> &argSets, unsigned threads, JitMode jitMode) {
+	std::vector<BatchResult> results(argSets.size());
+	if (argSets.empty()) {
+		return results;
+	}
+
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	// Every call may be expensive, small batches still get a thread per call
+	threads = static_cast<unsigned>(std::min<std::size_t>(threads, argSets.size()));
+	const auto chunkSize = std::clamp<std::size_t>(argSets.size() / threads, 1, maxChunkSize);
+
+	auto func = program->Lookup(entry);
+	if (!func) {
+		throw std::string("Unknown entry function " + entry);
+	}
+
+	std::atomic<std::size_t> next{ 0 };
+	auto worker = [&]() {
+		VM vm{ program, jitMode };
+		while (true) {
+			const auto begin = next.fetch_add(chunkSize, std::memory_order_relaxed);
+			if (begin >= argSets.size()) {
+				break;
+			}
+
+			const auto end = std::min(begin + chunkSize, argSets.size());
+			for (auto i = begin; i < end; ++i) {
+				try {
+					results[i].value = vm.Call(func.value(), argSets[i]);
+				}
+				catch (const std::string &err) {
+					results[i].error = err;
+				}
+				catch (const std::exception &err) {
+					results[i].error = err.what();
+				}
+			}
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned i = 1; i < threads; ++i) {
+		pool.emplace_back(worker);
+	}
+	worker();
+	for (auto &thread : pool) {
+		thread.join();
+	}
+
+	return results;
+}
+
+std::vector<std::vector<VarType>> ReadBatchArgs(std::istream &in, const Program &program, const std::string &entry) {
+	auto func = program.Lookup(entry);
+	if (!func) {
+		throw std::string("Unknown entry function " + entry);
+	}
+	const auto types = ParamTypes(program.GetSignature(func.value()));
+
+	std::vector<std::vector<VarType>> argSets;
+	std::string line;
+	std::size_t lineNum = 0;
+	while (std::getline(in, line)) {
+		lineNum++;
+		std::replace(line.begin(), line.end(), ',', ' ');
+
+		std::istringstream values{ line };
+		std::vector<VarType> args;
+		std::string value;
+		while (values >> value) {
+			const bool floating = args.size() < types.size() && types[args.size()] == "float";
+			if (floating) {
+				args.push_back(std::stof(value));
+			}
+			else {
+				args.push_back(std::stoi(value));
+			}
+		}
+
+		// Blank lines only count as calls for functions without parameters
+		if (args.empty() && !types.empty()) {
+			continue;
+		}
+		if (args.size() != types.size()) {
+			throw std::string("Line " + std::to_string(lineNum) + ": expected " + std::to_string(types.size()) + " arguments");
+		}
+		argSets.push_back(std::move(args));
+	}
+	return argSets;
+}
+
+void WriteBatchResults(std::ostream &out, const std::vector<BatchResult> &results) {
+	for (const auto &result : results) {
+		if (!result.error.empty()) {
+			out << "error: " << result.error << '\n';
+		}
+		else if (!result.value) {
+			out << "void\n";
+		}
+		else {
+			std::visit([&](auto val) { out << val; }, result.value.value());
+			out << '\n';
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "interpreter.h"
+
+struct BatchResult {
+	std::optional<VarType> value;
+	std::string error;			// empty unless the invocation failed
+};
+
+// Calls entry once per argument set, spread over a pool of worker threads.
+// Every worker owns a VM, the program is shared. Results keep input order.
+std::vector<BatchResult> RunBatch(std::shared_ptr<const Program> program, const std::string &entry,
+	const std::vector<std::vector<VarType>> &argSets, unsigned threads = 0, JitMode jitMode = JitMode::BASELINE);
+
+// One argument set per line, values separated by spaces or commas and
+// converted to the parameter types of entry
+std::vector<std::vector<VarType>> ReadBatchArgs(std::istream &in, const Program &program, const std::string &entry);
+void WriteBatchResults(std::ostream &out, const std::vector<BatchResult> &results);
\ No newline at end of file
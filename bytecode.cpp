@@ -1,353 +1,941 @@
 #include "bytecode.h"
-#include <stack>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <unordered_map>
-
-void GenerateBytecode(std::ostream &out, Statement &stmt);
+#include <sstream>
+#include "ir.h"
 
 namespace {
-	using UnfinishedBreak = std::uint32_t;
-	Parser *globalParser = nullptr;
-	Scope *currScope = nullptr;
-	std::uint32_t varIdx = 0, currFuncIdx = 0;
-	std::stack<std::unordered_map<std::string, std::pair<std::uint32_t, VarDeclStmt*>>> vars;
-
-	// Loop stuff
-	std::stack<std::uint32_t> loopBeginBytes;
-	std::stack<std::vector<UnfinishedBreak>> unfinishedBreaks;
-	std::stack<Statement *> postLoopStatements;
-	
-	std::uint32_t GetVariableIdx(const std::string &toFind) {
-		if (!vars.size()) {
-			return -1;
+	// Value of an integer expression built only from literals
+	std::optional<int> FoldConstant(const Expression &expr) {
+		if (expr.type == ExpressionType::VALUE) {
+			const auto &val = static_cast<const ValueExpr &>(expr).val;
+			if (val.type != TokenType::INTEGER) return std::nullopt;
+			return std::stoi(val.value);
 		}
-		for (const auto &[var, idx] : vars.top()) {
-			if (var == toFind) {
-				return idx.first;
-			}
+		if (expr.type != ExpressionType::BINARY) {
+			return std::nullopt;
 		}
-		decltype(vars)::value_type tmp = vars.top();
-		vars.pop();
 
-		auto ret = GetVariableIdx(toFind);
-		vars.push(std::move(tmp));
-		return ret;
-	}
-	VarDeclStmt *GetVariableStmt(std::uint32_t toFind) {
-		if (!vars.size()) {
-			return nullptr;
+		const auto &binary = static_cast<const BinaryExpression &>(expr);
+		auto lhs = FoldConstant(*binary.lhs), rhs = FoldConstant(*binary.rhs);
+		if (!lhs || !rhs) {
+			return std::nullopt;
+		}
+		switch (binary.op.type) {
+			case TokenType::PLUS: return *lhs + *rhs;
+			case TokenType::MINUS: return *lhs - *rhs;
+			case TokenType::STAR: return *lhs * *rhs;
+			case TokenType::SLASH: return *rhs ? std::optional<int>(*lhs / *rhs) : std::nullopt;
+			case TokenType::PERCENT: return *rhs ? std::optional<int>(*lhs % *rhs) : std::nullopt;
+			case TokenType::EQUALS: return *lhs == *rhs;
+			case TokenType::LESS: return *lhs < *rhs;
+			case TokenType::GREATER: return *lhs > *rhs;
 		}
-		for (const auto &[var, idx] : vars.top()) {
-			if (idx.first == toFind) {
-				return idx.second;
+		return std::nullopt;
+	}
+
+	bool HasSideEffects(const Expression &expr) {
+		switch (expr.type) {
+			case ExpressionType::BINARY: {
+				const auto &binary = static_cast<const BinaryExpression &>(expr);
+				return HasSideEffects(*binary.lhs) || HasSideEffects(*binary.rhs);
 			}
+			case ExpressionType::CAST:
+				return HasSideEffects(*static_cast<const CastExpr &>(expr).expr);
+			case ExpressionType::UNARY:
+			case ExpressionType::FUNCCALL:
+				return true;
 		}
-		decltype(vars)::value_type tmp = vars.top();
-		vars.pop();
+		return false;
+	}
 
-		auto ret = GetVariableStmt(toFind);
-		vars.push(std::move(tmp));
-		return ret;
+	// True when control never reaches the statement after stmt
+	bool Terminates(const Statement &stmt) {
+		switch (stmt.type) {
+			case StatementType::RETURN:
+			case StatementType::BREAK:
+			case StatementType::CONTINUE:
+				return true;
+			case StatementType::BLOCK: {
+				const auto &block = static_cast<const BlockStmt &>(stmt);
+				return std::any_of(block.stmts.begin(), block.stmts.end(), [](const auto &child) { return Terminates(*child); });
+			}
+			case StatementType::IF: {
+				const auto &ifStmt = static_cast<const IfStmt &>(stmt);
+				if (auto cond = FoldConstant(*ifStmt.condition)) {
+					const auto *taken = *cond ? ifStmt.then.get() : ifStmt.els.get();
+					return taken && Terminates(*taken);
+				}
+				return ifStmt.els && Terminates(*ifStmt.then) && Terminates(*ifStmt.els);
+			}
+		}
+		return false;
 	}
 
-	void GenerateExprBytecode(std::ostream &out, Expression &expr);
+	bool ContainsLoop(const Statement &stmt) {
+		switch (stmt.type) {
+			case StatementType::WHILE:
+			case StatementType::FOR:
+				return true;
+			case StatementType::BLOCK: {
+				const auto &block = static_cast<const BlockStmt &>(stmt);
+				return std::any_of(block.stmts.begin(), block.stmts.end(), [](const auto &child) { return ContainsLoop(*child); });
+			}
+			case StatementType::IF: {
+				const auto &ifStmt = static_cast<const IfStmt &>(stmt);
+				return ContainsLoop(*ifStmt.then) || (ifStmt.els && ContainsLoop(*ifStmt.els));
+			}
+		}
+		return false;
+	}
 
-	void GenerateValueBytecode(std::ostream &out, ValueExpr &expr) {
-		bool floating = false;
-		switch (expr.val.type) {
-			case TokenType::INTEGER:
-				out << GetCode(InstructionCode::ICONST);
+	void CollectCalls(const Expression &expr, std::vector<const FuncCallExpr *> &calls) {
+		switch (expr.type) {
+			case ExpressionType::BINARY: {
+				const auto &binary = static_cast<const BinaryExpression &>(expr);
+				CollectCalls(*binary.lhs, calls);
+				CollectCalls(*binary.rhs, calls);
+				break;
+			}
+			case ExpressionType::CAST:
+				CollectCalls(*static_cast<const CastExpr &>(expr).expr, calls);
+				break;
+			case ExpressionType::FUNCCALL: {
+				const auto &call = static_cast<const FuncCallExpr &>(expr);
+				calls.push_back(&call);
+				for (const auto &param : call.params) {
+					CollectCalls(*param, calls);
+				}
+				break;
+			}
+		}
+	}
+	void CollectCalls(const Statement &stmt, std::vector<const FuncCallExpr *> &calls) {
+		switch (stmt.type) {
+			case StatementType::BLOCK:
+				for (const auto &child : static_cast<const BlockStmt &>(stmt).stmts) {
+					CollectCalls(*child, calls);
+				}
 				break;
-			case TokenType::FLOAT:
-				out << GetCode(InstructionCode::FCONST);
-				floating = true;
+			case StatementType::FUNCDECL: {
+				const auto &func = static_cast<const FuncDeclStmt &>(stmt);
+				if (func.definition) CollectCalls(*func.definition, calls);
 				break;
-			case TokenType::IDENT: {
-				auto varIdx = GetVariableIdx(expr.val.value);
-				bool floating = GetVariableStmt(varIdx)->var.type->name.value == "float";
+			}
+			case StatementType::VARDECL: {
+				const auto &decl = static_cast<const VarDeclStmt &>(stmt);
+				if (decl.expr) CollectCalls(*decl.expr, calls);
+				break;
+			}
+			case StatementType::VARASSIGN:
+				CollectCalls(*static_cast<const VarAssignStmt &>(stmt).val, calls);
+				break;
+			case StatementType::IF: {
+				const auto &ifStmt = static_cast<const IfStmt &>(stmt);
+				CollectCalls(*ifStmt.condition, calls);
+				CollectCalls(*ifStmt.then, calls);
+				if (ifStmt.els) CollectCalls(*ifStmt.els, calls);
+				break;
+			}
+			case StatementType::WHILE: {
+				const auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+				CollectCalls(*whileStmt.condition, calls);
+				CollectCalls(*whileStmt.then, calls);
+				break;
+			}
+			case StatementType::FOR: {
+				const auto &forStmt = static_cast<const ForStmt &>(stmt);
+				CollectCalls(*forStmt.initial, calls);
+				CollectCalls(*forStmt.condition, calls);
+				CollectCalls(*forStmt.postLoop, calls);
+				CollectCalls(*forStmt.then, calls);
+				break;
+			}
+			case StatementType::EXPRSTMT:
+				CollectCalls(*static_cast<const ExpressionStmt &>(stmt).expr, calls);
+				break;
+			case StatementType::RETURN:
+				CollectCalls(*static_cast<const ReturnStmt &>(stmt).ret, calls);
+				break;
+		}
+	}
+
+	// Body with the short form of every instruction whose operands fit.
+	// Distances shrink with the code they jump over, so jumps start out
+	// short and the ones that do not fit are widened until none changes.
+	// Bodies with a jump into the middle of an instruction stay as they are
+	std::string CompactOperands(const std::string &body) {
+		struct Inst {
+			InstructionCode code = InstructionCode::NOP;
+			std::uint32_t a = 0, b = 0;
+			std::size_t target = 0;	// instruction a jump lands on, the end counts as one
+			bool jump = false;
+			bool isShort = false;
+		};
+		constexpr auto notStart = ~std::size_t{ 0 };
 
-				out << GetCode(floating ? InstructionCode::FLOAD : InstructionCode::ILOAD);
-				out.write(reinterpret_cast<char*>(&varIdx), sizeof(varIdx));
-				return;
+		std::vector<Inst> insts;
+		std::vector<std::size_t> indexAt(body.size() + 1, notStart);
+		std::vector<std::size_t> wideNext;
+		for (std::size_t pos = 0; pos < body.size();) {
+			const auto code = static_cast<InstructionCode>(body[pos]);
+			if (pos + 1 + OperandSize(code) > body.size()) {
+				return body;
 			}
+			Inst inst;
+			inst.code = ReadOperands(code, body.data() + pos + 1, inst.a, inst.b);
+			indexAt[pos] = insts.size();
+			pos += 1 + OperandSize(code);
+			insts.push_back(inst);
+			wideNext.push_back(pos);
 		}
+		indexAt[body.size()] = insts.size();
 
-		if (floating) {
-			auto var = std::stof(expr.val.value);
-			out.write(reinterpret_cast<char *>(&var), sizeof(var));
+		auto fitsByte = [](std::uint32_t value) { return value <= 0xFF; };
+		auto fitsSignedByte = [](std::uint32_t value) {
+			const auto signedValue = static_cast<std::int32_t>(value);
+			return signedValue >= -128 && signedValue <= 127;
+		};
+		for (std::size_t i = 0; i < insts.size(); ++i) {
+			auto &inst = insts[i];
+			std::int64_t target = -1;
+			switch (inst.code) {
+				case InstructionCode::SKIP:
+				case InstructionCode::IF:
+				case InstructionCode::WHILE:
+				case InstructionCode::FOR:
+					target = static_cast<std::int64_t>(wideNext[i]) + inst.a;
+					break;
+				case InstructionCode::BACK:
+					target = static_cast<std::int64_t>(wideNext[i]) - inst.a;
+					break;
+				case InstructionCode::LOOP:
+					target = static_cast<std::int64_t>(wideNext[i]) - inst.b;
+					break;
+			}
+			if (target != -1) {
+				if (target < 0 || target > static_cast<std::int64_t>(body.size()) || indexAt[target] == notStart) {
+					return body;
+				}
+				inst.target = indexAt[target];
+				inst.jump = true;
+			}
+
+			switch (inst.code) {
+				case InstructionCode::ICONST:
+					inst.isShort = fitsSignedByte(inst.a);
+					break;
+				case InstructionCode::INCBY:
+					inst.isShort = fitsByte(inst.a) && fitsSignedByte(inst.b);
+					break;
+				case InstructionCode::FUNCTIONCALL:
+				case InstructionCode::NATIVECALL:
+				case InstructionCode::TAILCALL:
+				case InstructionCode::MEMOCALL:
+					inst.isShort = inst.a <= 0xFFFF && fitsByte(inst.b);
+					break;
+				default:
+					// Jump distances are checked below
+					inst.isShort = ShortCode(inst.code) != InstructionCode::NONE && (!IsSlotInstruction(inst.code) || fitsByte(inst.a));
+					break;
+			}
 		}
-		else {
-			auto var = std::stoi(expr.val.value);
-			out.write(reinterpret_cast<char *>(&var), sizeof(var));
+
+		// Offset of every instruction and of the end under the current choice
+		std::vector<std::size_t> offsets(insts.size() + 1);
+		for (bool changed = true; changed;) {
+			for (std::size_t i = 0; i < insts.size(); ++i) {
+				const auto code = insts[i].isShort ? ShortCode(insts[i].code) : insts[i].code;
+				offsets[i + 1] = offsets[i] + 1 + OperandSize(code);
+			}
+
+			changed = false;
+			for (std::size_t i = 0; i < insts.size(); ++i) {
+				auto &inst = insts[i];
+				if (!inst.jump || !inst.isShort) continue;
+
+				const auto from = offsets[i + 1], to = offsets[inst.target];
+				if (!fitsByte(static_cast<std::uint32_t>(to >= from ? to - from : from - to))) {
+					inst.isShort = false;
+					changed = true;
+				}
+			}
 		}
+
+		std::string compact;
+		compact.reserve(offsets.back());
+		for (std::size_t i = 0; i < insts.size(); ++i) {
+			auto inst = insts[i];
+			if (inst.jump) {
+				const auto from = offsets[i + 1], to = offsets[inst.target];
+				(inst.code == InstructionCode::LOOP ? inst.b : inst.a) = static_cast<std::uint32_t>(to >= from ? to - from : from - to);
+			}
+
+			const auto code = inst.isShort ? ShortCode(inst.code) : inst.code;
+			const auto widths = GetOperandWidths(code);
+			compact.push_back(static_cast<char>(GetCode(code)));
+			compact.append(reinterpret_cast<const char *>(&inst.a), widths.a);
+			compact.append(reinterpret_cast<const char *>(&inst.b), widths.b);
+		}
+		return compact;
 	}
-	void GenerateBinaryBytecode(std::ostream &out, BinaryExpression &expr) {
-		GenerateExprBytecode(out, *expr.lhs.get());
-		GenerateExprBytecode(out, *expr.rhs.get());
+}
 
-		const auto *evaluatedType = globalParser->EvalType(expr, currScope);
-		bool floating = evaluatedType->name.value == "float";
-		switch (expr.op.type) {
-		case TokenType::PLUS:
-			out << GetCode(floating ? InstructionCode::FADD : InstructionCode::IADD);
-			break;
-		case TokenType::MINUS:
-			out << GetCode(floating ? InstructionCode::FSUB : InstructionCode::ISUB);
-			break;
-		case TokenType::STAR:
-			out << GetCode(floating ? InstructionCode::FMUL : InstructionCode::IMUL);
-			break;
-		case TokenType::SLASH:
-			out << GetCode(floating ? InstructionCode::FDIV : InstructionCode::IDIV);
-			break;
-		case TokenType::PERCENT:
-			out << GetCode(InstructionCode::MOD);
-			break;
-		case TokenType::EQUALS:
-			out << GetCode(floating ? InstructionCode::FEQ : InstructionCode::IEQ);
-			break;
-		case TokenType::LESS:
-			out << GetCode(floating ? InstructionCode::FLE : InstructionCode::ILE);
-			break;
-		case TokenType::GREATER:
-			out << GetCode(floating ? InstructionCode::FGE : InstructionCode::IGE);
-			break;
+void Compiler::PushScope() {
+	vars.emplace();
+	scopeVarIdx.push(varIdx);
+}
+void Compiler::PopScope() {
+	vars.pop();
+	varIdx = scopeVarIdx.top();
+	scopeVarIdx.pop();
+}
+
+std::uint32_t Compiler::GetVariableIdx(const std::string &toFind) {
+	if (!vars.size()) {
+		return -1;
+	}
+	for (const auto &[var, idx] : vars.top()) {
+		if (var == toFind) {
+			return idx.first;
+		}
+	}
+	decltype(vars)::value_type tmp = vars.top();
+	vars.pop();
+
+	auto ret = GetVariableIdx(toFind);
+	vars.push(std::move(tmp));
+	return ret;
+}
+VarDeclStmt *Compiler::GetVariableStmt(std::uint32_t toFind) {
+	if (!vars.size()) {
+		return nullptr;
+	}
+	for (const auto &[var, idx] : vars.top()) {
+		if (idx.first == toFind) {
+			return idx.second;
 		}
 	}
-	void GenerateUnaryBytecode(std::ostream &out, UnaryExpr &expr) {
-		out << GetCode(expr.op.type == TokenType::INCREMENT ? InstructionCode::INC : InstructionCode::DEC);
-		std::uint32_t variableIndex = GetVariableIdx(expr.expr->val.value);
-		out.write(reinterpret_cast<char *>(&variableIndex), sizeof(variableIndex));
+	decltype(vars)::value_type tmp = vars.top();
+	vars.pop();
+
+	auto ret = GetVariableStmt(toFind);
+	vars.push(std::move(tmp));
+	return ret;
+}
+
+// Index into the FUNCTIONS section for script functions or into NATIVES
+// for host functions, each lists its functions in declaration order
+std::uint32_t Compiler::GetFunctionIdx(const Function *func) {
+	std::uint32_t idx = 0;
+	for (const auto &other : parser.GetGlobalScope().funcs) {
+		if (other.get() == func) {
+			return idx;
+		}
+		if (other->native == func->native && IsEmitted(other.get())) {
+			idx++;
+		}
 	}
-	void GenerateCastBytecode(std::ostream &out, CastExpr &expr) {
-		GenerateExprBytecode(out, *expr.expr.get());
-		if (expr.finalType == expr.origType) {
-			return;
+	return -1;
+}
+bool Compiler::IsEmitted(const Function *func) const {
+	return !reachableFunctions || reachableFunctions->contains(func);
+}
+// Walks the call graph from the configured roots, natives included so
+// the host only has to bind the ones that can actually be called
+void Compiler::FindReachableFunctions(Statement &stmt) {
+	if (stmt.type != StatementType::BLOCK || options.roots.empty()) {
+		return;
+	}
+
+	std::unordered_map<const Function *, const FuncDeclStmt *> definitions;
+	for (const auto &child : static_cast<BlockStmt &>(stmt).stmts) {
+		if (child->type != StatementType::FUNCDECL) continue;
+
+		const auto &decl = static_cast<const FuncDeclStmt &>(*child);
+		if (decl.definition) {
+			definitions[parser.GetGlobalScope().FindFunc(decl.name)] = &decl;
 		}
+	}
 
-		out << GetCode(expr.finalType->name.value == "float" ? InstructionCode::ITOF : InstructionCode::FTOI);
+	std::vector<const Function *> pending;
+	for (const auto &root : options.roots) {
+		if (const auto *func = parser.GetGlobalScope().FindFunc(Token{ TokenType::IDENT, 0, 0, root })) {
+			pending.push_back(func);
+		}
 	}
-	void GenerateFunccallBytecode(std::ostream &out, FuncCallExpr &expr) {
-		for (auto &param: expr.params) {
-			GenerateExprBytecode(out, *param);
+
+	reachableFunctions.emplace();
+	while (!pending.empty()) {
+		const auto *func = pending.back();
+		pending.pop_back();
+		if (!reachableFunctions->insert(func).second) continue;
+
+		auto found = definitions.find(func);
+		if (found == definitions.end()) continue;
+
+		std::vector<const FuncCallExpr *> calls;
+		CollectCalls(*found->second, calls);
+		for (const auto *call : calls) {
+			if (const auto *callee = parser.GetGlobalScope().FindFunc(call->func)) {
+				pending.push_back(callee);
+			}
 		}
-		
-		out << GetCode(InstructionCode::FUNCTIONCALL);
-		std::string funcSig = currScope->FindFunc(expr.func)->GenerateSignature() + '\n';
-		out << funcSig;//(funcSig.data(), funcSig.size());
-		const std::uint32_t paramSz = expr.params.size();
-		out.write(reinterpret_cast<const char *>(&paramSz), sizeof(paramSz));
 	}
-	void GenerateExprBytecode(std::ostream &out, Expression &expr) {
-		switch (expr.type) {
-			case ExpressionType::VALUE:
-				GenerateValueBytecode(out, static_cast<ValueExpr &>(expr));
-				break;
-			case ExpressionType::BINARY:
-				GenerateBinaryBytecode(out, static_cast<BinaryExpression &>(expr));
-				break;
-			case ExpressionType::UNARY:
-				GenerateUnaryBytecode(out, static_cast<UnaryExpr &>(expr));
+}
+
+// Scripts have no globals or pointers, so a function that calls no
+// natives and only calls functions like it (itself included) computes its
+// result from its arguments alone. Calls to the ones that return something
+// and call or loop are worth a cache lookup, straight line leaves are not
+void Compiler::FindMemoizedFunctions(Statement &stmt) {
+	if (!options.memoize || stmt.type != StatementType::BLOCK) {
+		return;
+	}
+
+	std::unordered_map<const Function *, std::vector<const FuncCallExpr *>> calls;
+	std::unordered_set<const Function *> loops;
+	for (const auto &child : static_cast<BlockStmt &>(stmt).stmts) {
+		if (child->type != StatementType::FUNCDECL) continue;
+
+		const auto &decl = static_cast<const FuncDeclStmt &>(*child);
+		const auto *func = parser.GetGlobalScope().FindFunc(decl.name);
+		if (!decl.definition || !func) continue;
+
+		CollectCalls(decl, calls[func]);
+		if (ContainsLoop(*decl.definition)) {
+			loops.insert(func);
+		}
+	}
+
+	// Everything starts out pure until it calls something that is not
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (auto it = calls.begin(); it != calls.end();) {
+			const bool pure = std::all_of(it->second.begin(), it->second.end(), [&](const FuncCallExpr *call) {
+				const auto *callee = parser.GetGlobalScope().FindFunc(call->func);
+				return callee && !callee->native && calls.contains(callee);
+			});
+			if (pure) {
+				++it;
+				continue;
+			}
+			it = calls.erase(it);
+			changed = true;
+		}
+	}
+
+	for (const auto &[func, funcCalls] : calls) {
+		const bool returnsValue = func->returnType && func->returnType->name.value != "void";
+		if (returnsValue && (!funcCalls.empty() || loops.contains(func))) {
+			memoizedFunctions.insert(func);
+		}
+	}
+}
+
+void Compiler::GenerateValueBytecode(std::ostream &out, ValueExpr &expr) {
+	bool floating = false;
+	switch (expr.val.type) {
+		case TokenType::INTEGER:
+			out << GetCode(InstructionCode::ICONST);
+			break;
+		case TokenType::FLOAT:
+			out << GetCode(InstructionCode::FCONST);
+			floating = true;
+			break;
+		case TokenType::IDENT: {
+			auto varIdx = GetVariableIdx(expr.val.value);
+			bool floating = GetVariableStmt(varIdx)->var.type->name.value == "float";
+
+			out << GetCode(floating ? InstructionCode::FLOAD : InstructionCode::ILOAD);
+			out.write(reinterpret_cast<char*>(&varIdx), sizeof(varIdx));
+			return;
+		}
+	}
+
+	if (floating) {
+		auto var = std::stof(expr.val.value);
+		out.write(reinterpret_cast<char *>(&var), sizeof(var));
+	}
+	else {
+		auto var = std::stoi(expr.val.value);
+		out.write(reinterpret_cast<char *>(&var), sizeof(var));
+	}
+}
+void Compiler::GenerateBinaryBytecode(std::ostream &out, BinaryExpression &expr) {
+	GenerateExprBytecode(out, *expr.lhs.get());
+	GenerateExprBytecode(out, *expr.rhs.get());
+
+	const auto *evaluatedType = parser.EvalType(expr, currScope);
+	bool floating = evaluatedType->name.value == "float";
+	switch (expr.op.type) {
+	case TokenType::PLUS:
+		out << GetCode(floating ? InstructionCode::FADD : InstructionCode::IADD);
+		break;
+	case TokenType::MINUS:
+		out << GetCode(floating ? InstructionCode::FSUB : InstructionCode::ISUB);
+		break;
+	case TokenType::STAR:
+		out << GetCode(floating ? InstructionCode::FMUL : InstructionCode::IMUL);
+		break;
+	case TokenType::SLASH:
+		out << GetCode(floating ? InstructionCode::FDIV : InstructionCode::IDIV);
+		break;
+	case TokenType::PERCENT:
+		out << GetCode(InstructionCode::MOD);
+		break;
+	case TokenType::EQUALS:
+		out << GetCode(floating ? InstructionCode::FEQ : InstructionCode::IEQ);
+		break;
+	case TokenType::LESS:
+		out << GetCode(floating ? InstructionCode::FLE : InstructionCode::ILE);
+		break;
+	case TokenType::GREATER:
+		out << GetCode(floating ? InstructionCode::FGE : InstructionCode::IGE);
+		break;
+	}
+}
+void Compiler::GenerateUnaryBytecode(std::ostream &out, UnaryExpr &expr) {
+	out << GetCode(expr.op.type == TokenType::INCREMENT ? InstructionCode::INC : InstructionCode::DEC);
+	std::uint32_t variableIndex = GetVariableIdx(expr.expr->val.value);
+	out.write(reinterpret_cast<char *>(&variableIndex), sizeof(variableIndex));
+}
+void Compiler::GenerateCastBytecode(std::ostream &out, CastExpr &expr) {
+	GenerateExprBytecode(out, *expr.expr.get());
+	if (expr.finalType == expr.origType) {
+		return;
+	}
+
+	out << GetCode(expr.finalType->name.value == "float" ? InstructionCode::ITOF : InstructionCode::FTOI);
+}
+// Copies the body of an already generated callee in place of the call.
+// Parameters go to fresh slots past the caller's locals and the value of
+// the final return is left on the stack
+bool Compiler::InlineCall(std::ostream &out, const Function &func) {
+	auto found = functionBodies.find(&func);
+	if (func.native || found == functionBodies.end()) {
+		return false;
+	}
+	const auto &body = found->second;
+
+	const bool marked = func.IsMod(Modifiers::INLINE);
+	if (body.size() > (marked ? options.inlineBudget : options.leafInlineBudget)) {
+		return false;
+	}
+
+	std::size_t exits = 0, lastPos = 0;
+	bool leaf = true;
+	for (std::size_t pos = 0; pos < body.size(); pos += 1 + OperandSize(static_cast<InstructionCode>(body[pos]))) {
+		lastPos = pos;
+		switch (static_cast<InstructionCode>(body[pos])) {
+			case InstructionCode::IRET:
+			case InstructionCode::FRET:
+				exits++;
 				break;
-			case ExpressionType::CAST:
-				GenerateCastBytecode(out, static_cast<CastExpr &>(expr));
+			case InstructionCode::TAILCALL:
+				exits++;
+				leaf = false;
 				break;
-			case ExpressionType::FUNCCALL:
-				GenerateFunccallBytecode(out, static_cast<FuncCallExpr &>(expr));
+			case InstructionCode::FUNCTIONCALL:
+			case InstructionCode::MEMOCALL:
+				leaf = false;
 				break;
 		}
 	}
+	if (!marked && !leaf) {
+		return false;
+	}
 
-	void GenerateIfBytecode(std::ostream &out, IfStmt &stmt) {
-		GenerateExprBytecode(out, *stmt.condition.get());
-		out << GetCode(InstructionCode::IF);
-
-		// To skip if false
-		std::uint32_t offset = 0;
-		out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
-		auto position = out.tellp();
+	// Only the last instruction may leave the body
+	const auto lastCode = body.empty() ? InstructionCode::NONE : static_cast<InstructionCode>(body[lastPos]);
+	const bool exitsLast = lastCode == InstructionCode::IRET || lastCode == InstructionCode::FRET || lastCode == InstructionCode::TAILCALL;
+	if (exits > (exitsLast ? 1 : 0)) {
+		return false;
+	}
 
-		vars.emplace();
-		GenerateBytecode(out, *stmt.then);
-		vars.pop();
+	// Arguments are on the stack in order, the last one on top
+	const std::uint32_t base = varIdx;
+	for (std::size_t i = func.params.size(); i-- > 0;) {
+		bool floating = func.params[i].type->name.value == "float";
+		out << GetCode(floating ? InstructionCode::FSTORE : InstructionCode::ISTORE);
+		const std::uint32_t slot = base + i;
+		out.write(reinterpret_cast<const char *>(&slot), sizeof(slot));
+	}
 
-		// Skip else when finished
-		out << GetCode(InstructionCode::SKIP);
-		out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
-		int ifEndPos = out.tellp();
+	for (std::size_t pos = 0; pos < body.size();) {
+		auto code = static_cast<InstructionCode>(body[pos]);
+		const auto operands = OperandSize(code);
+		if (pos == lastPos && exitsLast) {
+			if (code != InstructionCode::TAILCALL) break;
 
-		// Skip if false offset
-		int ifFinishedPos = out.tellp();
-		std::streamoff skipToElse = offset = (ifFinishedPos - position);
-		out.seekp(-skipToElse - sizeof(offset), out.cur);
-		out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
-		out.seekp(skipToElse, out.cur);
+			// Its result becomes the result of the inlined body
+			code = InstructionCode::FUNCTIONCALL;
+		}
 
-		if (stmt.els) {
-			out << GetCode(InstructionCode::ELSE);
-			vars.emplace();
-			GenerateBytecode(out, *stmt.els);
-			vars.pop();
+		out << GetCode(code);
+		if (IsSlotInstruction(code)) {
+			std::uint32_t slot = 0;
+			std::memcpy(&slot, body.data() + pos + 1, sizeof(slot));
+			slot += base;
+			out.write(reinterpret_cast<const char *>(&slot), sizeof(slot));
+			out.write(body.data() + pos + 1 + sizeof(slot), operands - sizeof(slot));
+		}
+		else {
+			out.write(body.data() + pos + 1, operands);
 		}
+		pos += 1 + operands;
+	}
+	return true;
+}
+void Compiler::GenerateFunccallBytecode(std::ostream &out, FuncCallExpr &expr, bool tailCall) {
+	for (auto &param: expr.params) {
+		GenerateExprBytecode(out, *param);
+	}
+	
+	EmitCall(out, *currScope->FindFunc(expr.func), expr.params.size(), tailCall);
+}
+// Arguments are already on the stack
+void Compiler::EmitCall(std::ostream &out, const Function &func, std::uint32_t params, bool tailCall) {
+	if (options.inlining && InlineCall(out, func)) {
+		if (tailCall) {
+			out << GetCode(returns == ValueKind::FLOAT ? InstructionCode::FRET : InstructionCode::IRET);
+		}
+		return;
+	}
 
-		int ifStmtEnd = out.tellp();
-		int skipElse = offset = (ifStmtEnd - ifEndPos);
-		out.seekp(ifEndPos - sizeof(offset), out.beg);
-		out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+	if (func.native) {
+		out << GetCode(InstructionCode::NATIVECALL);
+	}
+	else if (tailCall) {
+		out << GetCode(InstructionCode::TAILCALL);
+	}
+	else {
+		out << GetCode(memoizedFunctions.contains(&func) ? InstructionCode::MEMOCALL : InstructionCode::FUNCTIONCALL);
+	}
+	const std::uint32_t funcIdx = GetFunctionIdx(&func);
+	out.write(reinterpret_cast<const char *>(&funcIdx), sizeof(funcIdx));
+	out.write(reinterpret_cast<const char *>(&params), sizeof(params));
+}
+void Compiler::GenerateExprBytecode(std::ostream &out, Expression &expr) {
+	switch (expr.type) {
+		case ExpressionType::VALUE:
+			GenerateValueBytecode(out, static_cast<ValueExpr &>(expr));
+			break;
+		case ExpressionType::BINARY:
+			GenerateBinaryBytecode(out, static_cast<BinaryExpression &>(expr));
+			break;
+		case ExpressionType::UNARY:
+			GenerateUnaryBytecode(out, static_cast<UnaryExpr &>(expr));
+			break;
+		case ExpressionType::CAST:
+			GenerateCastBytecode(out, static_cast<CastExpr &>(expr));
+			break;
+		case ExpressionType::FUNCCALL:
+			GenerateFunccallBytecode(out, static_cast<FuncCallExpr &>(expr));
+			break;
+	}
+}
 
-		out.seekp(ifStmtEnd, out.beg);
+void Compiler::GenerateIfBytecode(std::ostream &out, IfStmt &stmt) {
+	// Only the taken branch of a constant condition is kept
+	if (auto cond = FoldConstant(*stmt.condition); cond && options.deadCodeElimination) {
+		auto *taken = *cond ? stmt.then.get() : stmt.els.get();
+		if (taken) {
+			PushScope();
+			GenerateBytecode(out, *taken);
+			PopScope();
+		}
+		return;
 	}
-	void GenerateWhileBytecode(std::ostream &out, WhileStmt &stmt) {
-		std::uint32_t endWhileOff = 0;
 
-		int whileStartPos = out.tellp();
-		loopBeginBytes.push(whileStartPos);
-		unfinishedBreaks.emplace();
-		GenerateExprBytecode(out, *stmt.condition);
+	GenerateExprBytecode(out, *stmt.condition.get());
+	out << GetCode(InstructionCode::IF);
 
-		out << GetCode(InstructionCode::WHILE);
-		int whileSkipPos = out.tellp();
-		out.write(reinterpret_cast<char *>(&endWhileOff), sizeof(endWhileOff));
+	// To skip if false
+	std::uint32_t offset = 0;
+	out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+	auto position = out.tellp();
 
-		vars.emplace();
-		GenerateBytecode(out, *stmt.then);
-		vars.pop();
+	PushScope();
+	GenerateBytecode(out, *stmt.then);
+	PopScope();
 
-		out << GetCode(InstructionCode::BACK);
-		std::uint32_t backBytes = (int)out.tellp() - whileStartPos + sizeof(endWhileOff);
-		out.write(reinterpret_cast<char *>(&backBytes), sizeof(backBytes));
+	// Skip else when finished
+	out << GetCode(InstructionCode::SKIP);
+	out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+	int ifEndPos = out.tellp();
 
-		int loopEnd = out.tellp();
-		endWhileOff = (loopEnd - whileSkipPos) - sizeof(endWhileOff);
-		out.seekp(whileSkipPos, out.beg);
-		out.write(reinterpret_cast<char *>(&endWhileOff), sizeof(endWhileOff));
+	// Skip if false offset
+	int ifFinishedPos = out.tellp();
+	std::streamoff skipToElse = offset = (ifFinishedPos - position);
+	out.seekp(-skipToElse - sizeof(offset), out.cur);
+	out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+	out.seekp(skipToElse, out.cur);
 
-		for (const auto &unfinishedBreak : unfinishedBreaks.top()) {
-			std::uint32_t offset = loopEnd - unfinishedBreak - sizeof(uint32_t);
-			out.seekp(unfinishedBreak, out.beg);
-			out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
-		}
+	if (stmt.els) {
+		out << GetCode(InstructionCode::ELSE);
+		PushScope();
+		GenerateBytecode(out, *stmt.els);
+		PopScope();
+	}
 
-		out.seekp(0, out.end);
-		unfinishedBreaks.pop();
-		loopBeginBytes.pop();
+	int ifStmtEnd = out.tellp();
+	int skipElse = offset = (ifStmtEnd - ifEndPos);
+	out.seekp(ifEndPos - sizeof(offset), out.beg);
+	out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+
+	out.seekp(ifStmtEnd, out.beg);
+}
+void Compiler::GenerateWhileBytecode(std::ostream &out, WhileStmt &stmt) {
+	if (auto cond = FoldConstant(*stmt.condition); cond && !*cond && options.deadCodeElimination) {
+		return;
 	}
-	void GenerateForBytecode(std::ostream &out, ForStmt &stmt) {
-		std::uint32_t offset = 0;
 
-		vars.emplace();
-		unfinishedBreaks.emplace();
-		postLoopStatements.push(stmt.postLoop.get());
-		GenerateBytecode(out, *stmt.initial);
+	std::uint32_t endWhileOff = 0;
 
-		int conditionPos = out.tellp();
-		loopBeginBytes.push(conditionPos);
-		GenerateExprBytecode(out, *stmt.condition);
+	int whileStartPos = out.tellp();
+	loopBeginBytes.push(whileStartPos);
+	unfinishedBreaks.emplace();
+	GenerateExprBytecode(out, *stmt.condition);
 
-		out << GetCode(InstructionCode::FOR);
-		auto offsetPos = out.tellp();
-		out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+	out << GetCode(InstructionCode::WHILE);
+	int whileSkipPos = out.tellp();
+	out.write(reinterpret_cast<char *>(&endWhileOff), sizeof(endWhileOff));
+
+	PushScope();
+	GenerateBytecode(out, *stmt.then);
+	PopScope();
 
-		GenerateBytecode(out, *stmt.then);
-		GenerateBytecode(out, *stmt.postLoop);
+	out << GetCode(InstructionCode::BACK);
+	std::uint32_t backBytes = (int)out.tellp() - whileStartPos + sizeof(endWhileOff);
+	out.write(reinterpret_cast<char *>(&backBytes), sizeof(backBytes));
 
-		out << GetCode(InstructionCode::BACK);
-		// Go back to start of loop (conditions)
-		offset = (int)out.tellp() - conditionPos + sizeof(offset);
-		out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+	int loopEnd = out.tellp();
+	endWhileOff = (loopEnd - whileSkipPos) - sizeof(endWhileOff);
+	out.seekp(whileSkipPos, out.beg);
+	out.write(reinterpret_cast<char *>(&endWhileOff), sizeof(endWhileOff));
 
-		// Skip loop size in bytes
-		int loopEnd = out.tellp();
-		offset = loopEnd - offsetPos - sizeof(offset);
-		out.seekp(offsetPos, out.beg);
+	for (const auto &unfinishedBreak : unfinishedBreaks.top()) {
+		std::uint32_t offset = loopEnd - unfinishedBreak - sizeof(uint32_t);
+		out.seekp(unfinishedBreak, out.beg);
 		out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+	}
 
-		for (const auto &unfinishedBreak : unfinishedBreaks.top()) {
-			std::uint32_t offset = loopEnd - unfinishedBreak - sizeof(uint32_t);
-			out.seekp(unfinishedBreak, out.beg);
-			out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
-		}
+	out.seekp(0, out.end);
+	unfinishedBreaks.pop();
+	loopBeginBytes.pop();
+}
+void Compiler::GenerateForBytecode(std::ostream &out, ForStmt &stmt) {
+	std::uint32_t offset = 0;
+
+	PushScope();
+	unfinishedBreaks.emplace();
+	postLoopStatements.push(stmt.postLoop.get());
+	GenerateBytecode(out, *stmt.initial);
 
-		out.seekp(0, out.end);
+	// Never entered, only the initializer runs
+	if (auto cond = FoldConstant(*stmt.condition); cond && !*cond && options.deadCodeElimination) {
 		unfinishedBreaks.pop();
-		vars.pop();
-		loopBeginBytes.pop();
+		PopScope();
 		postLoopStatements.pop();
+		return;
 	}
-	void GenerateContinueBytecode(std::ostream &out, ContinueStmt &stmt) {
-		if (postLoopStatements.size() && postLoopStatements.top()) {
-			GenerateBytecode(out, *postLoopStatements.top());
-		}
-		out << GetCode(InstructionCode::BACK);
-		int backPos = out.tellp();
-		std::uint32_t backbytes = backPos - loopBeginBytes.top() + sizeof(uint32_t);
-		out.write(reinterpret_cast<char *>(&backbytes), sizeof(backbytes));
+
+	int conditionPos = out.tellp();
+	loopBeginBytes.push(conditionPos);
+	GenerateExprBytecode(out, *stmt.condition);
+
+	out << GetCode(InstructionCode::FOR);
+	auto offsetPos = out.tellp();
+	out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+
+	GenerateBytecode(out, *stmt.then);
+	GenerateBytecode(out, *stmt.postLoop);
+
+	out << GetCode(InstructionCode::BACK);
+	// Go back to start of loop (conditions)
+	offset = (int)out.tellp() - conditionPos + sizeof(offset);
+	out.write(reinterpret_cast<char*>(&offset), sizeof(offset));
+
+	// Skip loop size in bytes
+	int loopEnd = out.tellp();
+	offset = loopEnd - offsetPos - sizeof(offset);
+	out.seekp(offsetPos, out.beg);
+	out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
+
+	for (const auto &unfinishedBreak : unfinishedBreaks.top()) {
+		std::uint32_t offset = loopEnd - unfinishedBreak - sizeof(uint32_t);
+		out.seekp(unfinishedBreak, out.beg);
+		out.write(reinterpret_cast<char *>(&offset), sizeof(offset));
 	}
-	void GenerateBreakBytecode(std::ostream &out, BreakStmt &stmt) {
-		out << GetCode(InstructionCode::SKIP);
-		std::uint32_t skipCnt = 0;
-		unfinishedBreaks.top().push_back(out.tellp());
-		out.write(reinterpret_cast<char *>(&skipCnt), sizeof(skipCnt));
+
+	out.seekp(0, out.end);
+	unfinishedBreaks.pop();
+	PopScope();
+	loopBeginBytes.pop();
+	postLoopStatements.pop();
+}
+void Compiler::GenerateContinueBytecode(std::ostream &out, ContinueStmt &stmt) {
+	if (postLoopStatements.size() && postLoopStatements.top()) {
+		GenerateBytecode(out, *postLoopStatements.top());
 	}
-	void GenerateBlockBytecode(std::ostream &out, BlockStmt &stmt) {
-		for (auto &stmt_child : stmt.stmts) {
-			GenerateBytecode(out, *stmt_child.get());
-		}
+	out << GetCode(InstructionCode::BACK);
+	int backPos = out.tellp();
+	std::uint32_t backbytes = backPos - loopBeginBytes.top() + sizeof(uint32_t);
+	out.write(reinterpret_cast<char *>(&backbytes), sizeof(backbytes));
+}
+void Compiler::GenerateBreakBytecode(std::ostream &out, BreakStmt &stmt) {
+	out << GetCode(InstructionCode::SKIP);
+	std::uint32_t skipCnt = 0;
+	unfinishedBreaks.top().push_back(out.tellp());
+	out.write(reinterpret_cast<char *>(&skipCnt), sizeof(skipCnt));
+}
+void Compiler::GenerateBlockBytecode(std::ostream &out, BlockStmt &stmt) {
+	// Bodies of if and while have their own scope
+	auto *outerScope = currScope;
+	if (stmt.scope) {
+		currScope = stmt.scope;
+	}
+
+	for (auto &stmt_child : stmt.stmts) {
+		GenerateBytecode(out, *stmt_child.get());
+
+		// Nothing after a return, break or continue can run
+		if (options.deadCodeElimination && Terminates(*stmt_child)) break;
 	}
-	void GenerateFuncBytecode(std::ostream &out, FuncDeclStmt &stmt) {
-		currScope = currScope->children[currFuncIdx++].get();
+	currScope = outerScope;
+}
+void Compiler::GenerateFuncBytecode(FuncDeclStmt &stmt) {
+	// Prototypes only own an empty scope
+	if (!stmt.definition || !IsEmitted(currScope->FindFunc(stmt.name))) {
+		currFuncIdx++;
+		return;
+	}
+
+	currScope = currScope->children[currFuncIdx++].get();
+	const auto outerVarIdx = varIdx;
+	returns = ValueKindOf(stmt.returnType);
+
+	// Bodies are generated on their own so callers can inline them later
+	auto generateBody = [&]() {
 		vars.push(decltype(vars)::value_type{});
 
+		// Every frame starts at slot 0 with the parameters in order
+		varIdx = 0;
 		for (auto &param : stmt.params) {
 			vars.top()[param->var.name.value] = std::pair<std::uint32_t, VarDeclStmt *>(varIdx++, param.get());
 		}
 
-		out << GetCode(InstructionCode::FUNCTION);
-		out << currScope->FindFunc(stmt.name)->GenerateSignature();
-		out.put('\n');
-		GenerateBlockBytecode(out, *stmt.definition.get());
-		out << GetCode(InstructionCode::ENDFUNC);
-
-		varIdx -= vars.top().size();
+		std::stringstream bodyStream;
+		GenerateBlockBytecode(bodyStream, *stmt.definition.get());
 		vars.pop();
+		return bodyStream.str();
+	};
+	std::string bodyCode;
+	if (options.ssa) {
+		auto ir = BuildIR(parser, *currScope, stmt);
+		OptimizeIR(ir, pureFunctions, options.unrollFactor);
+		if (IsPure(ir, pureFunctions)) {
+			pureFunctions.insert(ir.func);
+		}
 
-		currScope = currScope->parent;
+		std::ostringstream bodyStream;
+		EmitIR(bodyStream, ir, [&](std::ostream &callOut, const Function &callee, std::uint32_t params, bool tailCall, std::uint32_t frameSize) {
+			// Inlined callees get the slots past this frame
+			varIdx = frameSize;
+			EmitCall(callOut, callee, params, tailCall);
+		});
+		bodyCode = bodyStream.str();
+	}
+	else {
+		bodyCode = generateBody();
 	}
-	void GenerateVarDeclBytecode(std::ostream &out, VarDeclStmt &stmt) {
-		GenerateExprBytecode(out, *stmt.expr);
-		bool floating = stmt.var.type->name.value == "float";
 
-		out << GetCode(floating ? InstructionCode::FSTORE : InstructionCode::ISTORE);
-		out.write(reinterpret_cast<char *>(&varIdx), sizeof(varIdx));
+	// Stores to slots nothing loads are dropped on a second pass
+	if (options.deadCodeElimination && !options.ssa) {
+		std::unordered_set<std::uint32_t> read;
+		for (std::size_t pos = 0; pos < bodyCode.size(); pos += 1 + OperandSize(static_cast<InstructionCode>(bodyCode[pos]))) {
+			const auto code = static_cast<InstructionCode>(bodyCode[pos]);
+			if (!IsSlotInstruction(code)) continue;
+
+			std::uint32_t slot = 0;
+			std::memcpy(&slot, bodyCode.data() + pos + 1, sizeof(slot));
+			if (code == InstructionCode::ISTORE || code == InstructionCode::FSTORE) {
+				deadSlots.insert(slot);
+			}
+			else {
+				read.insert(slot);
+			}
+		}
+		std::erase_if(deadSlots, [&](std::uint32_t slot) { return read.contains(slot); });
+
+		if (!deadSlots.empty()) {
+			bodyCode = generateBody();
+			deadSlots.clear();
+		}
+	}
 
+	// Goes into the image once every function is done
+	functionBodies[currScope->FindFunc(stmt.name)] = std::move(bodyCode);
+
+	varIdx = outerVarIdx;
+	currScope = currScope->parent;
+}
+void Compiler::GenerateVarDeclBytecode(std::ostream &out, VarDeclStmt &stmt) {
+	if (deadSlots.contains(varIdx) && !HasSideEffects(*stmt.expr)) {
 		vars.top()[stmt.var.name.value] = std::pair<std::uint32_t, VarDeclStmt*>{varIdx++, &stmt};
+		return;
 	}
-	void GenerateVarAssignBytecode(std::ostream &out, VarAssignStmt &stmt) {
-		GenerateExprBytecode(out, *stmt.val);
-		auto idx = GetVariableIdx(stmt.name.value);
-		bool floating = GetVariableStmt(idx)->var.type->name.value == "float";
 
-		out << GetCode(floating ? InstructionCode::FSTORE : InstructionCode::ISTORE);
-		out.write(reinterpret_cast<char *>(&idx), sizeof(idx));
+	GenerateExprBytecode(out, *stmt.expr);
+	bool floating = stmt.var.type->name.value == "float";
+
+	out << GetCode(floating ? InstructionCode::FSTORE : InstructionCode::ISTORE);
+	out.write(reinterpret_cast<char *>(&varIdx), sizeof(varIdx));
+
+	vars.top()[stmt.var.name.value] = std::pair<std::uint32_t, VarDeclStmt*>{varIdx++, &stmt};
+}
+void Compiler::GenerateVarAssignBytecode(std::ostream &out, VarAssignStmt &stmt) {
+	auto idx = GetVariableIdx(stmt.name.value);
+	if (deadSlots.contains(idx) && !HasSideEffects(*stmt.val)) {
+		return;
 	}
-	void GenerateReturnBytecode(std::ostream &out, ReturnStmt &stmt) {
-		GenerateExprBytecode(out, *stmt.ret.get());
-		out << GetCode(InstructionCode::IRET);
+
+	GenerateExprBytecode(out, *stmt.val);
+	bool floating = GetVariableStmt(idx)->var.type->name.value == "float";
+
+	out << GetCode(floating ? InstructionCode::FSTORE : InstructionCode::ISTORE);
+	out.write(reinterpret_cast<char *>(&idx), sizeof(idx));
+}
+void Compiler::GenerateReturnBytecode(std::ostream &out, ReturnStmt &stmt) {
+	const auto valueKind = ValueKindOf(parser.EvalType(*stmt.ret, currScope));
+	const bool converts = returns != ValueKind::NONE && valueKind != ValueKind::NONE && valueKind != returns;
+
+	// Returning a script call directly reuses this frame for the callee,
+	// unless its result needs converting first
+	if (stmt.ret->type == ExpressionType::FUNCCALL && !converts) {
+		auto &call = static_cast<FuncCallExpr &>(*stmt.ret);
+		if (!currScope->FindFunc(call.func)->native) {
+			GenerateFunccallBytecode(out, call, true);
+			return;
+		}
 	}
 
-	union Constant {
-		int integer;
-		float floating;
-	};
+	GenerateExprBytecode(out, *stmt.ret.get());
+	if (converts) {
+		out << GetCode(returns == ValueKind::FLOAT ? InstructionCode::ITOF : InstructionCode::FTOI);
+	}
+	out << GetCode(returns == ValueKind::FLOAT ? InstructionCode::FRET : InstructionCode::IRET);
 }
 
-void GenerateBytecode(std::ostream &out, Statement &stmt) {
+void Compiler::GenerateBytecode(std::ostream &out, Statement &stmt) {
 	switch (stmt.type) {
 	case StatementType::BLOCK:
 		GenerateBlockBytecode(out, static_cast<BlockStmt &>(stmt));
 		break;
 	case StatementType::FUNCDECL:
-		GenerateFuncBytecode(out, static_cast<FuncDeclStmt &>(stmt));
+		GenerateFuncBytecode(static_cast<FuncDeclStmt &>(stmt));
 		break;
 	case StatementType::VARDECL:
 		GenerateVarDeclBytecode(out, static_cast<VarDeclStmt &>(stmt));
@@ -373,41 +961,222 @@ void GenerateBytecode(std::ostream &out, Statement &stmt) {
 	case StatementType::CONTINUE:
 		GenerateContinueBytecode(out, static_cast<ContinueStmt &>(stmt));
 		break;
-	case StatementType::EXPRSTMT:
-		GenerateExprBytecode(out, *static_cast<ExpressionStmt &>(stmt).expr);
+	case StatementType::EXPRSTMT: {
+		auto &expr = *static_cast<ExpressionStmt &>(stmt).expr;
+		GenerateExprBytecode(out, expr);
+
+		// Drop the unused value, ++ and -- push nothing
+		const auto *type = expr.type != ExpressionType::UNARY ? parser.EvalType(expr, currScope) : nullptr;
+		if (type && type->name.value != "void") {
+			out << GetCode(InstructionCode::POP);
+		}
 		break;
 	}
+	}
 }
-void GenerateBytecode(std::ostream &out, Statement &stmt, Parser &parser) {
-	globalParser = &parser;
-	currScope = &globalParser->GetGlobalScope();
+Compiler::Compiler(Parser &parser, const CompileOptions &options) : parser(parser), options(options) {
+	currScope = &parser.GetGlobalScope();
 	vars.push(decltype(vars)::value_type{});
-
-	out << GetCode(InstructionCode::FUNCS_BEGIN);
+}
+// Lays out the image described in bytecode.h from the finished bodies
+void Compiler::WriteImage(std::ostream &out) {
+	std::vector<const Function *> scripts, hosts;
 	for (auto &func : parser.GetGlobalScope().funcs) {
-		out << func->GenerateSignature() << '\n';
+		if (IsEmitted(func.get())) {
+			(func->native ? hosts : scripts).push_back(func.get());
+		}
+	}
+	auto returnsValue = [](const std::vector<const Function *> &funcs, std::uint32_t idx) {
+		return idx < funcs.size() && funcs[idx]->returnType->name.value != "void";
+	};
+
+	std::string strings, code;
+	auto addString = [&](const std::string &str) {
+		const auto offset = static_cast<std::uint32_t>(strings.size());
+		strings.append(str).push_back('\0');
+		return offset;
+	};
+
+	std::vector<ImageFunction> functions;
+	for (const auto *func : scripts) {
+		const auto arity = static_cast<std::uint32_t>(func->params.size());
+		ImageFunction entry{ addString(func->GenerateSignature()), ImageFunction::noCode, 0, arity, arity, 0, ValueKindOf(func->returnType) };
+
+		auto bodyIt = functionBodies.find(func);
+		if (bodyIt != functionBodies.end()) {
+			const auto &body = bodyIt->second;
+
+			// Bodies are structured, every jump lands where the stack is as
+			// high as at the jump, so walking them in order finds the deepest
+			int depth = 0;
+			for (std::size_t pos = 0; pos < body.size(); pos += 1 + OperandSize(static_cast<InstructionCode>(body[pos]))) {
+				const auto inst = static_cast<InstructionCode>(body[pos]);
+				std::uint32_t operands[2] = {};
+				std::memcpy(operands, body.data() + pos + 1, std::min(OperandSize(inst), body.size() - pos - 1));
+				if (IsSlotInstruction(inst)) {
+					entry.frameSize = std::max(entry.frameSize, operands[0] + 1);
+				}
+
+				const bool returns = inst == InstructionCode::NATIVECALL ? returnsValue(hosts, operands[0]) : returnsValue(scripts, operands[0]);
+				const auto effect = GetStackEffect(inst, operands[1], returns);
+				depth = std::max(depth - effect.pops, 0) + effect.pushes;
+				entry.maxStack = std::max(entry.maxStack, static_cast<std::uint32_t>(depth));
+			}
+
+			// Bodies stay wide until here, the inliner copies them
+			const auto written = options.compactOperands ? CompactOperands(body) : body;
+			entry.codeOffset = static_cast<std::uint32_t>(code.size());
+			entry.codeSize = static_cast<std::uint32_t>(written.size());
+			code += written;
+		}
+		functions.push_back(entry);
 	}
-	out << GetCode(InstructionCode::FUNCS_END);
 
-	GenerateBytecode(out, stmt);
-	globalParser = nullptr;
+	std::vector<std::uint32_t> natives;
+	for (const auto *func : hosts) {
+		natives.push_back(addString(func->GenerateSignature()));
+	}
+
+	auto bytesOf = [](const auto &table) {
+		return std::span<const char>{ reinterpret_cast<const char *>(table.data()), table.size() * sizeof(table[0]) };
+	};
+	const std::pair<SectionKind, std::span<const char>> contents[] = {
+		{ SectionKind::STRINGS, strings },
+		{ SectionKind::FUNCTIONS, bytesOf(functions) },
+		{ SectionKind::NATIVES, bytesOf(natives) },
+		{ SectionKind::CODE, code },
+	};
+
+	ImageHeader header{};
+	std::memcpy(header.magic, imageMagic, sizeof(imageMagic));
+	header.version = imageVersion;
+	header.sectionCount = static_cast<std::uint32_t>(std::size(contents));
+	out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+	// Sections follow the table, each padded to 4 bytes
+	auto padded = [](std::size_t size) { return (size + 3) & ~std::size_t{ 3 }; };
+	std::size_t offset = sizeof(header) + std::size(contents) * sizeof(ImageSection);
+	for (const auto &[kind, bytes] : contents) {
+		const ImageSection section{ kind, static_cast<std::uint32_t>(offset), static_cast<std::uint32_t>(bytes.size()) };
+		out.write(reinterpret_cast<const char *>(&section), sizeof(section));
+		offset += padded(bytes.size());
+	}
+	for (const auto &[kind, bytes] : contents) {
+		out.write(bytes.data(), bytes.size());
+		for (auto pad = bytes.size(); pad < padded(bytes.size()); ++pad) {
+			out.put('\0');
+		}
+	}
+}
+void Compiler::Compile(std::ostream &out, Statement &stmt) {
+	FindReachableFunctions(stmt);
+	FindMemoizedFunctions(stmt);
+
+	// Only function bodies end up in the image, code outside them never runs
+	std::ostringstream topLevel;
+	GenerateBytecode(topLevel, stmt);
+	WriteImage(out);
+}
+void GenerateBytecode(std::ostream &out, Statement &stmt, Parser &parser, const CompileOptions &options) {
+	Compiler{ parser, options }.Compile(out, stmt);
 }
 
-void PrintNextBytecode(std::istream &in) {
-	InstructionCode code;
-	std::cout << in.tellg() << ": ";
-	in.read(reinterpret_cast<char *>(&code), sizeof(InstructionCode));
+namespace {
+	std::string InvalidImage(const std::string &why) {
+		return "Invalid program image, " + why;
+	}
+}
+
+ImageReader::ImageReader(std::span<const char> image) {
+	ImageHeader header{};
+	if (image.size() < sizeof(header)) {
+		throw InvalidImage("no header");
+	}
+	std::memcpy(&header, image.data(), sizeof(header));
+	if (std::memcmp(header.magic, imageMagic, sizeof(imageMagic)) != 0) {
+		throw InvalidImage("not an image");
+	}
+	if (header.version != imageVersion) {
+		throw InvalidImage("version " + std::to_string(header.version) + " instead of " + std::to_string(imageVersion));
+	}
+	if (header.sectionCount > (image.size() - sizeof(header)) / sizeof(ImageSection)) {
+		throw InvalidImage("section table out of bounds");
+	}
+
+	for (std::uint32_t i = 0; i < header.sectionCount; ++i) {
+		ImageSection section{};
+		std::memcpy(&section, image.data() + sizeof(header) + i * sizeof(section), sizeof(section));
+		if (section.offset > image.size() || section.size > image.size() - section.offset) {
+			throw InvalidImage("section out of bounds");
+		}
+
+		const auto bytes = image.subspan(section.offset, section.size);
+		switch (section.kind) {
+			case SectionKind::STRINGS: strings = bytes; break;
+			case SectionKind::FUNCTIONS: functions = bytes; break;
+			case SectionKind::NATIVES: natives = bytes; break;
+			case SectionKind::CODE: code = bytes; break;
+		}
+	}
+	if (functions.size() % sizeof(ImageFunction) || natives.size() % sizeof(std::uint32_t)) {
+		throw InvalidImage("truncated table");
+	}
+
+	// Checked once here, the accessors rely on it
+	for (std::uint32_t i = 0; i < FunctionCount(); ++i) {
+		const auto func = GetFunction(i);
+		GetString(func.name);
+		if (func.codeOffset != ImageFunction::noCode && (func.codeOffset > code.size() || func.codeSize > code.size() - func.codeOffset)) {
+			throw InvalidImage("code of " + std::string(GetString(func.name)) + " out of bounds");
+		}
+	}
+	for (std::uint32_t i = 0; i < NativeCount(); ++i) {
+		GetNative(i);
+	}
+}
+ImageFunction ImageReader::GetFunction(std::uint32_t idx) const {
+	ImageFunction func{};
+	std::memcpy(&func, functions.data() + idx * sizeof(func), sizeof(func));
+	return func;
+}
+const char *ImageReader::CodeOf(const ImageFunction &func) const {
+	return func.codeOffset == ImageFunction::noCode ? nullptr : code.data() + func.codeOffset;
+}
+std::string_view ImageReader::GetNative(std::uint32_t idx) const {
+	std::uint32_t name = 0;
+	std::memcpy(&name, natives.data() + idx * sizeof(name), sizeof(name));
+	return GetString(name);
+}
+std::string_view ImageReader::GetString(std::uint32_t offset) const {
+	const auto *end = offset < strings.size() ? static_cast<const char *>(std::memchr(strings.data() + offset, '\0', strings.size() - offset)) : nullptr;
+	if (!end) {
+		throw InvalidImage("string out of bounds");
+	}
+	return std::string_view{ strings.data() + offset, static_cast<std::size_t>(end - strings.data() - offset) };
+}
+
+namespace {
+	union Constant {
+		int integer;
+		float floating;
+	};
+
+	// Signature tables of the image, to print call targets by name
+	struct PrintState {
+		std::vector<std::string> funcs;
+		std::vector<std::string> natives;
+	};
+}
+
+// One instruction of a body, short forms print like the instruction they stand for
+void PrintInstruction(InstructionCode code, std::uint32_t a, std::uint32_t b, const PrintState &state) {
 	switch (code) {
 		case InstructionCode::SKIP: {
-			std::uint32_t skipBytes = 0;
-			in.read(reinterpret_cast<char *>(&skipBytes), sizeof(skipBytes));
-			std::cout << "SKIP " << skipBytes << " bytes\n";
+			std::cout << "SKIP " << a << " bytes\n";
 			break;
 		}
 		case InstructionCode::BACK: {
-			std::uint32_t backBytes = 0;
-			in.read(reinterpret_cast<char *>(&backBytes), sizeof(backBytes));
-			std::cout << "BACK " << backBytes << " bytes\n";
+			std::cout << "BACK " << a << " bytes\n";
 			break;
 		}
 		case InstructionCode::DUP: {
@@ -422,24 +1191,20 @@ void PrintNextBytecode(std::istream &in) {
 		case InstructionCode::ICONST:
 		case InstructionCode::FCONST: {
 			Constant num;
-			in.read(reinterpret_cast<char *>(&num), sizeof(int));
+			std::memcpy(&num, &a, sizeof(num));
 			std::cout << "PUSH " << (code == InstructionCode::ICONST ? num.integer : num.floating) << '\n';
 			break;
 		}
 		
 		case InstructionCode::ILOAD:
 		case InstructionCode::FLOAD: {
-			std::uint32_t var;
-			in.read(reinterpret_cast<char *>(&var), sizeof(var));
-			std::cout << "PUSH FROM #" << var << '\n';
+			std::cout << "PUSH FROM #" << a << '\n';
 			break;
 		}
 		
 		case InstructionCode::ISTORE:
 		case InstructionCode::FSTORE: {
-			std::uint32_t var;
-			in.read(reinterpret_cast<char *>(&var), sizeof(var));
-			std::cout << "STORE INTO #" << var << '\n';
+			std::cout << "STORE INTO #" << a << '\n';
 			break;
 		}
 
@@ -464,12 +1229,16 @@ void PrintNextBytecode(std::istream &in) {
 			break;
 		}
 		case InstructionCode::INC:
-		
 		case InstructionCode::DEC: {
-			std::uint32_t varIdx = 0;
-			in.read(reinterpret_cast<char*>(&varIdx), sizeof(varIdx));
-			std::cout << (code == InstructionCode::INC ? "INC" : "DEC") << " #" << varIdx << '\n';
-
+			std::cout << (code == InstructionCode::INC ? "INC" : "DEC") << " #" << a << '\n';
+			break;
+		}
+		case InstructionCode::INCBY: {
+			std::cout << "INC #" << a << " BY " << static_cast<int>(b) << '\n';
+			break;
+		}
+		case InstructionCode::LOOP: {
+			std::cout << "LOOP #" << a << " (back " << b << " bytes while below)\n";
 			break;
 		}
 		case InstructionCode::ILE:
@@ -489,9 +1258,7 @@ void PrintNextBytecode(std::istream &in) {
 		}
 
 		case InstructionCode::IF: {
-			std::uint32_t codeSz = 0;
-			in.read(reinterpret_cast<char *>(&codeSz), sizeof(codeSz));
-			std::cout << "IF (skip " << codeSz << " bytes)\n";
+			std::cout << "IF (skip " << a << " bytes)\n";
 			break;
 		}
 		case InstructionCode::ELSE: {
@@ -499,46 +1266,24 @@ void PrintNextBytecode(std::istream &in) {
 			break;
 		}
 		case InstructionCode::WHILE: {
-			std::uint32_t codeSz = 0;
-			in.read(reinterpret_cast<char *>(&codeSz), sizeof(codeSz));
-			std::cout << "WHILE (skip " << codeSz << " bytes)\n";
+			std::cout << "WHILE (skip " << a << " bytes)\n";
 			break;
 		}
 		case InstructionCode::FOR: {
-			std::uint32_t codeSz = 0;
-			in.read(reinterpret_cast<char *>(&codeSz), sizeof(codeSz));
-			std::cout << "FOR (skip " << codeSz << " bytes)\n";
+			std::cout << "FOR (skip " << a << " bytes)\n";
 			break;
 		}
 
-		case InstructionCode::FUNCTION: {
-			std::string funcSig;
-			while (in.peek() != '\n') {
-				funcSig += in.get();
-			}
-			int ch = in.get();
-
-			std::cout << funcSig << ":\n";
-
-			while (!in.eof() && (ch = in.peek()) != '}') {
-				PrintNextBytecode(in);
-			}
-			in.get();
+		case InstructionCode::FUNCTIONCALL:
+		case InstructionCode::TAILCALL:
+		case InstructionCode::MEMOCALL: {
+			std::cout << (code == InstructionCode::TAILCALL ? "TAILCALL " : code == InstructionCode::MEMOCALL ? "MEMOCALL " : "CALL ") << (a < state.funcs.size() ? state.funcs[a] : "#" + std::to_string(a));
+			std::cout << " (" << b << ") params\n";
 			break;
 		}
-		case InstructionCode::ENDFUNC: {
-			std::cout << "ENDFUNC\n";
-			break;
-		}
-		case InstructionCode::FUNCTIONCALL: {
-			std::cout << "CALL ";
-			while (in.peek() != '\n') {
-				std::cout << (char)in.get();
-			}
-			in.get();
-			std::uint32_t params = 0;
-			in.read(reinterpret_cast<char *>(&params), sizeof(params));
-			std::cout << " (" << params << ") params\n";
+		case InstructionCode::NATIVECALL: {
+			std::cout << "NATIVE CALL " << (a < state.natives.size() ? state.natives[a] : "#" + std::to_string(a));
+			std::cout << " (" << b << ") params\n";
 			break;
 		}
 		case InstructionCode::IRET:
@@ -552,26 +1297,41 @@ void PrintNextBytecode(std::istream &in) {
 			std::cout << "CAST TO " << (code == InstructionCode::FTOI ? "INT" : "FLOAT") << "\n";
 			break;
 		}
+	}
+}
+void PrintBytecode(std::span<const char> image) {
+	const ImageReader reader{ image };
 
-		case InstructionCode::FUNCS_BEGIN: {
-			std::string tmp;
-
-			std::cout << "FUNCS\n";
-			while (true) {
-				std::getline(in, tmp);
-				std::cout << tmp << '\n';
-				if (in.peek() == GetCode(InstructionCode::FUNCS_END)) {
-					std::cout << "ENDFUNCS\n\n";
-					in.get();
-					break;
-				}
-			}
-			break;
+	PrintState state;
+	std::cout << "FUNCS\n";
+	for (std::uint32_t i = 0; i < reader.FunctionCount(); ++i) {
+		state.funcs.emplace_back(reader.GetString(reader.GetFunction(i).name));
+		std::cout << state.funcs.back() << '\n';
+	}
+	std::cout << "ENDFUNCS\n\n";
+	if (reader.NativeCount()) {
+		std::cout << "NATIVES\n";
+		for (std::uint32_t i = 0; i < reader.NativeCount(); ++i) {
+			state.natives.emplace_back(reader.GetNative(i));
+			std::cout << state.natives.back() << '\n';
 		}
+		std::cout << "ENDNATIVES\n\n";
 	}
-}
-void PrintBytecode(std::istream &in) {
-	while (!in.eof()) {
-		PrintNextBytecode(in);
+
+	for (std::uint32_t i = 0; i < reader.FunctionCount(); ++i) {
+		const auto func = reader.GetFunction(i);
+		const auto *code = reader.CodeOf(func);
+		if (!code) continue;
+
+		std::cout << state.funcs[i] << ": (" << func.codeSize << " bytes, " << func.frameSize << " slots, stack " << func.maxStack << ")\n";
+		for (std::size_t pos = 0; pos < func.codeSize;) {
+			const auto encoded = static_cast<InstructionCode>(code[pos]);
+			std::uint32_t a = 0, b = 0;
+			const auto inst = ReadOperands(encoded, code + pos + 1, a, b);
+			std::cout << pos << ": ";
+			PrintInstruction(inst, a, b, state);
+			pos += 1 + OperandSize(encoded);
+		}
+		std::cout << "ENDFUNC\n";
 	}
 }
\ No newline at end of file
@@ -1,9 +1,18 @@
 #pragma once
 
 #include <cstdint>
+#include <cstring>
 #include <ostream>
 #include <istream>
+#include <optional>
+#include <span>
 #include <stack>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include "parser.hpp"
 
 enum class InstructionCode : std::uint8_t {
@@ -52,15 +61,371 @@ enum class InstructionCode : std::uint8_t {
 	FTOI,		// float to int
 	ITOF,		// int to float
 
-	FUNCTION,
 	FUNCTIONCALL,	// funccall
-	FUNCS_BEGIN,
-	FUNCS_END,
-	ENDFUNC,
+	NATIVECALL,		// call host function, args stay on the stack
+	TAILCALL,		// call that replaces the current frame
+
+	INCBY,			// add an integer constant to int var
+	LOOP,			// pop limit, increment int var, go N bytes back while it is below the limit
+	MEMOCALL,		// funccall whose result is cached by argument values
+
+	// Short forms of the instructions above, see ShortCode. Slots, counts,
+	// jump distances and constants take a byte, call targets take two
+	SKIP_S,
+	BACK_S,
+	ICONST_S,
+	ILOAD_S,
+	FLOAD_S,
+	ISTORE_S,
+	FSTORE_S,
+	INC_S,
+	DEC_S,
+	IF_S,
+	WHILE_S,
+	FOR_S,
+	FUNCTIONCALL_S,
+	NATIVECALL_S,
+	TAILCALL_S,
+	INCBY_S,
+	LOOP_S,
+	MEMOCALL_S,
 };
 inline std::underlying_type_t<InstructionCode> GetCode(InstructionCode c) {
 	return static_cast<std::underlying_type_t<InstructionCode>>(c);
 }
+// Instructions and their short form, which behaves the same
+constexpr std::pair<InstructionCode, InstructionCode> shortForms[] = {
+	{ InstructionCode::SKIP, InstructionCode::SKIP_S },
+	{ InstructionCode::BACK, InstructionCode::BACK_S },
+	{ InstructionCode::ICONST, InstructionCode::ICONST_S },
+	{ InstructionCode::ILOAD, InstructionCode::ILOAD_S },
+	{ InstructionCode::FLOAD, InstructionCode::FLOAD_S },
+	{ InstructionCode::ISTORE, InstructionCode::ISTORE_S },
+	{ InstructionCode::FSTORE, InstructionCode::FSTORE_S },
+	{ InstructionCode::INC, InstructionCode::INC_S },
+	{ InstructionCode::DEC, InstructionCode::DEC_S },
+	{ InstructionCode::IF, InstructionCode::IF_S },
+	{ InstructionCode::WHILE, InstructionCode::WHILE_S },
+	{ InstructionCode::FOR, InstructionCode::FOR_S },
+	{ InstructionCode::FUNCTIONCALL, InstructionCode::FUNCTIONCALL_S },
+	{ InstructionCode::NATIVECALL, InstructionCode::NATIVECALL_S },
+	{ InstructionCode::TAILCALL, InstructionCode::TAILCALL_S },
+	{ InstructionCode::INCBY, InstructionCode::INCBY_S },
+	{ InstructionCode::LOOP, InstructionCode::LOOP_S },
+	{ InstructionCode::MEMOCALL, InstructionCode::MEMOCALL_S },
+};
+// Short form of c, NONE when it has none
+inline InstructionCode ShortCode(InstructionCode c) {
+	for (const auto &[wide, narrow] : shortForms) {
+		if (wide == c) return narrow;
+	}
+	return InstructionCode::NONE;
+}
+// Instruction a short form stands for, any other instruction stands for itself
+inline InstructionCode WideCode(InstructionCode c) {
+	for (const auto &[wide, narrow] : shortForms) {
+		if (narrow == c) return wide;
+	}
+	return c;
+}
+
+// Bytes of the first and second immediate operand
+struct OperandWidths {
+	std::size_t a = 0;
+	std::size_t b = 0;
+};
+inline OperandWidths GetOperandWidths(InstructionCode c) {
+	switch (c) {
+		case InstructionCode::SKIP:
+		case InstructionCode::BACK:
+		case InstructionCode::ICONST:
+		case InstructionCode::FCONST:
+		case InstructionCode::ILOAD:
+		case InstructionCode::FLOAD:
+		case InstructionCode::ISTORE:
+		case InstructionCode::FSTORE:
+		case InstructionCode::INC:
+		case InstructionCode::DEC:
+		case InstructionCode::IF:
+		case InstructionCode::WHILE:
+		case InstructionCode::FOR:
+			return { sizeof(std::uint32_t), 0 };
+		case InstructionCode::FUNCTIONCALL:
+		case InstructionCode::NATIVECALL:
+		case InstructionCode::TAILCALL:
+		case InstructionCode::INCBY:
+		case InstructionCode::LOOP:
+		case InstructionCode::MEMOCALL:
+			return { sizeof(std::uint32_t), sizeof(std::uint32_t) };
+		case InstructionCode::SKIP_S:
+		case InstructionCode::BACK_S:
+		case InstructionCode::ICONST_S:
+		case InstructionCode::ILOAD_S:
+		case InstructionCode::FLOAD_S:
+		case InstructionCode::ISTORE_S:
+		case InstructionCode::FSTORE_S:
+		case InstructionCode::INC_S:
+		case InstructionCode::DEC_S:
+		case InstructionCode::IF_S:
+		case InstructionCode::WHILE_S:
+		case InstructionCode::FOR_S:
+			return { 1, 0 };
+		case InstructionCode::INCBY_S:
+		case InstructionCode::LOOP_S:
+			return { 1, 1 };
+		case InstructionCode::FUNCTIONCALL_S:
+		case InstructionCode::NATIVECALL_S:
+		case InstructionCode::TAILCALL_S:
+		case InstructionCode::MEMOCALL_S:
+			return { 2, 1 };
+		default:
+			return {};
+	}
+}
+// Bytes of immediate operands after an instruction inside a function body
+inline std::size_t OperandSize(InstructionCode c) {
+	const auto widths = GetOperandWidths(c);
+	return widths.a + widths.b;
+}
+// Reads the operands starting at at widened to 32 bits, constants and
+// INCBY amounts sign extended. Returns the wide form of c, so callers
+// never need to tell short forms apart
+inline InstructionCode ReadOperands(InstructionCode c, const char *at, std::uint32_t &a, std::uint32_t &b) {
+	const auto wide = WideCode(c);
+	const auto widths = GetOperandWidths(c);
+	auto read = [](const char *from, std::size_t width, bool isSigned) {
+		std::uint32_t value = 0;
+		std::memcpy(&value, from, width);
+		if (isSigned && width < sizeof(value) && (value >> (width * 8 - 1)) & 1) {
+			value |= ~0u << (width * 8);
+		}
+		return value;
+	};
+	a = widths.a ? read(at, widths.a, wide == InstructionCode::ICONST) : 0;
+	b = widths.b ? read(at + widths.a, widths.b, wide == InstructionCode::INCBY) : 0;
+	return wide;
+}
+// Instructions whose (first) operand is a local slot
+inline bool IsSlotInstruction(InstructionCode c) {
+	switch (WideCode(c)) {
+		case InstructionCode::ILOAD:
+		case InstructionCode::FLOAD:
+		case InstructionCode::ISTORE:
+		case InstructionCode::FSTORE:
+		case InstructionCode::INC:
+		case InstructionCode::DEC:
+		case InstructionCode::INCBY:
+		case InstructionCode::LOOP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Values one instruction takes off the operand stack and puts back, a
+// call pushes its result only when returnsValue
+struct StackEffect {
+	int pops = 0;
+	int pushes = 0;
+};
+inline StackEffect GetStackEffect(InstructionCode c, std::uint32_t params = 0, bool returnsValue = false) {
+	switch (WideCode(c)) {
+		case InstructionCode::ICONST:
+		case InstructionCode::FCONST:
+		case InstructionCode::ILOAD:
+		case InstructionCode::FLOAD:
+			return { 0, 1 };
+		case InstructionCode::DUP:
+			return { 1, 2 };
+		case InstructionCode::ISTORE:
+		case InstructionCode::FSTORE:
+		case InstructionCode::POP:
+		case InstructionCode::IRET:
+		case InstructionCode::FRET:
+		case InstructionCode::IF:
+		case InstructionCode::WHILE:
+		case InstructionCode::FOR:
+		case InstructionCode::LOOP:
+			return { 1, 0 };
+		case InstructionCode::IADD:
+		case InstructionCode::FADD:
+		case InstructionCode::ISUB:
+		case InstructionCode::FSUB:
+		case InstructionCode::IMUL:
+		case InstructionCode::FMUL:
+		case InstructionCode::IDIV:
+		case InstructionCode::FDIV:
+		case InstructionCode::MOD:
+		case InstructionCode::IEQ:
+		case InstructionCode::ILE:
+		case InstructionCode::IGE:
+		case InstructionCode::FEQ:
+		case InstructionCode::FLE:
+		case InstructionCode::FGE:
+			return { 2, 1 };
+		case InstructionCode::FTOI:
+		case InstructionCode::ITOF:
+			return { 1, 1 };
+		case InstructionCode::FUNCTIONCALL:
+		case InstructionCode::MEMOCALL:
+		case InstructionCode::NATIVECALL:
+			return { static_cast<int>(params), returnsValue ? 1 : 0 };
+		case InstructionCode::TAILCALL:
+			return { static_cast<int>(params), 0 };
+		default:
+			return {};
+	}
+}
+
+// Layout of the program images the compiler writes and Program loads.
+// Little endian, the header is followed by its section table and every
+// section is found through an offset from the start of the image, 4 byte
+// aligned. Nothing needs fixing up, so a mapped file is used in place
+constexpr char imageMagic[4] = { 'C', 'B', 'I', 'M' };
+constexpr std::uint32_t imageVersion = 3;
+// Bumped whenever generated code changes, cached images are keyed by it
+constexpr std::uint32_t compilerVersion = 4;
+
+struct ImageHeader {
+	char magic[4];
+	std::uint32_t version;			// images of any other version are rejected
+	std::uint32_t sectionCount;		// ImageSection entries right after the header
+};
+enum class SectionKind : std::uint32_t {
+	STRINGS,	// zero terminated signatures
+	FUNCTIONS,	// ImageFunction per script function, FUNCTIONCALL operands index into it
+	NATIVES,	// STRINGS offset per host function, NATIVECALL operands index into it
+	CODE,		// function bodies back to back
+};
+struct ImageSection {
+	SectionKind kind;
+	std::uint32_t offset;
+	std::uint32_t size;
+};
+enum class ValueKind : std::uint32_t {
+	NONE,
+	INT,
+	FLOAT,
+};
+// Float literals evaluate to double, they are floats all the same
+inline ValueKind ValueKindOf(std::string_view type) {
+	if (type == "void") return ValueKind::NONE;
+	return type == "float" || type == "double" ? ValueKind::FLOAT : ValueKind::INT;
+}
+// Expressions without a type, like ++ and --, yield ints
+inline ValueKind ValueKindOf(const Type *type) {
+	return type ? ValueKindOf(type->name.value) : ValueKind::INT;
+}
+struct ImageFunction {
+	static constexpr std::uint32_t noCode = ~0u;	// codeOffset of functions declared without a body
+
+	std::uint32_t name;			// offset into STRINGS
+	std::uint32_t codeOffset;	// offset into CODE
+	std::uint32_t codeSize;
+	std::uint32_t arity;
+	std::uint32_t frameSize;	// local slots the body uses, checked by VerifyFunction
+	std::uint32_t maxStack;		// deepest the operand stack gets, checked by VerifyFunction
+	ValueKind returns;
+};
+static_assert(sizeof(ImageHeader) == 12 && sizeof(ImageSection) == 12 && sizeof(ImageFunction) == 28);
+
+// Checked view of an image, throws on anything out of bounds so the
+// accessors can trust it. Does not copy, image has to outlive it
+class ImageReader {
+	std::span<const char> strings, functions, natives, code;
+public:
+	explicit ImageReader(std::span<const char> image);
+
+	std::uint32_t FunctionCount() const { return static_cast<std::uint32_t>(functions.size() / sizeof(ImageFunction)); }
+	ImageFunction GetFunction(std::uint32_t idx) const;
+	// Null for functions declared without a body
+	const char *CodeOf(const ImageFunction &func) const;
+	std::uint32_t NativeCount() const { return static_cast<std::uint32_t>(natives.size() / sizeof(std::uint32_t)); }
+	std::string_view GetNative(std::uint32_t idx) const;
+	std::string_view GetString(std::uint32_t offset) const;
+};
+
+// Every field is part of the key of cached images, see ImageCache::Key
+struct CompileOptions {
+	bool inlining = true;
+	bool deadCodeElimination = true;
+	// Entry points the host calls, when set only functions they can reach
+	// through the call graph are emitted. Empty keeps every function
+	std::vector<std::string> roots;
+	std::uint32_t leafInlineBudget = 48;	// body bytes allowed for leaf functions
+	std::uint32_t inlineBudget = 256;		// body bytes allowed for functions marked inline
+	bool ssa = true;						// generate bodies through the SSA IR, see ir.h
+	std::uint32_t unrollFactor = 4;			// copies of small counted loop bodies, 1 disables
+	bool memoize = true;					// calls to pure functions that call or loop use MEMOCALL
+	bool compactOperands = true;			// short forms wherever operands fit, see ShortCode
+};
+
+// Holds all code generation state, one instance per compilation
+class Compiler {
+	using UnfinishedBreak = std::uint32_t;
+
+	Parser &parser;
+	CompileOptions options;
+	Scope *currScope = nullptr;
+	std::uint32_t varIdx = 0, currFuncIdx = 0;
+	ValueKind returns = ValueKind::NONE;	// of the function being generated, returned values are converted to it
+	std::stack<std::unordered_map<std::string, std::pair<std::uint32_t, VarDeclStmt *>>> vars;
+	std::stack<std::uint32_t> scopeVarIdx;
+
+	// Loop stuff
+	std::stack<std::uint32_t> loopBeginBytes;
+	std::stack<std::vector<UnfinishedBreak>> unfinishedBreaks;
+	std::stack<Statement *> postLoopStatements;
+
+	// Finished bodies, copied into callers by the inliner
+	std::unordered_map<const Function *, std::string> functionBodies;
+
+	// Slots of the current function that are written but never read
+	std::unordered_set<std::uint32_t> deadSlots;
+	// Functions to emit, every function when unset
+	std::optional<std::unordered_set<const Function *>> reachableFunctions;
+	// Functions proven pure so far, calls to them may be hoisted out of loops
+	std::unordered_set<const Function *> pureFunctions;
+	// Functions whose results only depend on their arguments and are worth caching
+	std::unordered_set<const Function *> memoizedFunctions;
+
+	// Locals die with their block, siblings reuse the same slots
+	void PushScope();
+	void PopScope();
+
+	std::uint32_t GetVariableIdx(const std::string &toFind);
+	VarDeclStmt *GetVariableStmt(std::uint32_t toFind);
+	std::uint32_t GetFunctionIdx(const Function *func);
+	bool IsEmitted(const Function *func) const;
+	void FindReachableFunctions(Statement &stmt);
+	void FindMemoizedFunctions(Statement &stmt);
+
+	void GenerateValueBytecode(std::ostream &out, ValueExpr &expr);
+	void GenerateBinaryBytecode(std::ostream &out, BinaryExpression &expr);
+	void GenerateUnaryBytecode(std::ostream &out, UnaryExpr &expr);
+	void GenerateCastBytecode(std::ostream &out, CastExpr &expr);
+	bool InlineCall(std::ostream &out, const Function &func);
+	void EmitCall(std::ostream &out, const Function &func, std::uint32_t params, bool tailCall);
+	void GenerateFunccallBytecode(std::ostream &out, FuncCallExpr &expr, bool tailCall = false);
+	void GenerateExprBytecode(std::ostream &out, Expression &expr);
+
+	void GenerateIfBytecode(std::ostream &out, IfStmt &stmt);
+	void GenerateWhileBytecode(std::ostream &out, WhileStmt &stmt);
+	void GenerateForBytecode(std::ostream &out, ForStmt &stmt);
+	void GenerateContinueBytecode(std::ostream &out, ContinueStmt &stmt);
+	void GenerateBreakBytecode(std::ostream &out, BreakStmt &stmt);
+	void GenerateBlockBytecode(std::ostream &out, BlockStmt &stmt);
+	void GenerateFuncBytecode(FuncDeclStmt &stmt);
+	void GenerateVarDeclBytecode(std::ostream &out, VarDeclStmt &stmt);
+	void GenerateVarAssignBytecode(std::ostream &out, VarAssignStmt &stmt);
+	void GenerateReturnBytecode(std::ostream &out, ReturnStmt &stmt);
+	void GenerateBytecode(std::ostream &out, Statement &stmt);
+	void WriteImage(std::ostream &out);
+public:
+	Compiler(Parser &parser, const CompileOptions &options = {});
+
+	void Compile(std::ostream &out, Statement &stmt);
+};
 
-void GenerateBytecode(std::ostream &out, Statement &stmt, Parser &parser);
-void PrintBytecode(std::istream &in);
\ No newline at end of file
+void GenerateBytecode(std::ostream &out, Statement &stmt, Parser &parser, const CompileOptions &options = {});
+void PrintBytecode(std::span<const char> image);
\ No newline at end of file
@@ -0,0 +1,677 @@
+#include "closure.h"
+#include "parser.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+namespace {
+	// Native stack a call from the host may use, deeper recursion fails
+	constexpr std::uintptr_t stackBudget = 1 << 20;
+	constexpr std::size_t maxInlineArgs = 8;
+
+	enum class Kind : std::uint8_t {
+		VOID,
+		INT,
+		FLOAT,
+	};
+	Kind KindOf(const std::string &type) {
+		if (type == "void") return Kind::VOID;
+		return type == "float" ? Kind::FLOAT : Kind::INT;
+	}
+	Kind KindOf(const Type *type) {
+		return type ? KindOf(type->name.value) : Kind::VOID;
+	}
+
+	// Only the tree knows which member a slot holds
+	union Slot {
+		int i;
+		float f;
+	};
+	template<typename T>
+	T &As(Slot &slot) {
+		if constexpr (std::is_same_v<T, int>) {
+			return slot.i;
+		}
+		else {
+			return slot.f;
+		}
+	}
+	inline int Wrap(std::int64_t value) {
+		return static_cast<int>(static_cast<std::uint32_t>(value));
+	}
+
+	// Locals of one call, small frames stay on the native stack
+	class Locals {
+		static constexpr std::size_t inlineSlots = 16;
+		Slot fixed[inlineSlots];
+		std::unique_ptr<Slot[]> heap;
+		std::size_t capacity = inlineSlots;
+	public:
+		Slot *data = fixed;
+
+		explicit Locals(std::size_t size) { Reserve(size); }
+		Locals(const Locals &) = delete;
+		Locals &operator=(const Locals &) = delete;
+
+		// Growing loses the contents
+		void Reserve(std::size_t size) {
+			if (size > capacity) {
+				heap = std::make_unique<Slot[]>(size);
+				data = heap.get();
+				capacity = size;
+			}
+		}
+	};
+
+	enum class Flow : std::uint8_t {
+		NEXT,
+		BREAK,
+		CONTINUE,
+		RETURN,
+		TAILCALL,	// the callee's arguments are in the locals already
+	};
+}
+
+struct ClosureFunction;
+
+namespace {
+	struct Frame {
+		Slot *locals = nullptr;
+		Locals *storage = nullptr;
+		std::uintptr_t stackLimit = 0;
+		Slot ret{};
+		const ClosureFunction *callee = nullptr;	// TAILCALL
+	};
+	template<typename T>
+	using Expr = std::function<T(Frame &)>;
+	using Step = std::function<Flow(Frame &)>;
+}
+
+struct ClosureFunction {
+	std::string signature;
+	std::vector<Kind> params;
+	Kind returns = Kind::VOID;
+	std::uint32_t frameSize = 0;
+	Step body;		// empty for prototypes that were never defined
+};
+
+namespace {
+	// Runs func with its arguments in the first locals, tail calls carry on
+	// in here. Returns the function that returned a value, null if none did
+	const ClosureFunction *Invoke(const ClosureFunction *func, Locals &locals, Slot &ret, std::uintptr_t stackLimit) {
+		char marker = 0;
+		if (reinterpret_cast<std::uintptr_t>(&marker) < stackLimit) {
+			throw std::string("Call stack overflow");
+		}
+
+		Frame frame{ locals.data, &locals, stackLimit };
+		while (true) {
+			if (!func->body) {
+				throw std::string("Call to undefined function");
+			}
+			switch (func->body(frame)) {
+				case Flow::TAILCALL:
+					func = frame.callee;
+					break;
+				case Flow::RETURN:
+					ret = frame.ret;
+					return func;
+				default:
+					return nullptr;
+			}
+		}
+	}
+
+	// Expression as built, the closure matching its kind is set
+	struct Value {
+		Kind kind = Kind::VOID;
+		Expr<int> i = {};		// INT, VOID ones only run for their effects
+		Expr<float> f = {};		// FLOAT
+		std::optional<std::uint32_t> local = std::nullopt;	// reads this local and nothing else
+		std::optional<Slot> constant = std::nullopt;
+
+		template<typename T>
+		Expr<T> Get() const {
+			if constexpr (std::is_same_v<T, int>) {
+				if (kind != Kind::FLOAT) return i;
+				return [f = f](Frame &frame) { return static_cast<int>(f(frame)); };
+			}
+			else {
+				if (kind == Kind::FLOAT) return f;
+				return [i = i](Frame &frame) { return static_cast<float>(i(frame)); };
+			}
+		}
+		template<typename T>
+		std::optional<T> Constant() const {
+			if (!constant) return std::nullopt;
+			return kind == Kind::FLOAT ? static_cast<T>(constant->f) : static_cast<T>(constant->i);
+		}
+		// Local that can be read in place as a T
+		template<typename T>
+		std::optional<std::uint32_t> Local() const {
+			return kind == (std::is_same_v<T, int> ? Kind::INT : Kind::FLOAT) ? local : std::nullopt;
+		}
+	};
+
+	// Argument converted to the parameter's kind, exactly one is set
+	struct Argument {
+		Expr<int> i;
+		Expr<float> f;
+	};
+	void FillArguments(const std::vector<Argument> &args, Frame &frame, Slot *out) {
+		for (std::size_t k = 0; k < args.size(); ++k) {
+			if (args[k].i) {
+				out[k].i = args[k].i(frame);
+			}
+			else {
+				out[k].f = args[k].f(frame);
+			}
+		}
+	}
+
+	// Picks a closure for where the operands come from, locals and
+	// constants are read in place instead of through another closure
+	template<typename R, typename T, typename Op>
+	Expr<R> Combine(const Value &lhs, const Value &rhs, Op op) {
+		if (auto a = lhs.Local<T>()) {
+			if (auto c = rhs.Constant<T>()) {
+				return [a = *a, c = *c, op](Frame &frame) -> R { return op(As<T>(frame.locals[a]), c); };
+			}
+			if (auto b = rhs.Local<T>()) {
+				return [a = *a, b = *b, op](Frame &frame) -> R { return op(As<T>(frame.locals[a]), As<T>(frame.locals[b])); };
+			}
+		}
+		if (auto c = rhs.Constant<T>()) {
+			return [l = lhs.Get<T>(), c = *c, op](Frame &frame) -> R { return op(l(frame), c); };
+		}
+		return [l = lhs.Get<T>(), r = rhs.Get<T>(), op](Frame &frame) -> R {
+			const auto a = l(frame);
+			return op(a, r(frame));
+		};
+	}
+
+	class Builder {
+		using Names = std::unordered_map<std::string, std::pair<std::uint32_t, Kind>>;
+
+		const Scope &global;
+		const NativeRegistry &natives;
+		const std::unordered_map<const Function *, ClosureFunction *> &functions;
+
+		// Function being built
+		ClosureFunction *current = nullptr;
+		std::vector<Names> names;
+		std::uint32_t nextSlot = 0;
+
+		std::pair<std::uint32_t, Kind> Lookup(const std::string &name) const {
+			for (auto it = names.rbegin(); it != names.rend(); ++it) {
+				if (auto found = it->find(name); found != it->end()) {
+					return found->second;
+				}
+			}
+			throw std::string("Unknown variable " + name);
+		}
+		std::uint32_t Declare(const std::string &name, Kind kind) {
+			const auto slot = nextSlot++;
+			current->frameSize = std::max(current->frameSize, nextSlot);
+			names.back()[name] = { slot, kind };
+			return slot;
+		}
+
+		std::vector<Argument> BuildArguments(const FuncCallExpr &expr, const std::vector<Kind> &params) {
+			std::vector<Argument> args;
+			for (std::size_t k = 0; k < expr.params.size(); ++k) {
+				auto arg = BuildExpr(*expr.params[k]);
+				if (k < params.size() && params[k] == Kind::FLOAT) {
+					args.push_back(Argument{ nullptr, arg.Get<float>() });
+				}
+				else {
+					args.push_back(Argument{ arg.Get<int>(), nullptr });
+				}
+			}
+			return args;
+		}
+		template<typename T>
+		static Expr<T> ScriptCall(const ClosureFunction *callee, std::vector<Argument> args) {
+			return [callee, args = std::move(args)](Frame &frame) -> T {
+				Locals locals(std::max<std::size_t>(callee->frameSize, args.size()));
+				FillArguments(args, frame, locals.data);
+				Slot ret{};
+				Invoke(callee, locals, ret, frame.stackLimit);
+				return As<T>(ret);
+			};
+		}
+		template<typename T>
+		static Expr<T> NativeCall(NativeFn fn, std::vector<Argument> args) {
+			return [fn, args = std::move(args)](Frame &frame) -> T {
+				std::array<VarType, maxInlineArgs> fixed;
+				std::vector<VarType> heap(args.size() > maxInlineArgs ? args.size() : 0);
+				auto *values = heap.empty() ? fixed.data() : heap.data();
+				for (std::size_t k = 0; k < args.size(); ++k) {
+					values[k] = args[k].i ? VarType{ args[k].i(frame) } : VarType{ args[k].f(frame) };
+				}
+				const auto ret = fn(values);
+				return std::visit([](auto value) { return static_cast<T>(value); }, ret);
+			};
+		}
+		Value BuildCall(const FuncCallExpr &expr) {
+			const auto *decl = global.FindFunc(expr.func);
+			Value value{ KindOf(decl->returnType) };
+
+			if (decl->native) {
+				const auto signature = decl->GenerateSignature();
+				const auto *native = natives.Find(signature);
+				if (!native) {
+					throw std::string("Unbound native function " + signature);
+				}
+
+				std::vector<Kind> params;
+				for (const auto &type : native->paramTypes) {
+					params.push_back(KindOf(type));
+				}
+				auto args = BuildArguments(expr, params);
+				if (value.kind == Kind::FLOAT) {
+					value.f = NativeCall<float>(native->fn, std::move(args));
+				}
+				else {
+					value.i = NativeCall<int>(native->fn, std::move(args));
+				}
+				return value;
+			}
+
+			const auto *callee = functions.at(decl);
+			auto args = BuildArguments(expr, callee->params);
+			if (value.kind == Kind::FLOAT) {
+				value.f = ScriptCall<float>(callee, std::move(args));
+			}
+			else {
+				value.i = ScriptCall<int>(callee, std::move(args));
+			}
+			return value;
+		}
+		Value BuildBinary(const BinaryExpression &expr) {
+			auto lhs = BuildExpr(*expr.lhs);
+			auto rhs = BuildExpr(*expr.rhs);
+			const bool floating = lhs.kind == Kind::FLOAT || rhs.kind == Kind::FLOAT;
+
+			// Integers wrap around like in the JIT tiers
+			Value value{ floating ? Kind::FLOAT : Kind::INT };
+			auto arithmetic = [&](auto intOp, auto floatOp) {
+				if (floating) {
+					value.f = Combine<float, float>(lhs, rhs, floatOp);
+				}
+				else {
+					value.i = Combine<int, int>(lhs, rhs, intOp);
+				}
+				return value;
+			};
+			auto compare = [&](auto op) {
+				value.kind = Kind::INT;
+				value.i = floating ? Combine<int, float>(lhs, rhs, op) : Combine<int, int>(lhs, rhs, op);
+				return value;
+			};
+			switch (expr.op.type) {
+				case TokenType::PLUS:
+					return arithmetic([](int a, int b) { return Wrap(static_cast<std::int64_t>(a) + b); }, std::plus<float>{});
+				case TokenType::MINUS:
+					return arithmetic([](int a, int b) { return Wrap(static_cast<std::int64_t>(a) - b); }, std::minus<float>{});
+				case TokenType::STAR:
+					return arithmetic([](int a, int b) { return Wrap(static_cast<std::int64_t>(a) * b); }, std::multiplies<float>{});
+				case TokenType::SLASH:
+					return arithmetic([](int a, int b) { return a / b; }, std::divides<float>{});
+				case TokenType::PERCENT:
+					value.kind = Kind::INT;
+					value.i = Combine<int, int>(lhs, rhs, [](int a, int b) { return a % b; });
+					return value;
+				case TokenType::EQUALS:
+					return compare([](auto a, auto b) -> int { return a == b; });
+				case TokenType::LESS:
+					return compare([](auto a, auto b) -> int { return a < b; });
+				case TokenType::GREATER:
+					return compare([](auto a, auto b) -> int { return a > b; });
+				default:
+					throw std::string("Unsupported operator " + expr.op.value);
+			}
+		}
+		Value BuildExpr(const Expression &expr) {
+			switch (expr.type) {
+				case ExpressionType::VALUE: {
+					const auto &val = static_cast<const ValueExpr &>(expr).val;
+					Value value;
+					if (val.type == TokenType::INTEGER) {
+						const int c = std::stoi(val.value);
+						value.kind = Kind::INT;
+						value.constant = Slot{ .i = c };
+						value.i = [c](Frame &) { return c; };
+					}
+					else if (val.type == TokenType::FLOAT) {
+						const float c = std::stof(val.value);
+						value.kind = Kind::FLOAT;
+						value.constant = Slot{ .f = c };
+						value.f = [c](Frame &) { return c; };
+					}
+					else {
+						const auto [slot, kind] = Lookup(val.value);
+						value.kind = kind;
+						value.local = slot;
+						if (kind == Kind::FLOAT) {
+							value.f = [slot](Frame &frame) { return frame.locals[slot].f; };
+						}
+						else {
+							value.i = [slot](Frame &frame) { return frame.locals[slot].i; };
+						}
+					}
+					return value;
+				}
+				case ExpressionType::BINARY:
+					return BuildBinary(static_cast<const BinaryExpression &>(expr));
+				case ExpressionType::UNARY: {
+					// Stores back into the variable, yields the old value
+					const auto &unary = static_cast<const UnaryExpr &>(expr);
+					const auto slot = Lookup(unary.expr->val.value).first;
+					const int step = unary.op.type == TokenType::INCREMENT ? 1 : -1;
+					Value value{ Kind::INT };
+					value.i = [slot, step](Frame &frame) {
+						const int old = frame.locals[slot].i;
+						frame.locals[slot].i = Wrap(static_cast<std::int64_t>(old) + step);
+						return old;
+					};
+					return value;
+				}
+				case ExpressionType::CAST: {
+					const auto &cast = static_cast<const CastExpr &>(expr);
+					auto inner = BuildExpr(*cast.expr);
+					if (cast.finalType == cast.origType) {
+						return inner;
+					}
+					Value value{ KindOf(cast.finalType) };
+					if (value.kind == Kind::FLOAT) {
+						value.f = inner.Get<float>();
+					}
+					else {
+						value.i = inner.Get<int>();
+					}
+					return value;
+				}
+				case ExpressionType::FUNCCALL:
+					return BuildCall(static_cast<const FuncCallExpr &>(expr));
+				default:
+					throw std::string("Unsupported expression");
+			}
+		}
+		// Conditions only need to be tested against zero
+		Expr<int> BuildCondition(const Expression &expr) {
+			auto value = BuildExpr(expr);
+			if (value.kind != Kind::FLOAT) {
+				return value.i;
+			}
+			return [f = value.f](Frame &frame) -> int { return f(frame) != 0; };
+		}
+
+		Step BuildStore(std::uint32_t slot, Kind kind, const Value &value) {
+			if (kind == Kind::FLOAT) {
+				if (auto c = value.Constant<float>()) {
+					return [slot, c = *c](Frame &frame) { frame.locals[slot].f = c; return Flow::NEXT; };
+				}
+				return [slot, v = value.Get<float>()](Frame &frame) { frame.locals[slot].f = v(frame); return Flow::NEXT; };
+			}
+			if (auto c = value.Constant<int>()) {
+				return [slot, c = *c](Frame &frame) { frame.locals[slot].i = c; return Flow::NEXT; };
+			}
+			return [slot, v = value.Get<int>()](Frame &frame) { frame.locals[slot].i = v(frame); return Flow::NEXT; };
+		}
+		// Locals declared in a branch or loop body die with it, siblings reuse their slots
+		Step BuildScoped(const Statement &stmt) {
+			names.emplace_back();
+			const auto outerSlot = nextSlot;
+			auto step = BuildStep(stmt);
+			nextSlot = outerSlot;
+			names.pop_back();
+			return step;
+		}
+		Step BuildBlock(const BlockStmt &stmt) {
+			std::vector<Step> steps;
+			for (const auto &child : stmt.stmts) {
+				steps.push_back(BuildStep(*child));
+			}
+			if (steps.size() == 1) {
+				return std::move(steps.front());
+			}
+			return [steps = std::move(steps)](Frame &frame) {
+				for (const auto &step : steps) {
+					if (auto flow = step(frame); flow != Flow::NEXT) {
+						return flow;
+					}
+				}
+				return Flow::NEXT;
+			};
+		}
+		Step BuildReturn(const ReturnStmt &stmt) {
+			// A returned script call replaces this frame, unless its result needs converting
+			if (stmt.ret->type == ExpressionType::FUNCCALL) {
+				const auto &call = static_cast<const FuncCallExpr &>(*stmt.ret);
+				const auto *decl = global.FindFunc(call.func);
+				const auto kind = KindOf(decl->returnType);
+				if (!decl->native && (kind == current->returns || kind == Kind::VOID || current->returns == Kind::VOID)) {
+					const auto *callee = functions.at(decl);
+					return [callee, args = BuildArguments(call, callee->params)](Frame &frame) {
+						// Arguments may read the locals they replace
+						Locals values(args.size());
+						FillArguments(args, frame, values.data);
+						frame.storage->Reserve(std::max<std::size_t>(callee->frameSize, args.size()));
+						frame.locals = frame.storage->data;
+						std::copy_n(values.data, args.size(), frame.locals);
+						frame.callee = callee;
+						return Flow::TAILCALL;
+					};
+				}
+			}
+
+			auto value = BuildExpr(*stmt.ret);
+			if (current->returns == Kind::FLOAT) {
+				return [v = value.Get<float>()](Frame &frame) { frame.ret.f = v(frame); return Flow::RETURN; };
+			}
+			return [v = value.Get<int>()](Frame &frame) { frame.ret.i = v(frame); return Flow::RETURN; };
+		}
+		Step BuildStep(const Statement &stmt) {
+			switch (stmt.type) {
+				case StatementType::BLOCK: {
+					names.emplace_back();
+					const auto outerSlot = nextSlot;
+					auto step = BuildBlock(static_cast<const BlockStmt &>(stmt));
+					nextSlot = outerSlot;
+					names.pop_back();
+					return step;
+				}
+				case StatementType::VARDECL: {
+					const auto &decl = static_cast<const VarDeclStmt &>(stmt);
+					const auto kind = KindOf(decl.var.type);
+					Value value{ Kind::INT, [](Frame &) { return 0; } };
+					value.constant = Slot{ .i = 0 };
+					if (decl.expr) {
+						value = BuildExpr(*decl.expr);
+					}
+					return BuildStore(Declare(decl.var.name.value, kind), kind, value);
+				}
+				case StatementType::VARASSIGN: {
+					const auto &assign = static_cast<const VarAssignStmt &>(stmt);
+					const auto [slot, kind] = Lookup(assign.name.value);
+					return BuildStore(slot, kind, BuildExpr(*assign.val));
+				}
+				case StatementType::IF: {
+					const auto &branch = static_cast<const IfStmt &>(stmt);
+					auto cond = BuildCondition(*branch.condition);
+					auto then = BuildScoped(*branch.then);
+					if (!branch.els) {
+						return [cond, then](Frame &frame) { return cond(frame) ? then(frame) : Flow::NEXT; };
+					}
+					auto els = BuildScoped(*branch.els);
+					return [cond, then, els](Frame &frame) { return cond(frame) ? then(frame) : els(frame); };
+				}
+				case StatementType::WHILE: {
+					const auto &loop = static_cast<const WhileStmt &>(stmt);
+					auto cond = BuildCondition(*loop.condition);
+					auto body = BuildScoped(*loop.then);
+					return [cond, body](Frame &frame) {
+						while (cond(frame)) {
+							const auto flow = body(frame);
+							if (flow == Flow::BREAK) break;
+							if (flow == Flow::RETURN || flow == Flow::TAILCALL) return flow;
+						}
+						return Flow::NEXT;
+					};
+				}
+				case StatementType::FOR: {
+					const auto &loop = static_cast<const ForStmt &>(stmt);
+					names.emplace_back();
+					const auto outerSlot = nextSlot;
+					auto init = BuildStep(*loop.initial);
+					auto cond = BuildCondition(*loop.condition);
+					auto body = BuildScoped(*loop.then);
+					auto post = BuildStep(*loop.postLoop);
+					nextSlot = outerSlot;
+					names.pop_back();
+
+					return [init, cond, body, post](Frame &frame) {
+						init(frame);
+						while (cond(frame)) {
+							const auto flow = body(frame);
+							if (flow == Flow::BREAK) break;
+							if (flow == Flow::RETURN || flow == Flow::TAILCALL) return flow;
+							post(frame);
+						}
+						return Flow::NEXT;
+					};
+				}
+				case StatementType::BREAK:
+					return [](Frame &) { return Flow::BREAK; };
+				case StatementType::CONTINUE:
+					return [](Frame &) { return Flow::CONTINUE; };
+				case StatementType::EXPRSTMT: {
+					const auto &expr = *static_cast<const ExpressionStmt &>(stmt).expr;
+					if (expr.type == ExpressionType::UNARY) {
+						// Nobody reads the old value
+						const auto &unary = static_cast<const UnaryExpr &>(expr);
+						const auto slot = Lookup(unary.expr->val.value).first;
+						const int step = unary.op.type == TokenType::INCREMENT ? 1 : -1;
+						return [slot, step](Frame &frame) {
+							frame.locals[slot].i = Wrap(static_cast<std::int64_t>(frame.locals[slot].i) + step);
+							return Flow::NEXT;
+						};
+					}
+					auto value = BuildExpr(expr);
+					if (value.kind == Kind::FLOAT) {
+						return [f = value.f](Frame &frame) { f(frame); return Flow::NEXT; };
+					}
+					return [i = value.i](Frame &frame) { i(frame); return Flow::NEXT; };
+				}
+				case StatementType::RETURN:
+					return BuildReturn(static_cast<const ReturnStmt &>(stmt));
+				default:
+					return [](Frame &) { return Flow::NEXT; };
+			}
+		}
+	public:
+		Builder(const Scope &global, const NativeRegistry &natives, const std::unordered_map<const Function *, ClosureFunction *> &functions)
+			: global(global), natives(natives), functions(functions) {}
+
+		void Build(ClosureFunction &func, const FuncDeclStmt &stmt) {
+			current = &func;
+			names.assign(1, Names{});
+			nextSlot = 0;
+			for (const auto &param : stmt.params) {
+				Declare(param->var.name.value, KindOf(param->var.type));
+			}
+			func.body = BuildScoped(*stmt.definition);
+		}
+	};
+}
+
+ClosureProgram::ClosureProgram(const Parser &parser, const NativeRegistry &natives) {
+	const auto &global = parser.GetGlobalScope();
+
+	// Everything is declared first so calls can point at functions defined further down
+	std::unordered_map<const Function *, ClosureFunction *> byDecl;
+	for (const auto &func : global.funcs) {
+		if (func->native) continue;
+
+		auto compiled = std::make_unique<ClosureFunction>();
+		compiled->signature = func->GenerateSignature();
+		for (const auto &param : func->params) {
+			compiled->params.push_back(KindOf(param.type));
+		}
+		compiled->returns = KindOf(func->returnType);
+		compiled->frameSize = static_cast<std::uint32_t>(func->params.size());
+
+		functionIndices.emplace(compiled->signature, static_cast<std::uint32_t>(functions.size()));
+		byDecl[func.get()] = compiled.get();
+		functions.push_back(std::move(compiled));
+	}
+
+	Builder builder{ global, natives, byDecl };
+	for (const auto &stmt : global.block.stmts) {
+		if (stmt->type != StatementType::FUNCDECL) continue;
+
+		const auto &decl = static_cast<const FuncDeclStmt &>(*stmt);
+		if (decl.definition) {
+			builder.Build(*byDecl.at(global.FindFunc(decl.name)), decl);
+		}
+	}
+}
+ClosureProgram::~ClosureProgram() = default;
+
+std::optional<FunctionHandle> ClosureProgram::Lookup(const std::string &signature) const {
+	auto it = functionIndices.find(signature);
+	if (it != functionIndices.end()) {
+		return FunctionHandle{ it->second, static_cast<std::uint32_t>(functions[it->second]->params.size()) };
+	}
+
+	// A bare name matches the first function declared with it
+	if (signature.find('(') == std::string::npos) {
+		for (std::uint32_t i = 0; i < functions.size(); ++i) {
+			if (functions[i]->signature.starts_with(signature + '(')) {
+				return FunctionHandle{ i, static_cast<std::uint32_t>(functions[i]->params.size()) };
+			}
+		}
+	}
+	return std::nullopt;
+}
+const std::string &ClosureProgram::GetSignature(FunctionHandle func) const {
+	return functions[func.idx]->signature;
+}
+
+std::optional<VarType> ClosureProgram::Call(FunctionHandle func, std::span<const VarType> args) const {
+	if (func.idx >= functions.size() || !functions[func.idx]->body) {
+		throw std::string("Call to undefined function");
+	}
+	const auto &entry = *functions[func.idx];
+	if (args.size() != entry.params.size()) {
+		throw std::string("Wrong number of arguments for " + entry.signature);
+	}
+
+	Locals locals(std::max<std::size_t>(entry.frameSize, args.size()));
+	for (std::size_t k = 0; k < args.size(); ++k) {
+		if (entry.params[k] == Kind::FLOAT) {
+			locals.data[k].f = std::visit([](auto value) { return static_cast<float>(value); }, args[k]);
+		}
+		else {
+			locals.data[k].i = std::visit([](auto value) { return static_cast<int>(value); }, args[k]);
+		}
+	}
+
+	char marker = 0;
+	const auto sp = reinterpret_cast<std::uintptr_t>(&marker);
+	Slot ret{};
+	const auto *returned = Invoke(&entry, locals, ret, sp > stackBudget ? sp - stackBudget : 0);
+	if (!returned || returned->returns == Kind::VOID) {
+		return std::nullopt;
+	}
+	return returned->returns == Kind::FLOAT ? VarType{ ret.f } : VarType{ ret.i };
+}
+std::optional<VarType> ClosureProgram::Run(const std::string &func, std::span<const VarType> args) const {
+	auto handle = Lookup(func);
+	if (!handle) return std::nullopt;
+
+	return Call(handle.value(), args);
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "interpreter.h"
+
+class Parser;
+struct ClosureFunction;
+
+// Runs scripts straight from the syntax tree, no bytecode is generated.
+// Every function is built once into a tree of closures with the locals
+// resolved to slots and every operation picked for its operand types, so
+// nothing is decoded or type checked while running. Meant for short
+// scripts where writing and loading an image costs more than running it.
+// Immutable once built, any number of threads can call into one instance.
+// Recursion runs on the native stack and is bounded by it.
+class ClosureProgram {
+	// Same order as the FUNCTIONS section of a program image
+	std::vector<std::unique_ptr<ClosureFunction>> functions;
+	std::unordered_map<std::string, std::uint32_t> functionIndices;
+public:
+	// Every native the parsed code calls has to be in natives
+	ClosureProgram(const Parser &parser, const NativeRegistry &natives = {});
+	ClosureProgram(const ClosureProgram &) = delete;
+	ClosureProgram &operator=(const ClosureProgram &) = delete;
+	~ClosureProgram();
+
+	// Accepts a full signature like "foo(int)" or just the name "foo"
+	std::optional<FunctionHandle> Lookup(const std::string &signature) const;
+	const std::string &GetSignature(FunctionHandle func) const;
+
+	// Runs func to completion, args become its first locals
+	std::optional<VarType> Call(FunctionHandle func, std::span<const VarType> args = {}) const;
+	std::optional<VarType> Run(const std::string &func, std::span<const VarType> args = {}) const;
+};
\ No newline at end of file
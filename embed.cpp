@@ -0,0 +1,43 @@
+#include "embed.h"
+#include <sstream>
+
+namespace {
+	std::string GenerateImage(std::string_view source, const NativeRegistry &natives, const CompileOptions &options) {
+		Parser parser{ source };
+		for (const auto &native : natives.GetFunctions()) {
+			parser.DeclareNative(native.name, native.returnType, native.paramTypes);
+		}
+		parser.Parse();
+
+		std::stringstream out;
+		GenerateBytecode(out, parser.GetGlobalScope().block, parser, options);
+		return out.str();
+	}
+}
+
+std::shared_ptr<const Program> Compile(std::string_view source) {
+	return Compile(source, NativeRegistry{});
+}
+std::shared_ptr<const Program> Compile(std::string_view source, const NativeRegistry &natives, const CompileOptions &options) {
+	const auto image = GenerateImage(source, natives, options);
+	return std::make_shared<const Program>(std::vector<char>(image.begin(), image.end()), &natives);
+}
+std::shared_ptr<const Program> CompileCached(std::string_view source, const ImageCache &cache, const NativeRegistry &natives, const CompileOptions &options) {
+	const auto key = ImageCache::Key(source, natives, options);
+	if (auto program = cache.Load(key, &natives)) {
+		return program;
+	}
+
+	// A cache that can not be written only costs the next start a compile
+	const auto image = GenerateImage(source, natives, options);
+	cache.Store(key, image);
+	return std::make_shared<const Program>(std::vector<char>(image.begin(), image.end()), &natives);
+}
+std::shared_ptr<const ClosureProgram> CompileClosures(std::string_view source, const NativeRegistry &natives) {
+	Parser parser{ source };
+	for (const auto &native : natives.GetFunctions()) {
+		parser.DeclareNative(native.name, native.returnType, native.paramTypes);
+	}
+	parser.Parse();
+	return std::make_shared<const ClosureProgram>(parser, natives);
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+#include "interpreter.h"
+#include "closure.h"
+#include "imagecache.h"
+
+// Host facing API, compile once and call as often as needed:
+//
+//	auto program = Compile(source);
+//	auto func = program->Lookup("foo");
+//	VM vm{ program };
+//	Value args[] = { 1, 2.0f };
+//	auto ret = vm.Call(*func, args);
+//
+// A Program can be shared between threads, a VM can not.
+using Value = VarType;
+
+std::shared_ptr<const Program> Compile(std::string_view source);
+// Scripts may call every function in natives, the program keeps its own
+// copy of the bindings so the registry does not have to outlive it.
+// Setting options.roots keeps only the functions those entry points reach
+std::shared_ptr<const Program> Compile(std::string_view source, const NativeRegistry &natives, const CompileOptions &options = {});
+// Same as Compile, but a script cache already holds is only mapped and
+// a missing one is compiled and stored for the next start
+std::shared_ptr<const Program> CompileCached(std::string_view source, const ImageCache &cache, const NativeRegistry &natives = {}, const CompileOptions &options = {});
+// Same without any bytecode, the program runs on closures built from the
+// syntax tree, see closure.h
+std::shared_ptr<const ClosureProgram> CompileClosures(std::string_view source, const NativeRegistry &natives = {});
\ No newline at end of file
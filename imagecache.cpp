@@ -0,0 +1,220 @@
+#include "imagecache.h"
+#include <atomic>
+#include <fstream>
+#include <random>
+
+#if defined(__unix__)
+#define IMAGE_CACHE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	// FIPS 180-4, just what keys need
+	class Sha256 {
+		static constexpr std::uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+		std::uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+		std::uint8_t block[64] = {};
+		std::size_t used = 0;
+		std::uint64_t length = 0;
+
+		static std::uint32_t Rotr(std::uint32_t x, int n) {
+			return (x >> n) | (x << (32 - n));
+		}
+		void Compress() {
+			std::uint32_t w[64];
+			for (int i = 0; i < 16; ++i) {
+				w[i] = std::uint32_t{ block[i * 4] } << 24 | std::uint32_t{ block[i * 4 + 1] } << 16 | std::uint32_t{ block[i * 4 + 2] } << 8 | block[i * 4 + 3];
+			}
+			for (int i = 16; i < 64; ++i) {
+				const auto s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+				const auto s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+				w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+			}
+
+			auto [a, b, c, d, e, f, g, h] = state;
+			for (int i = 0; i < 64; ++i) {
+				const auto t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+				const auto t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				h = g; g = f; f = e; e = d + t1;
+				d = c; c = b; b = a; a = t1 + t2;
+			}
+			const std::uint32_t result[8] = { a, b, c, d, e, f, g, h };
+			for (int i = 0; i < 8; ++i) {
+				state[i] += result[i];
+			}
+		}
+	public:
+		void Update(const void *data, std::size_t size) {
+			const auto *bytes = static_cast<const std::uint8_t *>(data);
+			length += size;
+			for (std::size_t i = 0; i < size; ++i) {
+				block[used++] = bytes[i];
+				if (used == sizeof(block)) {
+					Compress();
+					used = 0;
+				}
+			}
+		}
+		std::string HexDigest() {
+			const std::uint64_t bits = length * 8;
+			const std::uint8_t one = 0x80, zero = 0;
+			Update(&one, 1);
+			while (used != 56) {
+				Update(&zero, 1);
+			}
+			std::uint8_t lengthBytes[8];
+			for (int i = 0; i < 8; ++i) {
+				lengthBytes[i] = static_cast<std::uint8_t>(bits >> (56 - i * 8));
+			}
+			Update(lengthBytes, sizeof(lengthBytes));
+
+			static constexpr char digits[] = "0123456789abcdef";
+			std::string hex;
+			for (auto word : state) {
+				for (int shift = 28; shift >= 0; shift -= 4) {
+					hex += digits[(word >> shift) & 0xF];
+				}
+			}
+			return hex;
+		}
+	};
+
+	// Whole file, read only. Mapped where there is mmap, read into memory
+	// elsewhere. Empty when the file can not be opened
+	class MappedFile {
+		const char *bytes = nullptr;
+		std::size_t size = 0;
+		std::vector<char> buffer;
+	public:
+		explicit MappedFile(const std::filesystem::path &path) {
+#ifdef IMAGE_CACHE_MMAP
+			const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				return;
+			}
+			struct stat info {};
+			if (fstat(fd, &info) == 0 && info.st_size > 0) {
+				void *mapped = mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapped != MAP_FAILED) {
+					bytes = static_cast<const char *>(mapped);
+					size = static_cast<std::size_t>(info.st_size);
+				}
+			}
+			// The mapping outlives the descriptor
+			close(fd);
+#else
+			std::ifstream in(path, std::ios::binary);
+			if (in.is_open()) {
+				buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+				bytes = buffer.data();
+				size = buffer.size();
+			}
+#endif
+		}
+		MappedFile(const MappedFile &) = delete;
+		MappedFile &operator=(const MappedFile &) = delete;
+		~MappedFile() {
+#ifdef IMAGE_CACHE_MMAP
+			if (bytes) {
+				munmap(const_cast<char *>(bytes), size);
+			}
+#endif
+		}
+
+		std::span<const char> Bytes() const {
+			return { bytes, size };
+		}
+	};
+}
+
+ImageCache::ImageCache(std::filesystem::path dir) : dir(std::move(dir)) {}
+
+std::string ImageCache::Key(std::string_view source, const NativeRegistry &natives, const CompileOptions &options) {
+	Sha256 hash;
+	// Strings go in with their length, so no two inputs hash the same bytes
+	auto addString = [&](std::string_view str) {
+		const std::uint64_t size = str.size();
+		hash.Update(&size, sizeof(size));
+		hash.Update(str.data(), str.size());
+	};
+	auto addNumber = [&](std::uint32_t value) {
+		hash.Update(&value, sizeof(value));
+	};
+
+	addNumber(imageVersion);
+	addNumber(compilerVersion);
+	addString(source);
+
+	addNumber(options.inlining);
+	addNumber(options.deadCodeElimination);
+	addNumber(static_cast<std::uint32_t>(options.roots.size()));
+	for (const auto &root : options.roots) {
+		addString(root);
+	}
+	addNumber(options.leafInlineBudget);
+	addNumber(options.inlineBudget);
+	addNumber(options.ssa);
+	addNumber(options.unrollFactor);
+	addNumber(options.memoize);
+	addNumber(options.compactOperands);
+
+	// Natives change how scripts parse, their bindings do not matter
+	addNumber(static_cast<std::uint32_t>(natives.GetFunctions().size()));
+	for (const auto &native : natives.GetFunctions()) {
+		addString(native.returnType);
+		addString(native.GenerateSignature());
+	}
+	return hash.HexDigest();
+}
+
+std::shared_ptr<const Program> ImageCache::Load(const std::string &key, const NativeRegistry *registry) const {
+	auto file = std::make_shared<const MappedFile>(dir / (key + ".img"));
+	const auto bytes = file->Bytes();
+	if (bytes.empty()) {
+		return nullptr;
+	}
+
+	try {
+		return std::make_shared<const Program>(bytes, std::move(file), registry);
+	}
+	catch (const std::string &) {
+		return nullptr;
+	}
+}
+
+bool ImageCache::Store(const std::string &key, std::string_view image) const {
+	std::error_code error;
+	std::filesystem::create_directories(dir, error);
+
+	// Unique per process and call, racing writers never share a file
+	static std::atomic<std::uint64_t> stores = 0;
+	const auto temp = dir / (key + '.' + std::to_string(std::random_device{}()) + '-' + std::to_string(stores++) + ".tmp");
+	{
+		std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+		out.write(image.data(), static_cast<std::streamsize>(image.size()));
+		if (!out.flush()) {
+			out.close();
+			std::filesystem::remove(temp, error);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(temp, dir / (key + ".img"), error);
+	if (error) {
+		std::filesystem::remove(temp, error);
+		return false;
+	}
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "interpreter.h"
+
+// Compiled images on disk, one file per key in a directory that any
+// number of processes can share. Keys hash everything the image depends
+// on, so entries never go stale, a changed script or compiler just gets a
+// new key. Entries are mapped instead of read where the platform allows.
+class ImageCache {
+	std::filesystem::path dir;
+public:
+	explicit ImageCache(std::filesystem::path dir);
+
+	// SHA-256 of source, both versions in bytecode.h, options and natives, in hex
+	static std::string Key(std::string_view source, const NativeRegistry &natives, const CompileOptions &options);
+
+	// Null on a miss, damaged entries count as one
+	std::shared_ptr<const Program> Load(const std::string &key, const NativeRegistry *registry = nullptr) const;
+	// Written under a temporary name and renamed, concurrent starts never
+	// see half an entry. False when the directory is not writable
+	bool Store(const std::string &key, std::string_view image) const;
+};
\ No newline at end of file
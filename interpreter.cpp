@@ -1,73 +1,210 @@
 #include "interpreter.h"
-#include <stack>
-#include <vector>
-#include <deque>
-#include <unordered_map>
-
-namespace {
-	using VarType = std::variant<int, float>;
-	std::stack<VarType> stack;
-	std::stack<std::deque<VarType>> vars;
-	std::vector<std::string> functionDecls;
-
-	class CustomIStream {
-	private:
-		std::vector<std::byte> bytes;
-		decltype(bytes)::size_type *readIdx;
-	public:
-		CustomIStream(std::vector<std::byte> &&inArr, decltype(bytes)::size_type *idxVar = nullptr) : bytes{ inArr }, readIdx{ idxVar } {}
-
-		template<typename T>
-		void read(T &toModify, std::size_t size = sizeof(T)) {
-			std::memcpy(&toModify, bytes.data() + *readIdx, size);
-			*readIdx += size;
-		}
-		int get() {
-			*readIdx = *readIdx + 1;
-			return eof() ? EOF : static_cast<int>(bytes[*readIdx - 1]);
-		}
-		int peek() const {
-			return eof() ? EOF : static_cast<int>(bytes[*readIdx]);
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include "verifier.h"
+
+std::size_t MemoCache::Index(std::span<const VarType> args) const {
+	std::uint64_t hash = 0;
+	for (const auto &arg : args) {
+		const std::uint64_t bits = std::holds_alternative<int>(arg) ?
+			static_cast<std::uint32_t>(std::get<int>(arg)) :
+			std::bit_cast<std::uint32_t>(std::get<float>(arg)) | std::uint64_t{ 1 } << 32;
+		hash = (hash ^ bits) * 0x9E3779B97F4A7C15ull;
+	}
+	return static_cast<std::size_t>(hash >> (64 - capacityBits));
+}
+const VarType *MemoCache::Find(std::span<const VarType> args) {
+	if (!entries.empty()) {
+		const auto idx = Index(args);
+		const auto *entry = entries.data() + idx * (args.size() + 1);
+		if (used[idx] && std::equal(args.begin(), args.end(), entry)) {
+			++hits;
+			return entry + args.size();
 		}
-		void reset() {
-			*readIdx = 0;
+	}
+	++misses;
+	return nullptr;
+}
+void MemoCache::Insert(std::span<const VarType> args, const VarType &result) {
+	if (entries.empty()) {
+		entries.resize(capacity * (args.size() + 1));
+		used.resize(capacity);
+	}
+	const auto idx = Index(args);
+	auto *entry = entries.data() + idx * (args.size() + 1);
+	std::copy(args.begin(), args.end(), entry);
+	entry[args.size()] = result;
+	used[idx] = true;
+}
+
+VM::VM(std::shared_ptr<const Program> program, JitMode jitMode) : program(std::move(program)), memo(this->program->FunctionCount()) {
+	SetJitMode(jitMode);
+}
+
+void VM::SetJitMode(JitMode mode, std::uint32_t threshold) {
+	jit.reset();
+	tracer.reset();
+	if (JitAvailable(mode)) {
+		jit = std::make_unique<Jit>(*this, *program, mode, threshold);
+	}
+	if (mode == JitMode::BASELINE && JitAvailable(mode)) {
+		tracer = std::make_unique<Tracer>(*this, *program);
+	}
+}
+
+std::optional<VarType> VM::Run(const std::string &func, std::span<const VarType> args) {
+	auto handle = program->Lookup(func);
+	if (!handle) return std::nullopt;
+
+	return Call(handle.value(), args);
+}
+
+std::optional<VarType> VM::Call(FunctionHandle func, std::span<const VarType> args) {
+	const auto *entry = program->GetFunction(func.idx);
+	if (!entry) {
+		throw std::string("Call to undefined function");
+	}
+	if (args.size() != entry->arity) {
+		throw std::string("Wrong number of arguments for " + program->GetSignature(func));
+	}
+	if (std::optional<VarType> ret; jit && jit->TryCall(func.idx, args, ret)) {
+		return ret;
+	}
+
+	const auto entryDepth = frames.size();
+	const auto entryVars = vars.size();
+	const auto entryStack = stack.size();
+	const auto entryMemoArgs = memoArgs.size();
+	frames.push_back(Frame{ CustomIStream{ *entry }, vars.size(), stack.size() });
+	vars.insert(vars.end(), args.begin(), args.end());
+	ReserveFrame(*entry);
+
+	try {
+		return Execute(entryDepth);
+	}
+	catch (...) {
+		// Leave the VM reusable after a failed run
+		if (tracer) {
+			tracer->Abort();
 		}
-		bool eof() const {
-			return *readIdx >= bytes.size();
+		frames.resize(entryDepth);
+		vars.resize(entryVars);
+		stack.resize(entryStack);
+		memoArgs.resize(entryMemoArgs);
+		throw;
+	}
+}
+// Verified sizes let a frame get all of its room when it is entered,
+// handlers never grow vars or the stack
+void VM::ReserveFrame(const Program::FunctionCode &func) {
+	const auto &frame = frames.back();
+	vars.resize(frame.base + func.frameSize);
+	if (const auto needed = frame.stackBase + func.maxStack; stack.capacity() < needed) {
+		stack.reserve(std::max(needed, stack.capacity() * 2));
+	}
+}
+std::optional<VarType> VM::CallMemoized(FunctionHandle func, std::span<const VarType> args) {
+	auto &cache = memo.at(func.idx);
+	if (const auto *hit = cache.Find(args)) {
+		return *hit;
+	}
+
+	// The key is copied first, compiled callers reuse their argument buffers
+	const auto mark = memoArgs.size();
+	memoArgs.insert(memoArgs.end(), args.begin(), args.end());
+	std::optional<VarType> ret;
+	try {
+		ret = Call(func, args);
+	}
+	catch (...) {
+		memoArgs.resize(mark);
+		throw;
+	}
+	if (ret) {
+		cache.Insert(std::span(memoArgs).subspan(mark), ret.value());
+	}
+	memoArgs.resize(mark);
+	return ret;
+}
+MemoStats VM::GetMemoStats(FunctionHandle func) const {
+	const auto &cache = memo.at(func.idx);
+	return MemoStats{ cache.hits, cache.misses };
+}
+
+std::optional<VarType> VM::Execute(std::size_t entryDepth) {
+	CustomIStream in = frames.back().code;
+	std::size_t base = frames.back().base;
+
+	// Pops the current frame, true once the entry function itself returned
+	std::optional<VarType> retVal;
+	auto leaveFrame = [&](std::optional<VarType> ret) {
+		Frame frame = frames.back();
+		frames.pop_back();
+		if (frame.memoFunc != noMemo) {
+			const auto arity = program->GetFunction(frame.memoFunc)->arity;
+			if (ret) {
+				memo[frame.memoFunc].Insert(std::span(memoArgs).last(arity), ret.value());
+			}
+			memoArgs.resize(memoArgs.size() - arity);
 		}
 
-		void setIdx(decltype(bytes)::size_type &idx) {
-			this->readIdx = &idx;
+		vars.resize(frame.base);
+		stack.resize(frame.stackBase);
+
+		if (frames.size() == entryDepth) {
+			retVal = ret;
+			return true;
 		}
 
-		void skip(std::uint32_t bytes) {
-			*readIdx += bytes;
+		if (ret) {
+			stack.push_back(ret.value());
 		}
-		void back(std::uint32_t bytes) {
-			if (bytes > *readIdx) { *readIdx = 0; }
-			else { *readIdx -= bytes; }
+		in = frames.back().code;
+		base = frames.back().base;
+		return false;
+	};
+	// Taken back edge, hot loops carry on as a trace
+	auto backEdge = [&]() {
+		if (auto exit = tracer->BackEdge(in, frames.size(), stack, vars, base)) {
+			in.seek(exit.value());
 		}
 	};
 
-	std::unordered_map<std::string, CustomIStream> functionBytecodes;
-
-	std::string currFunc = "";
-}
-
-std::optional<VarType> RunCode(const std::string &func, bool createNewStack = true) {
-	auto funcIt = functionBytecodes.find(func);
-	if (funcIt == functionBytecodes.end()) return std::nullopt;
-	
-	auto &in = funcIt->second;
-	std::size_t idx = 0;
-	in.setIdx(idx);
-	if(createNewStack)
-		vars.emplace();
+	// Operand of one byte in short forms and four otherwise, call targets take two
+	auto operand = [&](bool isShort) -> std::uint32_t {
+		if (isShort) {
+			std::uint8_t value = 0;
+			in.read(value);
+			return value;
+		}
+		std::uint32_t value = 0;
+		in.read(value);
+		return value;
+	};
+	auto callOperands = [&](bool isShort, std::uint32_t &funcIdx, std::uint32_t &params) {
+		if (isShort) {
+			std::uint16_t target = 0;
+			in.read(target);
+			funcIdx = target;
+		}
+		else {
+			in.read(funcIdx);
+		}
+		params = operand(isShort);
+	};
 
 	InstructionCode code = InstructionCode::NOP;
 	while (true) {
+		if (tracer && tracer->Recording()) {
+			tracer->Record(in, frames.size(), stack.size());
+		}
 		if (in.eof()) {
-			break;
+			// Falling off the end returns nothing
+			if (leaveFrame(std::nullopt)) {
+				break;
+			}
+			continue;
 		}
 
 		in.read(code);
@@ -80,19 +217,39 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				in.skip(skipBytes);
 				break;
 			}
+			case InstructionCode::SKIP_S: {
+				std::uint8_t skipBytes = 0;
+				in.read(skipBytes);
+
+				in.skip(skipBytes);
+				break;
+			}
 			case InstructionCode::BACK: {
 				std::uint32_t backBytes = 0;
 				in.read(backBytes);
 
 				in.back(backBytes);
+				if (tracer) {
+					backEdge();
+				}
+				break;
+			}
+			case InstructionCode::BACK_S: {
+				std::uint8_t backBytes = 0;
+				in.read(backBytes);
+
+				in.back(backBytes);
+				if (tracer) {
+					backEdge();
+				}
 				break;
 			}
 			case InstructionCode::POP: {
-				stack.pop();
+				stack.pop_back();
 				break;
 			}
 			case InstructionCode::DUP: {
-				stack.push(stack.top());
+				stack.push_back(stack.back());
 				break;
 			}
 
@@ -113,7 +270,14 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 					constant = tmp;
 				}
 
-				stack.push(constant);
+				stack.push_back(constant);
+				break;
+			}
+			case InstructionCode::ICONST_S: {
+				std::int8_t constant = 0;
+				in.read(constant);
+
+				stack.push_back(static_cast<int>(constant));
 				break;
 			}
 			case InstructionCode::ILOAD:
@@ -121,7 +285,16 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				std::uint32_t varidx;
 
 				in.read(varidx);
-				stack.push(vars.top()[varidx]);
+				stack.push_back(vars[base + varidx]);
+
+				break;
+			}
+			case InstructionCode::ILOAD_S:
+			case InstructionCode::FLOAD_S: {
+				std::uint8_t varidx;
+
+				in.read(varidx);
+				stack.push_back(vars[base + varidx]);
 
 				break;
 			}
@@ -130,81 +303,87 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				std::uint32_t varidx;
 				in.read(varidx);
 
-				if (varidx + 1 > vars.top().size()) {
-					vars.top().resize(varidx + 1);
-				}
+				vars[base + varidx] = stack.back();
+				stack.pop_back();
 
-				vars.top()[varidx] = stack.top();
-				stack.pop();
+				break;
+			}
+			case InstructionCode::ISTORE_S:
+			case InstructionCode::FSTORE_S: {
+				std::uint8_t varidx;
+				in.read(varidx);
+
+				vars[base + varidx] = stack.back();
+				stack.pop_back();
 
 				break;
 			}
 			
 			case InstructionCode::IADD:
 			case InstructionCode::FADD: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FCONST;
 
 				if (floating) {
-					stack.push(std::get<float>(a) + std::get<float>(b));
+					stack.push_back(std::get<float>(a) + std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) + std::get<int>(b));
+					stack.push_back(std::get<int>(a) + std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::ISUB:
 			case InstructionCode::FSUB: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FCONST;
 
 				if (floating) {
-					stack.push(std::get<float>(a) - std::get<float>(b));
+					stack.push_back(std::get<float>(a) - std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) - std::get<int>(b));
+					stack.push_back(std::get<int>(a) - std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::IMUL:
 			case InstructionCode::FMUL: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FCONST;
 
 				if (floating) {
-					stack.push(std::get<float>(a) * std::get<float>(b));
+					stack.push_back(std::get<float>(a) * std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) * std::get<int>(b));
+					stack.push_back(std::get<int>(a) * std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::IDIV:
 			case InstructionCode::FDIV: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FCONST;
 
 				if (floating) {
-					stack.push(std::get<float>(a) / std::get<float>(b));
+					stack.push_back(std::get<float>(a) / std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) / std::get<int>(b));
+					stack.push_back(std::get<int>(a) / std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::MOD: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 
-				stack.push(std::get<int>(a) % std::get<int>(b));
+				stack.push_back(std::get<int>(a) % std::get<int>(b));
 				break;
 			}
 			case InstructionCode::INC:
@@ -213,53 +392,98 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				in.read(varIdx);
 
 				if(code == InstructionCode::INC)
-					std::get<int>(vars.top()[varIdx])++;
+					std::get<int>(vars[base + varIdx])++;
 				else
-					std::get<int>(vars.top()[varIdx])--;
+					std::get<int>(vars[base + varIdx])--;
+				break;
+			}
+			case InstructionCode::INC_S:
+			case InstructionCode::DEC_S: {
+				std::uint8_t varIdx = 0;
+				in.read(varIdx);
+
+				if (code == InstructionCode::INC_S)
+					std::get<int>(vars[base + varIdx])++;
+				else
+					std::get<int>(vars[base + varIdx])--;
+				break;
+			}
+			case InstructionCode::INCBY: {
+				std::uint32_t varIdx = 0;
+				int amount = 0;
+				in.read(varIdx);
+				in.read(amount);
+
+				std::get<int>(vars[base + varIdx]) += amount;
+				break;
+			}
+			case InstructionCode::INCBY_S: {
+				std::uint8_t varIdx = 0;
+				std::int8_t amount = 0;
+				in.read(varIdx);
+				in.read(amount);
+
+				std::get<int>(vars[base + varIdx]) += amount;
+				break;
+			}
+			case InstructionCode::LOOP:
+			case InstructionCode::LOOP_S: {
+				const bool isShort = code == InstructionCode::LOOP_S;
+				const auto varIdx = operand(isShort);
+				const auto backBytes = operand(isShort);
+
+				const int limit = std::get<int>(stack.back());
+				stack.pop_back();
+				if (++std::get<int>(vars[base + varIdx]) < limit) {
+					in.back(backBytes);
+					if (tracer) {
+						backEdge();
+					}
+				}
 				break;
 			}
 			
 			case InstructionCode::IGE:
 			case InstructionCode::FGE: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FGE;
 
 				if (floating) {
-					stack.push(std::get<float>(a) > std::get<float>(b));
+					stack.push_back(std::get<float>(a) > std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) > std::get<int>(b));
+					stack.push_back(std::get<int>(a) > std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::ILE:
 			case InstructionCode::FLE: {
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FGE;
 
 				if (floating) {
-					stack.push(std::get<float>(a) < std::get<float>(b));
+					stack.push_back(std::get<float>(a) < std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) < std::get<int>(b));
+					stack.push_back(std::get<int>(a) < std::get<int>(b));
 				}
 
 				break;
 			}
 			case InstructionCode::IEQ:
 			case InstructionCode::FEQ:{
-				VarType b = stack.top(); stack.pop();
-				VarType a = stack.top(); stack.pop();
+				VarType b = stack.back(); stack.pop_back();
+				VarType a = stack.back(); stack.pop_back();
 				bool floating = code == InstructionCode::FEQ;
 
 				if (floating) {
-					stack.push(std::get<float>(a) == std::get<float>(b));
+					stack.push_back(std::get<float>(a) == std::get<float>(b));
 				}
 				else {
-					stack.push(std::get<int>(a) == std::get<int>(b));
+					stack.push_back(std::get<int>(a) == std::get<int>(b));
 				}
 
 				break;
@@ -267,64 +491,124 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 
 			case InstructionCode::IRET:
 			case InstructionCode::FRET: {
-				auto top = stack.top();
-				stack.pop();
-
-				if(createNewStack)
-					vars.pop();
+				auto top = stack.back();
+				stack.pop_back();
 
-				funcIt->second.reset();
-
-				if(code == InstructionCode::IRET)
-					return std::get<int>(top);
-				else
-					return std::get<float>(top);
+				if (leaveFrame(top)) {
+					return retVal;
+				}
+				break;
 			}
 			
 			case InstructionCode::FTOI: {
-				auto var = stack.top();
-				stack.pop();
-				stack.push(static_cast<int>(std::get<float>(var)));
+				auto var = stack.back();
+				stack.pop_back();
+				stack.push_back(static_cast<int>(std::get<float>(var)));
 				break;
 			}
 			case InstructionCode::ITOF: {
-				auto var = stack.top();
-				stack.pop();
-				stack.push(static_cast<float>(std::get<int>(var)));
+				auto var = stack.back();
+				stack.pop_back();
+				stack.push_back(static_cast<float>(std::get<int>(var)));
 				break;
 			}
 
-			case InstructionCode::FUNCTIONCALL: {
-				std::string funcSig = "";
-				while (in.peek() != '\n' && in.peek() != EOF) {
-					funcSig += (char)in.get();
+			case InstructionCode::FUNCTIONCALL:
+			case InstructionCode::MEMOCALL:
+			case InstructionCode::FUNCTIONCALL_S:
+			case InstructionCode::MEMOCALL_S: {
+				std::uint32_t funcIdx = 0, params = 0;
+				callOperands(code == InstructionCode::FUNCTIONCALL_S || code == InstructionCode::MEMOCALL_S, funcIdx, params);
+
+				const auto *callee = program->GetFunction(funcIdx);
+				if (!callee) {
+					throw std::string("Call to undefined function");
+				}
+				if (frames.size() - entryDepth >= maxCallDepth) {
+					throw std::string("Call stack overflow");
 				}
-				in.get();	// Skip \n
-				std::uint32_t params = 0;
-				in.read(params);
-
-				vars.emplace();
-				while (params--) {
-					vars.top().push_back(stack.top());
-					stack.pop();
+				auto *cache = code == InstructionCode::MEMOCALL || code == InstructionCode::MEMOCALL_S ? &memo[funcIdx] : nullptr;
+				if (const auto *hit = cache ? cache->Find(std::span(stack).last(params)) : nullptr) {
+					const auto result = *hit;
+					stack.resize(stack.size() - params);
+					stack.push_back(result);
+					break;
+				}
+				if (std::optional<VarType> ret; jit && jit->TryCall(funcIdx, std::span(stack).last(params), ret)) {
+					if (cache && ret) {
+						cache->Insert(std::span(stack).last(params), ret.value());
+					}
+					stack.resize(stack.size() - params);
+					if (ret) {
+						stack.push_back(ret.value());
+					}
+					break;
 				}
 
-				auto var = RunCode(funcSig, false);
-				vars.pop();
+				// Arguments become the first locals of the new frame
+				frames.back().code = in;
+				frames.push_back(Frame{ CustomIStream{ *callee }, vars.size(), stack.size() - params, cache ? funcIdx : noMemo });
+				if (cache) {
+					memoArgs.insert(memoArgs.end(), stack.end() - params, stack.end());
+				}
+				vars.insert(vars.end(), stack.end() - params, stack.end());
+				stack.resize(stack.size() - params);
+				ReserveFrame(*callee);
+
+				in = frames.back().code;
+				base = frames.back().base;
+				break;
+			}
+			case InstructionCode::TAILCALL:
+			case InstructionCode::TAILCALL_S: {
+				std::uint32_t funcIdx = 0, params = 0;
+				callOperands(code == InstructionCode::TAILCALL_S, funcIdx, params);
+
+				const auto *callee = program->GetFunction(funcIdx);
+				if (!callee) {
+					throw std::string("Call to undefined function");
+				}
 
-				in.setIdx(idx);
-				if (var) {
-					stack.push(var.value());
+				// Compiled callees return straight to our caller
+				if (std::optional<VarType> ret; jit && jit->TryCall(funcIdx, std::span(stack).last(params), ret)) {
+					if (leaveFrame(ret)) {
+						return retVal;
+					}
+					break;
 				}
+
+				// Same frame, the arguments replace the current locals
+				auto &frame = frames.back();
+				vars.resize(frame.base);
+				vars.insert(vars.end(), stack.end() - params, stack.end());
+				stack.resize(frame.stackBase);
+				ReserveFrame(*callee);
+
+				in = CustomIStream{ *callee };
 				break;
 			}
 			
-			case InstructionCode::IF: {
-				std::uint32_t skipIfFalse{};
-				in.read(skipIfFalse);
+			case InstructionCode::NATIVECALL:
+			case InstructionCode::NATIVECALL_S: {
+				std::uint32_t nativeIdx = 0, params = 0;
+				callOperands(code == InstructionCode::NATIVECALL_S, nativeIdx, params);
+
+				// The native reads its arguments in place
+				const auto &native = program->GetNative(nativeIdx);
+				VarType ret = native.fn(stack.data() + stack.size() - params);
+				stack.resize(stack.size() - params);
+				if (native.returnsValue) {
+					stack.push_back(ret);
+				}
+				break;
+			}
+
+			case InstructionCode::IF:
+			case InstructionCode::IF_S: {
+				const auto skipIfFalse = operand(code == InstructionCode::IF_S);
 
-				auto compRes = stack.top();
-				stack.pop();
+				auto compRes = stack.back();
+				stack.pop_back();
 				if ((std::get_if<int>(&compRes) && std::get<int>(compRes)) || (std::get_if<float>(&compRes) && std::get<float>(compRes))) {
 					break;
 				}
@@ -334,11 +618,12 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				break;
 			}
 			case InstructionCode::FOR:
-			case InstructionCode::WHILE: {
-				std::uint32_t skipBytes = 0;
-				in.read(skipBytes);
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR_S:
+			case InstructionCode::WHILE_S: {
+				const auto skipBytes = operand(code == InstructionCode::FOR_S || code == InstructionCode::WHILE_S);
 
-				auto condVal = stack.top(); stack.pop();
+				auto condVal = stack.back(); stack.pop_back();
 				if (!((std::get_if<int>(&condVal) && std::get<int>(condVal)) || (std::get_if<float>(&condVal) && std::get<float>(condVal)))) {
 					in.skip(skipBytes);
 					break;
@@ -349,57 +634,104 @@ std::optional<VarType> RunCode(const std::string &func, bool createNewStack = tr
 				break;
 		}
 	}
-	funcIt->second.reset();
-	if(createNewStack)
-		vars.pop();
-	return std::nullopt;
+	return retVal;
 }
 
-int InterpretCode(std::istream &in) {
-	while (!in.eof()) {
-		InstructionCode code;
-		in.read(reinterpret_cast<char *>(&code), sizeof(code));
-		switch (code) {
-			case InstructionCode::FUNCS_BEGIN: {
-				do {
-					std::string temporary;
-					std::getline(in, temporary);
-					functionDecls.push_back(temporary);
-
-					code = static_cast<InstructionCode>(in.peek());
-				} while (code != InstructionCode::FUNCS_END);
-				in.get();
-				break;
-			}
-			case InstructionCode::FUNCTION: {
-				std::string funcName = "";
-				std::vector<std::byte> bytes;
-				while (in.peek() != '\n') {
-					funcName += in.get();
-				}
-				in.get();
+Program::Program(std::vector<char> &&bytecode, const NativeRegistry *registry) {
+	auto buffer = std::make_shared<const std::vector<char>>(std::move(bytecode));
+	image = *buffer;
+	storage = std::move(buffer);
+	IndexImage(registry);
+}
+Program::Program(std::span<const char> image, std::shared_ptr<const void> storage, const NativeRegistry *registry) : storage(std::move(storage)), image(image) {
+	IndexImage(registry);
+}
+Program::Program(std::istream &in, const NativeRegistry *registry) : Program([&]() {
+	std::vector<char> bytes;
+	in.seekg(0, std::ios::end);
+	const auto imageSize = in.tellg();
+	in.seekg(0, std::ios::beg);
+	if (imageSize > 0) {
+		bytes.resize(static_cast<std::size_t>(imageSize));
+		in.read(bytes.data(), imageSize);
+	}
+	else {
+		// Not seekable, fall back to draining the stream
+		in.clear();
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	return bytes;
+}(), registry) {}
+
+// One pass over the function and native tables, code is used in place
+// once every body got through the verifier
+void Program::IndexImage(const NativeRegistry *registry) {
+	const ImageReader reader{ image };
+
+	std::vector<CallTarget> functionTargets, nativeTargets;
+	functions.reserve(reader.FunctionCount());
+	functionDecls.reserve(reader.FunctionCount());
+	for (std::uint32_t i = 0; i < reader.FunctionCount(); ++i) {
+		const auto func = reader.GetFunction(i);
+		functions.push_back(FunctionCode{ reader.CodeOf(func), func.codeSize, func.arity, func.frameSize, func.maxStack });
+		functionDecls.emplace_back(reader.GetString(func.name));
+		functionIndices[functionDecls.back()] = i;
+		functionTargets.push_back(CallTarget{ func.arity, func.returns });
+	}
 
-				while (true) {
-					if (in.eof()) {
-						break;
-					}
+	natives.reserve(reader.NativeCount());
+	for (std::uint32_t i = 0; i < reader.NativeCount(); ++i) {
+		const std::string signature{ reader.GetNative(i) };
+		const auto *native = registry ? registry->Find(signature) : nullptr;
+		if (!native) {
+			throw std::string("Unbound native function " + signature);
+		}
+		natives.push_back(*native);
+		nativeTargets.push_back(CallTarget{ static_cast<std::uint32_t>(native->paramTypes.size()), ValueKindOf(native->returnType) });
+	}
 
-					if (in.peek() == GetCode(InstructionCode::ENDFUNC)) {
-						in.get();
-						if (in.peek() == GetCode(InstructionCode::FUNCTION)) {
-							break;
-						}
-					}
-					bytes.push_back(static_cast<std::byte>(in.get()));
-				}
-				functionBytecodes.insert(std::pair<std::string, CustomIStream>(funcName, CustomIStream{ std::move(bytes), nullptr }));
+	for (std::uint32_t i = 0; i < reader.FunctionCount(); ++i) {
+		const auto func = reader.GetFunction(i);
+		if (const auto *code = reader.CodeOf(func)) {
+			try {
+				VerifyFunction(std::span(code, func.codeSize), func, functionTargets, nativeTargets);
+			}
+			catch (const std::string &error) {
+				throw std::string("Invalid bytecode in " + functionDecls[i] + " at " + error);
+			}
+		}
+	}
+}
 
-				break;
+const Program::FunctionCode *Program::GetFunction(std::uint32_t idx) const {
+	if (idx >= functions.size() || !functions[idx].code) {
+		return nullptr;
+	}
+	return &functions[idx];
+}
+std::optional<FunctionHandle> Program::Lookup(const std::string &signature) const {
+	auto it = functionIndices.find(signature);
+	if (it != functionIndices.end()) {
+		return FunctionHandle{ it->second, functions[it->second].arity };
+	}
+
+	// A bare name matches the first function declared with it
+	if (signature.find('(') == std::string::npos) {
+		for (std::uint32_t i = 0; i < functionDecls.size(); ++i) {
+			if (functionDecls[i].starts_with(signature + '(')) {
+				return FunctionHandle{ i, functions[i].arity };
 			}
 		}
 	}
+	return std::nullopt;
+}
+const std::string &Program::GetSignature(FunctionHandle func) const {
+	return functionDecls[func.idx];
+}
 
-	auto var = RunCode("main()");
+int InterpretCode(std::istream &in, JitMode jitMode) {
+	VM vm{ std::make_shared<const Program>(in), jitMode };
+	auto var = vm.Run("main()");
 
 	if (!var) return -1;
 	return std::get<int>(var.value());
@@ -1,6 +1,187 @@
 #pragma once
 
 #include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <unordered_map>
 #include "bytecode.h"
+#include "jit.h"
+#include "trace.h"
+#include "native.h"
 
-int InterpretCode(std::istream &in);
\ No newline at end of file
+// Resolved function of a Program, cheap to copy and valid as long as the
+// Program it came from
+struct FunctionHandle {
+	std::uint32_t idx = 0;
+	std::uint32_t arity = 0;
+};
+
+// Loaded program image, see ImageHeader for the layout. Never modified after construction so a single
+// instance can be shared by any number of VMs
+class Program {
+public:
+	struct FunctionCode {
+		const char *code = nullptr;
+		std::size_t size = 0;
+		std::uint32_t arity = 0;
+		std::uint32_t frameSize = 0;	// local slots, verified like maxStack
+		std::uint32_t maxStack = 0;
+	};
+private:
+	// Keeps the memory image points into alive, a read buffer or a mapped
+	// file. Functions only point into the image
+	std::shared_ptr<const void> storage;
+	std::span<const char> image;
+	std::vector<std::string> functionDecls;
+	// Same order as the FUNCTIONS section, FUNCTIONCALL operands index into it
+	std::vector<FunctionCode> functions;
+	std::unordered_map<std::string, std::uint32_t> functionIndices;
+	// Same order as the NATIVES section, NATIVECALL operands index into it
+	std::vector<NativeFunction> natives;
+
+	void IndexImage(const NativeRegistry *registry);
+public:
+	// Every native the program calls has to be in registry
+	Program(std::istream &in, const NativeRegistry *registry = nullptr);
+	Program(std::vector<char> &&bytecode, const NativeRegistry *registry = nullptr);
+	// Uses image in place, storage owns the memory it points into
+	Program(std::span<const char> image, std::shared_ptr<const void> storage, const NativeRegistry *registry = nullptr);
+	Program(const Program &) = delete;
+	Program &operator=(const Program &) = delete;
+
+	const FunctionCode *GetFunction(std::uint32_t idx) const;
+	std::uint32_t FunctionCount() const { return static_cast<std::uint32_t>(functions.size()); }
+	const NativeFunction &GetNative(std::uint32_t idx) const { return natives[idx]; }
+	// Accepts a full signature like "foo(int)" or just the name "foo"
+	std::optional<FunctionHandle> Lookup(const std::string &signature) const;
+	const std::string &GetSignature(FunctionHandle func) const;
+	std::span<const char> GetImage() const { return image; }
+};
+
+// Cursor over one function's code inside a program image
+class CustomIStream {
+private:
+	const char *bytes = nullptr;
+	std::size_t size = 0;
+	std::size_t readIdx = 0;
+public:
+	CustomIStream() = default;
+	CustomIStream(const Program::FunctionCode &func) : bytes{ func.code }, size{ func.size } {}
+
+	template<typename T>
+	void read(T &toModify, std::size_t size = sizeof(T)) {
+		std::memcpy(&toModify, bytes + readIdx, size);
+		readIdx += size;
+	}
+	int get() {
+		readIdx = readIdx + 1;
+		return eof() ? EOF : static_cast<unsigned char>(bytes[readIdx - 1]);
+	}
+	int peek() const {
+		return eof() ? EOF : static_cast<unsigned char>(bytes[readIdx]);
+	}
+	void reset() {
+		readIdx = 0;
+	}
+	bool eof() const {
+		return readIdx >= size;
+	}
+
+	const char *data() const {
+		return bytes;
+	}
+	std::size_t tell() const {
+		return readIdx;
+	}
+	std::size_t length() const {
+		return size;
+	}
+	void seek(std::size_t pos) {
+		readIdx = pos;
+	}
+
+	void skip(std::uint32_t bytes) {
+		readIdx += bytes;
+	}
+	void back(std::uint32_t bytes) {
+		if (bytes > readIdx) { readIdx = 0; }
+		else { readIdx -= bytes; }
+	}
+};
+
+// Results of one MEMOCALL target by argument values. Direct mapped, so it
+// never holds more than capacity results and a call landing on a taken
+// entry just replaces it
+class MemoCache {
+public:
+	static constexpr std::size_t capacityBits = 12;
+	static constexpr std::size_t capacity = std::size_t{ 1 } << capacityBits;
+private:
+	std::vector<VarType> entries;	// allocated on the first insert, per entry the arguments then the result
+	std::vector<bool> used;
+
+	std::size_t Index(std::span<const VarType> args) const;
+public:
+	std::uint64_t hits = 0, misses = 0;
+
+	const VarType *Find(std::span<const VarType> args);
+	void Insert(std::span<const VarType> args, const VarType &result);
+};
+struct MemoStats {
+	std::uint64_t hits = 0;
+	std::uint64_t misses = 0;
+};
+
+// Execution state for running a program, one instance per thread
+class VM {
+	static constexpr std::uint32_t noMemo = ~0u;
+	struct Frame {
+		CustomIStream code;			// the caller's position while a callee runs
+		std::size_t base = 0;		// first local of this frame in vars
+		std::size_t stackBase = 0;	// operand stack height on entry
+		std::uint32_t memoFunc = noMemo;	// MEMOCALL target whose result gets cached on return
+	};
+
+	std::shared_ptr<const Program> program;
+	std::vector<VarType> stack;
+	std::vector<VarType> vars;
+	std::vector<Frame> frames;
+	std::size_t maxCallDepth = 1 << 20;
+	// Compiles hot functions, null when running everything in the interpreter
+	std::unique_ptr<Jit> jit;
+	// Compiles hot loops of interpreted code, with the BASELINE jit only
+	std::unique_ptr<Tracer> tracer;
+	// Per function, only MEMOCALL targets ever fill theirs
+	std::vector<MemoCache> memo;
+	// Arguments of the memoized calls still running, their cache keys
+	std::vector<VarType> memoArgs;
+
+	void ReserveFrame(const Program::FunctionCode &func);
+	std::optional<VarType> Execute(std::size_t entryDepth);
+public:
+	VM(std::shared_ptr<const Program> program, JitMode jitMode = JitMode::BASELINE);
+	VM(const VM &) = delete;
+	VM &operator=(const VM &) = delete;
+
+	// Upper bound on nested script calls before execution is aborted, calls
+	// running as machine code are bounded by the native stack instead
+	void SetMaxCallDepth(std::size_t depth) { maxCallDepth = depth; }
+	// Functions called threshold times are compiled, OFF interprets
+	// everything. BASELINE also compiles hot loops, see trace.h
+	void SetJitMode(JitMode mode, std::uint32_t threshold = Jit::defaultThreshold);
+
+	// Runs func to completion, args become its first locals
+	std::optional<VarType> Call(FunctionHandle func, std::span<const VarType> args = {});
+	std::optional<VarType> Run(const std::string &func, std::span<const VarType> args = {});
+	// Call through func's result cache, how compiled code makes a MEMOCALL
+	std::optional<VarType> CallMemoized(FunctionHandle func, std::span<const VarType> args);
+
+	// Cache lookups of MEMOCALLs to func so far
+	MemoStats GetMemoStats(FunctionHandle func) const;
+};
+
+int InterpretCode(std::istream &in, JitMode jitMode = JitMode::BASELINE);
\ No newline at end of file
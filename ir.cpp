@@ -0,0 +1,1748 @@
+#include "ir.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include "bytecode.h"
+
+namespace {
+	IRType TypeOf(const Type *type) {
+		if (!type || type->name.value == "void") return IRType::VOID;
+		return type->name.value == "float" ? IRType::FLOAT : IRType::INT;
+	}
+
+	bool IsTruthy(const VarType &value) {
+		return std::holds_alternative<int>(value) ? std::get<int>(value) != 0 : std::get<float>(value) != 0;
+	}
+
+	void RemoveEdge(IRBlock *from, IRBlock *to) {
+		auto predIt = std::find(to->preds.begin(), to->preds.end(), from);
+		const auto predIdx = predIt - to->preds.begin();
+		to->preds.erase(predIt);
+		for (auto *phi : to->phis) {
+			phi->operands.erase(phi->operands.begin() + predIdx);
+		}
+		from->succs.erase(std::find(from->succs.begin(), from->succs.end(), to));
+	}
+
+	// Points every use of a key at its value, following chains
+	void ReplaceUses(IRFunction &fn, const std::unordered_map<IRValue *, IRValue *> &replaced) {
+		if (replaced.empty()) return;
+
+		auto resolve = [&](IRValue *value) {
+			for (auto it = replaced.find(value); it != replaced.end(); it = replaced.find(value)) {
+				value = it->second;
+			}
+			return value;
+		};
+		for (auto &block : fn.blocks) {
+			for (auto *phi : block->phis) {
+				for (auto &op : phi->operands) op = resolve(op);
+			}
+			for (auto *inst : block->insts) {
+				for (auto &op : inst->operands) op = resolve(op);
+			}
+		}
+	}
+
+	class IRBuilder {
+		struct Loop {
+			IRBlock *continueTarget, *breakTarget;
+		};
+
+		Parser &parser;
+		Scope *scope;
+		IRFunction fn;
+		IRBlock *current = nullptr;	// null while lowering unreachable code
+
+		// Source variables get numbers, their SSA values are tracked per block
+		std::vector<std::unordered_map<std::string, std::uint32_t>> names;
+		std::vector<IRType> varTypes;
+		std::vector<std::unordered_map<IRBlock *, IRValue *>> definitions;
+
+		std::unordered_set<IRBlock *> sealed;
+		std::unordered_map<IRBlock *, std::vector<std::pair<std::uint32_t, IRValue *>>> incompletePhis;
+		std::unordered_map<IRValue *, IRValue *> removedPhis;
+
+		std::vector<Loop> loops;
+		std::uint32_t returnVar = 0;
+		IRBlock *exit = nullptr;
+
+		IRValue *Resolve(IRValue *value) const {
+			for (auto it = removedPhis.find(value); it != removedPhis.end(); it = removedPhis.find(value)) {
+				value = it->second;
+			}
+			return value;
+		}
+
+		std::uint32_t Declare(const std::string &name, IRType type) {
+			const auto var = static_cast<std::uint32_t>(varTypes.size());
+			varTypes.push_back(type);
+			definitions.emplace_back();
+			if (!name.empty()) {
+				names.back()[name] = var;
+			}
+			return var;
+		}
+		std::uint32_t Lookup(const std::string &name) const {
+			for (auto it = names.rbegin(); it != names.rend(); ++it) {
+				if (auto found = it->find(name); found != it->end()) {
+					return found->second;
+				}
+			}
+			throw std::string("Unknown variable " + name);
+		}
+
+		// SSA construction as in Braun et al., phis are only added where a
+		// read reaches a join and trivial ones are removed on the way
+		void WriteVariable(std::uint32_t var, IRBlock *block, IRValue *value) {
+			definitions[var][block] = value;
+		}
+		IRValue *ReadVariable(std::uint32_t var, IRBlock *block) {
+			if (auto found = definitions[var].find(block); found != definitions[var].end()) {
+				return Resolve(found->second);
+			}
+
+			IRValue *value = nullptr;
+			if (!sealed.contains(block)) {
+				value = NewPhi(var, block);
+				incompletePhis[block].emplace_back(var, value);
+			}
+			else if (block->preds.size() == 1) {
+				value = ReadVariable(var, block->preds[0]);
+			}
+			else if (block->preds.empty()) {
+				// Read before any write
+				value = fn.NewConstant(varTypes[var], 0);
+			}
+			else {
+				value = NewPhi(var, block);
+				WriteVariable(var, block, value);
+				value = AddPhiOperands(var, value);
+			}
+			WriteVariable(var, block, value);
+			return value;
+		}
+		IRValue *NewPhi(std::uint32_t var, IRBlock *block) {
+			auto *phi = fn.NewValue(IROp::PHI, varTypes[var], block);
+			block->phis.push_back(phi);
+			return phi;
+		}
+		IRValue *AddPhiOperands(std::uint32_t var, IRValue *phi) {
+			for (auto *pred : phi->block->preds) {
+				phi->operands.push_back(ReadVariable(var, pred));
+			}
+			return TryRemoveTrivialPhi(phi);
+		}
+		IRValue *TryRemoveTrivialPhi(IRValue *phi) {
+			IRValue *same = nullptr;
+			for (auto *op : phi->operands) {
+				op = Resolve(op);
+				if (op == same || op == phi) continue;
+				if (same) return phi;
+				same = op;
+			}
+			if (!same) {
+				same = fn.NewConstant(phi->type, 0);
+			}
+
+			auto &phis = phi->block->phis;
+			phis.erase(std::find(phis.begin(), phis.end(), phi));
+			removedPhis[phi] = same;
+			return same;
+		}
+		void Seal(IRBlock *block) {
+			for (auto &[var, phi] : incompletePhis[block]) {
+				AddPhiOperands(var, phi);
+			}
+			incompletePhis.erase(block);
+			sealed.insert(block);
+		}
+
+		IRValue *Append(IROp op, IRType type, std::vector<IRValue *> operands = {}) {
+			auto *value = fn.NewValue(op, type, current);
+			value->operands = std::move(operands);
+			current->insts.push_back(value);
+			return value;
+		}
+		void Link(IRBlock *from, IRBlock *to) {
+			from->succs.push_back(to);
+			to->preds.push_back(from);
+		}
+		void Jump(IRBlock *target) {
+			if (!current) return;
+
+			Append(IROp::JUMP, IRType::VOID);
+			Link(current, target);
+			current = nullptr;
+		}
+		void Branch(IRValue *cond, IRBlock *ifTrue, IRBlock *ifFalse) {
+			Append(IROp::BRANCH, IRType::VOID, { cond });
+			Link(current, ifTrue);
+			Link(current, ifFalse);
+			current = nullptr;
+		}
+
+		IRValue *LowerCall(FuncCallExpr &expr, bool tailCall) {
+			std::vector<IRValue *> args;
+			for (auto &param : expr.params) {
+				args.push_back(LowerExpr(*param));
+			}
+
+			const auto *callee = scope->FindFunc(expr.func);
+			auto op = callee->native ? IROp::NATIVECALL : (tailCall ? IROp::TAILCALL : IROp::CALL);
+			auto *call = Append(op, TypeOf(callee->returnType), std::move(args));
+			call->callee = callee;
+			return call;
+		}
+		IRValue *LowerExpr(Expression &expr) {
+			switch (expr.type) {
+				case ExpressionType::VALUE: {
+					auto &val = static_cast<ValueExpr &>(expr).val;
+					if (val.type == TokenType::INTEGER) {
+						return fn.NewConstant(IRType::INT, std::stoi(val.value));
+					}
+					if (val.type == TokenType::FLOAT) {
+						auto *constant = fn.NewValue(IROp::CONST, IRType::FLOAT);
+						constant->constant = std::stof(val.value);
+						return constant;
+					}
+					return ReadVariable(Lookup(val.value), current);
+				}
+				case ExpressionType::BINARY: {
+					auto &binary = static_cast<BinaryExpression &>(expr);
+					auto *lhs = LowerExpr(*binary.lhs);
+					auto *rhs = LowerExpr(*binary.rhs);
+					const auto type = TypeOf(parser.EvalType(expr, scope));
+
+					switch (binary.op.type) {
+						case TokenType::PLUS: return Append(IROp::ADD, type, { lhs, rhs });
+						case TokenType::MINUS: return Append(IROp::SUB, type, { lhs, rhs });
+						case TokenType::STAR: return Append(IROp::MUL, type, { lhs, rhs });
+						case TokenType::SLASH: return Append(IROp::DIV, type, { lhs, rhs });
+						case TokenType::PERCENT: return Append(IROp::MOD, IRType::INT, { lhs, rhs });
+						case TokenType::EQUALS: return Append(IROp::EQ, type, { lhs, rhs });
+						case TokenType::LESS: return Append(IROp::LT, type, { lhs, rhs });
+						case TokenType::GREATER: return Append(IROp::GT, type, { lhs, rhs });
+					}
+					return lhs;
+				}
+				case ExpressionType::UNARY: {
+					// Stores back into the variable, yields the old value
+					auto &unary = static_cast<UnaryExpr &>(expr);
+					const auto var = Lookup(unary.expr->val.value);
+					auto *old = ReadVariable(var, current);
+					auto op = unary.op.type == TokenType::INCREMENT ? IROp::ADD : IROp::SUB;
+					WriteVariable(var, current, Append(op, IRType::INT, { old, fn.NewConstant(IRType::INT, 1) }));
+					return old;
+				}
+				case ExpressionType::CAST: {
+					auto &cast = static_cast<CastExpr &>(expr);
+					auto *value = LowerExpr(*cast.expr);
+					if (cast.finalType == cast.origType) {
+						return value;
+					}
+					return cast.finalType->name.value == "float" ?
+						Append(IROp::ITOF, IRType::FLOAT, { value }) :
+						Append(IROp::FTOI, IRType::INT, { value });
+				}
+				case ExpressionType::FUNCCALL:
+					return LowerCall(static_cast<FuncCallExpr &>(expr), false);
+			}
+			return fn.NewConstant(IRType::INT, 0);
+		}
+
+		void LowerBlock(BlockStmt &stmt) {
+			auto *outerScope = scope;
+			if (stmt.scope) {
+				scope = stmt.scope;
+			}
+
+			names.emplace_back();
+			for (auto &child : stmt.stmts) {
+				if (!current) break;
+				LowerStmt(*child);
+			}
+			names.pop_back();
+			scope = outerScope;
+		}
+		void LowerIf(IfStmt &stmt) {
+			auto *cond = LowerExpr(*stmt.condition);
+			auto *thenBlock = fn.NewBlock();
+			auto *elseBlock = stmt.els ? fn.NewBlock() : nullptr;
+			auto *merge = fn.NewBlock();
+
+			Branch(cond, thenBlock, elseBlock ? elseBlock : merge);
+			Seal(thenBlock);
+			current = thenBlock;
+			LowerStmt(*stmt.then);
+			Jump(merge);
+
+			if (elseBlock) {
+				Seal(elseBlock);
+				current = elseBlock;
+				LowerStmt(*stmt.els);
+				Jump(merge);
+			}
+
+			Seal(merge);
+			current = merge->preds.empty() ? nullptr : merge;
+		}
+		void LowerWhile(WhileStmt &stmt) {
+			auto *header = fn.NewBlock();
+			Jump(header);
+			current = header;
+
+			auto *cond = LowerExpr(*stmt.condition);
+			auto *body = fn.NewBlock();
+			auto *loopExit = fn.NewBlock();
+			Branch(cond, body, loopExit);
+			Seal(body);
+
+			loops.push_back({ header, loopExit });
+			current = body;
+			LowerStmt(*stmt.then);
+			Jump(header);
+			loops.pop_back();
+
+			Seal(header);
+			Seal(loopExit);
+			current = loopExit->preds.empty() ? nullptr : loopExit;
+		}
+		void LowerFor(ForStmt &stmt) {
+			names.emplace_back();
+			LowerStmt(*stmt.initial);
+
+			auto *header = fn.NewBlock();
+			Jump(header);
+			current = header;
+
+			auto *cond = LowerExpr(*stmt.condition);
+			auto *body = fn.NewBlock();
+			auto *latch = fn.NewBlock();
+			auto *loopExit = fn.NewBlock();
+			Branch(cond, body, loopExit);
+			Seal(body);
+
+			loops.push_back({ latch, loopExit });
+			current = body;
+			LowerStmt(*stmt.then);
+			Jump(latch);
+			loops.pop_back();
+
+			Seal(latch);
+			if (!latch->preds.empty()) {
+				current = latch;
+				LowerStmt(*stmt.postLoop);
+				Jump(header);
+			}
+
+			Seal(header);
+			Seal(loopExit);
+			current = loopExit->preds.empty() ? nullptr : loopExit;
+			names.pop_back();
+		}
+		void LowerReturn(ReturnStmt &stmt) {
+			const auto returnType = varTypes[returnVar];
+			auto converts = [&](IRType type) {
+				return returnType != IRType::VOID && type != IRType::VOID && type != returnType;
+			};
+
+			// A returned script call replaces this frame, unless its result needs converting
+			if (stmt.ret->type == ExpressionType::FUNCCALL) {
+				auto &call = static_cast<FuncCallExpr &>(*stmt.ret);
+				const auto *callee = scope->FindFunc(call.func);
+				if (!callee->native && !converts(TypeOf(callee->returnType))) {
+					LowerCall(call, true);
+					current = nullptr;
+					return;
+				}
+			}
+
+			// Every other return shares one exit block, the value converted to the declared type
+			auto *value = LowerExpr(*stmt.ret);
+			if (converts(value->type)) {
+				value = returnType == IRType::FLOAT ?
+					Append(IROp::ITOF, IRType::FLOAT, { value }) :
+					Append(IROp::FTOI, IRType::INT, { value });
+			}
+			WriteVariable(returnVar, current, value);
+			Jump(exit);
+		}
+		void LowerStmt(Statement &stmt) {
+			if (!current) return;
+
+			switch (stmt.type) {
+				case StatementType::BLOCK:
+					LowerBlock(static_cast<BlockStmt &>(stmt));
+					break;
+				case StatementType::VARDECL: {
+					auto &decl = static_cast<VarDeclStmt &>(stmt);
+					const auto type = TypeOf(decl.var.type);
+					auto *value = decl.expr ? LowerExpr(*decl.expr) : fn.NewConstant(type, 0);
+					WriteVariable(Declare(decl.var.name.value, type), current, value);
+					break;
+				}
+				case StatementType::VARASSIGN: {
+					auto &assign = static_cast<VarAssignStmt &>(stmt);
+					auto *value = LowerExpr(*assign.val);
+					WriteVariable(Lookup(assign.name.value), current, value);
+					break;
+				}
+				case StatementType::IF:
+					LowerIf(static_cast<IfStmt &>(stmt));
+					break;
+				case StatementType::WHILE:
+					LowerWhile(static_cast<WhileStmt &>(stmt));
+					break;
+				case StatementType::FOR:
+					LowerFor(static_cast<ForStmt &>(stmt));
+					break;
+				case StatementType::BREAK:
+					Jump(loops.back().breakTarget);
+					break;
+				case StatementType::CONTINUE:
+					Jump(loops.back().continueTarget);
+					break;
+				case StatementType::EXPRSTMT:
+					LowerExpr(*static_cast<ExpressionStmt &>(stmt).expr);
+					break;
+				case StatementType::RETURN:
+					LowerReturn(static_cast<ReturnStmt &>(stmt));
+					break;
+			}
+		}
+	public:
+		IRBuilder(Parser &parser, Scope &scope) : parser(parser), scope(&scope) {}
+
+		IRFunction Build(FuncDeclStmt &stmt) {
+			fn.func = scope->FindFunc(stmt.name);
+			current = fn.NewBlock();
+			Seal(current);
+
+			names.emplace_back();
+			for (std::uint32_t i = 0; i < stmt.params.size(); ++i) {
+				const auto &var = stmt.params[i]->var;
+				auto *param = fn.NewValue(IROp::PARAM, TypeOf(var.type));
+				param->param = i;
+				fn.params.push_back(param);
+				WriteVariable(Declare(var.name.value, param->type), current, param);
+			}
+
+			returnVar = Declare("", TypeOf(fn.func->returnType));
+			exit = fn.NewBlock();
+			LowerBlock(*stmt.definition);
+
+			// Falling off the end returns nothing
+			if (current) {
+				Append(IROp::RETURN, IRType::VOID);
+			}
+
+			Seal(exit);
+			if (exit->preds.empty()) {
+				fn.blocks.erase(std::find_if(fn.blocks.begin(), fn.blocks.end(), [&](const auto &block) { return block.get() == exit; }));
+			}
+			else {
+				current = exit;
+				Append(IROp::RETURN, varTypes[returnVar], { ReadVariable(returnVar, exit) });
+			}
+
+			// Reads from before a phi got removed still point at it
+			ReplaceUses(fn, removedPhis);
+			return std::move(fn);
+		}
+	};
+
+	IRValue *Fold(IRFunction &fn, const IRValue &inst) {
+		if (inst.operands.empty() || inst.HasSideEffects() || inst.op == IROp::PHI || inst.op == IROp::CALL) {
+			return nullptr;
+		}
+		for (const auto *op : inst.operands) {
+			if (op->op != IROp::CONST) return nullptr;
+		}
+
+		const auto &a = inst.operands[0]->constant;
+		if (inst.op == IROp::ITOF || inst.op == IROp::FTOI) {
+			auto *folded = fn.NewValue(IROp::CONST, inst.type);
+			if (inst.op == IROp::ITOF && std::holds_alternative<int>(a)) {
+				folded->constant = static_cast<float>(std::get<int>(a));
+				return folded;
+			}
+			if (inst.op == IROp::FTOI && std::holds_alternative<float>(a)) {
+				folded->constant = static_cast<int>(std::get<float>(a));
+				return folded;
+			}
+			return nullptr;
+		}
+
+		// Float arithmetic is left to the interpreter
+		const auto &b = inst.operands[1]->constant;
+		if (inst.type != IRType::INT || !std::holds_alternative<int>(a) || !std::holds_alternative<int>(b)) {
+			return nullptr;
+		}
+		const int lhs = std::get<int>(a), rhs = std::get<int>(b);
+		const auto wrap = [](std::uint32_t value) { return static_cast<int>(value); };
+		switch (inst.op) {
+			case IROp::ADD: return fn.NewConstant(IRType::INT, wrap(static_cast<std::uint32_t>(lhs) + static_cast<std::uint32_t>(rhs)));
+			case IROp::SUB: return fn.NewConstant(IRType::INT, wrap(static_cast<std::uint32_t>(lhs) - static_cast<std::uint32_t>(rhs)));
+			case IROp::MUL: return fn.NewConstant(IRType::INT, wrap(static_cast<std::uint32_t>(lhs) * static_cast<std::uint32_t>(rhs)));
+			case IROp::DIV:
+				if (rhs == 0 || (rhs == -1 && lhs == INT32_MIN)) return nullptr;
+				return fn.NewConstant(IRType::INT, lhs / rhs);
+			case IROp::MOD:
+				if (rhs == 0 || (rhs == -1 && lhs == INT32_MIN)) return nullptr;
+				return fn.NewConstant(IRType::INT, lhs % rhs);
+			case IROp::EQ: return fn.NewConstant(IRType::INT, lhs == rhs);
+			case IROp::LT: return fn.NewConstant(IRType::INT, lhs < rhs);
+			case IROp::GT: return fn.NewConstant(IRType::INT, lhs > rhs);
+		}
+		return nullptr;
+	}
+	std::optional<std::uint32_t> ConstantStep(const IRValue &value) {
+		if ((value.op != IROp::ADD && value.op != IROp::SUB) || value.type != IRType::INT) return std::nullopt;
+
+		const auto *amount = value.operands[1];
+		if (amount->op != IROp::CONST || !std::holds_alternative<int>(amount->constant)) return std::nullopt;
+
+		const auto step = static_cast<std::uint32_t>(std::get<int>(amount->constant));
+		return value.op == IROp::ADD ? step : 0u - step;
+	}
+	// (x + a) + b becomes x + (a + b), so unrolled counters do not chain
+	bool MergeSteps(IRFunction &fn, IRValue &inst) {
+		const auto outer = ConstantStep(inst);
+		if (!outer) return false;
+		const auto inner = ConstantStep(*inst.operands[0]);
+		if (!inner) return false;
+
+		inst.op = IROp::ADD;
+		inst.operands = { inst.operands[0]->operands[0], fn.NewConstant(IRType::INT, static_cast<int>(*outer + *inner)) };
+		return true;
+	}
+	bool FoldConstants(IRFunction &fn) {
+		bool merged = false;
+		std::unordered_map<IRValue *, IRValue *> replaced;
+		for (auto &block : fn.blocks) {
+			for (auto it = block->insts.begin(); it != block->insts.end();) {
+				auto *inst = *it;
+				for (auto &op : inst->operands) {
+					if (auto found = replaced.find(op); found != replaced.end()) op = found->second;
+				}
+
+				merged |= MergeSteps(fn, *inst);
+				if (auto *folded = Fold(fn, *inst)) {
+					replaced[inst] = folded;
+					it = block->insts.erase(it);
+				}
+				else {
+					++it;
+				}
+			}
+		}
+		ReplaceUses(fn, replaced);
+		return merged || !replaced.empty();
+	}
+	bool FoldBranches(IRFunction &fn) {
+		bool changed = false;
+		for (auto &block : fn.blocks) {
+			auto *term = block->Terminator();
+			if (!term || term->op != IROp::BRANCH || term->operands[0]->op != IROp::CONST) continue;
+
+			auto *taken = block->succs[IsTruthy(term->operands[0]->constant) ? 0 : 1];
+			auto *other = block->succs[IsTruthy(term->operands[0]->constant) ? 1 : 0];
+			if (taken != other) {
+				RemoveEdge(block.get(), other);
+			}
+			term->op = IROp::JUMP;
+			term->operands.clear();
+			changed = true;
+		}
+		return changed;
+	}
+	bool RemoveUnreachableBlocks(IRFunction &fn) {
+		std::unordered_set<IRBlock *> reached;
+		std::vector<IRBlock *> pending{ fn.blocks[0].get() };
+		while (!pending.empty()) {
+			auto *block = pending.back();
+			pending.pop_back();
+			if (!reached.insert(block).second) continue;
+			pending.insert(pending.end(), block->succs.begin(), block->succs.end());
+		}
+		if (reached.size() == fn.blocks.size()) {
+			return false;
+		}
+
+		for (auto &block : fn.blocks) {
+			if (reached.contains(block.get())) continue;
+
+			const auto succs = block->succs;
+			for (auto *succ : succs) {
+				RemoveEdge(block.get(), succ);
+			}
+		}
+		std::erase_if(fn.blocks, [&](const auto &block) { return !reached.contains(block.get()); });
+		return true;
+	}
+	bool RemoveTrivialPhis(IRFunction &fn) {
+		std::unordered_map<IRValue *, IRValue *> replaced;
+		for (auto &block : fn.blocks) {
+			std::erase_if(block->phis, [&](IRValue *phi) {
+				IRValue *same = nullptr;
+				for (auto *op : phi->operands) {
+					if (op == same || op == phi) continue;
+					if (same) return false;
+					same = op;
+				}
+				replaced[phi] = same ? same : fn.NewConstant(phi->type, 0);
+				return true;
+			});
+		}
+		ReplaceUses(fn, replaced);
+		return !replaced.empty();
+	}
+	bool RemoveDeadValues(IRFunction &fn) {
+		std::unordered_map<const IRValue *, std::size_t> uses;
+		for (auto &block : fn.blocks) {
+			for (auto *phi : block->phis) {
+				for (auto *op : phi->operands) {
+					if (op != phi) uses[op]++;
+				}
+			}
+			for (auto *inst : block->insts) {
+				for (auto *op : inst->operands) uses[op]++;
+			}
+		}
+
+		std::unordered_set<const IRValue *> dead;
+		std::vector<const IRValue *> pending;
+		auto consider = [&](const IRValue *value) {
+			const bool removable = value->block && (value->op == IROp::PHI || !value->HasSideEffects());
+			if (removable && !uses[value] && dead.insert(value).second) {
+				pending.push_back(value);
+			}
+		};
+		for (auto &block : fn.blocks) {
+			for (auto *phi : block->phis) consider(phi);
+			for (auto *inst : block->insts) consider(inst);
+		}
+		while (!pending.empty()) {
+			const auto *value = pending.back();
+			pending.pop_back();
+			for (auto *op : value->operands) {
+				if (op == value) continue;
+				uses[op]--;
+				consider(op);
+			}
+		}
+		if (dead.empty()) {
+			return false;
+		}
+
+		for (auto &block : fn.blocks) {
+			std::erase_if(block->phis, [&](IRValue *value) { return dead.contains(value); });
+			std::erase_if(block->insts, [&](IRValue *value) { return dead.contains(value); });
+		}
+		return true;
+	}
+	// Appends a block to its only predecessor when that one jumps straight to it
+	bool MergeBlocks(IRFunction &fn) {
+		for (auto &owner : fn.blocks) {
+			auto *block = owner.get();
+			auto *term = block->Terminator();
+			if (!term || term->op != IROp::JUMP) continue;
+
+			auto *succ = block->succs[0];
+			if (succ == block || succ == fn.blocks[0].get() || succ->preds.size() != 1 || !succ->phis.empty()) continue;
+
+			block->insts.pop_back();
+			for (auto *inst : succ->insts) {
+				inst->block = block;
+				block->insts.push_back(inst);
+			}
+			block->succs = succ->succs;
+			for (auto *next : block->succs) {
+				std::replace(next->preds.begin(), next->preds.end(), succ, block);
+			}
+			std::erase_if(fn.blocks, [&](const auto &other) { return other.get() == succ; });
+			return true;
+		}
+		return false;
+	}
+
+	std::vector<IRBlock *> ReversePostorder(const IRFunction &fn) {
+		std::unordered_set<const IRBlock *> visited;
+		std::vector<IRBlock *> order;
+		std::function<void(IRBlock *)> visit = [&](IRBlock *block) {
+			visited.insert(block);
+			for (auto *succ : block->succs) {
+				if (!visited.contains(succ)) visit(succ);
+			}
+			order.push_back(block);
+		};
+		visit(fn.blocks[0].get());
+		std::reverse(order.begin(), order.end());
+		return order;
+	}
+
+	// Cooper, Harvey and Kennedy, blocks are numbered in reverse postorder
+	struct DominatorTree {
+		std::vector<IRBlock *> rpo;
+		std::unordered_map<const IRBlock *, std::size_t> index;
+		std::vector<std::size_t> idom;
+
+		explicit DominatorTree(const IRFunction &fn) : rpo(ReversePostorder(fn)), idom(rpo.size(), SIZE_MAX) {
+			for (std::size_t i = 0; i < rpo.size(); ++i) {
+				index[rpo[i]] = i;
+			}
+
+			auto intersect = [&](std::size_t a, std::size_t b) {
+				while (a != b) {
+					while (a > b) a = idom[a];
+					while (b > a) b = idom[b];
+				}
+				return a;
+			};
+			idom[0] = 0;
+			for (bool changed = true; changed;) {
+				changed = false;
+				for (std::size_t i = 1; i < rpo.size(); ++i) {
+					std::size_t newIdom = SIZE_MAX;
+					for (const auto *pred : rpo[i]->preds) {
+						const auto predIdx = index.at(pred);
+						if (idom[predIdx] == SIZE_MAX) continue;
+						newIdom = newIdom == SIZE_MAX ? predIdx : intersect(predIdx, newIdom);
+					}
+					if (idom[i] != newIdom) {
+						idom[i] = newIdom;
+						changed = true;
+					}
+				}
+			}
+		}
+		bool Dominates(const IRBlock *a, const IRBlock *b) const {
+			const auto target = index.at(a);
+			auto current = index.at(b);
+			while (current != target && current != 0) {
+				current = idom[current];
+			}
+			return current == target;
+		}
+	};
+
+	// Pure and unable to trap, so running it when the original would not is harmless
+	bool IsSpeculatable(const IRValue &value) {
+		switch (value.op) {
+			case IROp::ADD:
+			case IROp::SUB:
+			case IROp::MUL:
+			case IROp::EQ:
+			case IROp::LT:
+			case IROp::GT:
+			case IROp::ITOF:
+			case IROp::FTOI:
+				return true;
+			case IROp::DIV:
+			case IROp::MOD: {
+				const auto *divisor = value.operands[1];
+				return divisor->op == IROp::CONST && IsTruthy(divisor->constant) && divisor->constant != VarType{ -1 };
+			}
+			case IROp::CALL:
+				return value.pure;
+			default:
+				return false;
+		}
+	}
+
+	struct Loop {
+		IRBlock *header = nullptr;
+		std::unordered_set<const IRBlock *> body;	// header included
+		IRBlock *preheader = nullptr;	// the only way in, a plain jump. Null when there is none
+		IRBlock *latch = nullptr;		// the only back edge, null when there are several
+	};
+
+	// Natural loops, inner ones first
+	std::vector<Loop> FindLoops(const DominatorTree &dom) {
+		std::unordered_map<IRBlock *, Loop> loops;
+		for (auto *block : dom.rpo) {
+			for (auto *header : block->succs) {
+				if (!dom.Dominates(header, block)) continue;
+
+				auto &loop = loops[header];
+				loop.header = header;
+				loop.body.insert(header);
+				std::vector<const IRBlock *> pending{ block };
+				while (!pending.empty()) {
+					const auto *member = pending.back();
+					pending.pop_back();
+					if (!loop.body.insert(member).second) continue;
+					pending.insert(pending.end(), member->preds.begin(), member->preds.end());
+				}
+			}
+		}
+
+		std::vector<Loop> ordered;
+		for (auto &[header, loop] : loops) {
+			// The builder only ever enters a loop with a jump from one block
+			std::size_t entries = 0, backEdges = 0;
+			for (auto *pred : header->preds) {
+				if (loop.body.contains(pred)) {
+					backEdges++;
+					loop.latch = pred;
+				}
+				else {
+					entries++;
+					loop.preheader = pred;
+				}
+			}
+			if (entries != 1 || loop.preheader->succs.size() != 1) loop.preheader = nullptr;
+			if (backEdges != 1) loop.latch = nullptr;
+			ordered.push_back(std::move(loop));
+		}
+		std::sort(ordered.begin(), ordered.end(), [&](const Loop &a, const Loop &b) {
+			return a.body.size() != b.body.size() ? a.body.size() < b.body.size() : dom.index.at(a.header) < dom.index.at(b.header);
+		});
+		return ordered;
+	}
+	std::size_t PredIndex(const IRBlock *block, const IRBlock *pred) {
+		return std::find(block->preds.begin(), block->preds.end(), pred) - block->preds.begin();
+	}
+	void InsertBeforeTerminator(IRBlock *block, IRValue *value) {
+		value->block = block;
+		block->insts.insert(block->insts.end() - 1, value);
+	}
+
+	// Same operation on the same operands, constants compare by value
+	std::string ValueKey(const IRValue &value) {
+		std::vector<std::string> operands;
+		for (const auto *op : value.operands) {
+			if (op->op != IROp::CONST) {
+				operands.push_back('v' + std::to_string(op->id));
+			}
+			else if (std::holds_alternative<int>(op->constant)) {
+				operands.push_back('i' + std::to_string(std::get<int>(op->constant)));
+			}
+			else {
+				operands.push_back('f' + std::to_string(std::bit_cast<std::uint32_t>(std::get<float>(op->constant))));
+			}
+		}
+		if (value.op == IROp::ADD || value.op == IROp::MUL || value.op == IROp::EQ) {
+			std::sort(operands.begin(), operands.end());
+		}
+
+		std::string key = std::to_string(static_cast<int>(value.op)) + ':' + std::to_string(static_cast<int>(value.type));
+		if (value.callee) {
+			key += ':' + value.callee->GenerateSignature();
+		}
+		for (const auto &op : operands) {
+			key += ' ' + op;
+		}
+		return key;
+	}
+
+	// Pure values already computed in a dominating block, or earlier in the
+	// same one, are reused instead of computed again
+	bool NumberValues(IRFunction &fn) {
+		const DominatorTree dom(fn);
+		std::vector<std::vector<IRBlock *>> children(dom.rpo.size());
+		for (std::size_t i = 1; i < dom.rpo.size(); ++i) {
+			children[dom.idom[i]].push_back(dom.rpo[i]);
+		}
+
+		std::unordered_map<std::string, IRValue *> available;
+		std::unordered_map<IRValue *, IRValue *> replaced;
+		std::function<void(IRBlock *)> visit = [&](IRBlock *block) {
+			std::vector<std::string> added;
+			for (auto it = block->insts.begin(); it != block->insts.end();) {
+				auto *inst = *it;
+				for (auto &op : inst->operands) {
+					if (auto found = replaced.find(op); found != replaced.end()) op = found->second;
+				}
+
+				const bool numbered = inst->op == IROp::DIV || inst->op == IROp::MOD || IsSpeculatable(*inst);
+				if (!numbered) {
+					++it;
+					continue;
+				}
+
+				auto key = ValueKey(*inst);
+				if (auto found = available.find(key); found != available.end()) {
+					replaced[inst] = found->second;
+					it = block->insts.erase(it);
+					continue;
+				}
+				available.emplace(key, inst);
+				added.push_back(std::move(key));
+				++it;
+			}
+
+			for (auto *child : children[dom.index.at(block)]) {
+				visit(child);
+			}
+			for (const auto &key : added) {
+				available.erase(key);
+			}
+		};
+		visit(fn.blocks[0].get());
+
+		ReplaceUses(fn, replaced);
+		return !replaced.empty();
+	}
+
+	// Moves invariant values of every natural loop to the block that enters it
+	bool HoistLoopInvariants(IRFunction &fn) {
+		const DominatorTree dom(fn);
+
+		// Inner loops come first, what they hoist can move further out
+		bool hoisted = false;
+		for (const auto &loop : FindLoops(dom)) {
+			if (!loop.preheader) continue;
+
+			for (auto *block : dom.rpo) {
+				if (!loop.body.contains(block)) continue;
+
+				for (std::size_t i = 0; i < block->insts.size();) {
+					auto *inst = block->insts[i];
+					const bool invariant = IsSpeculatable(*inst) && std::none_of(inst->operands.begin(), inst->operands.end(),
+						[&](const IRValue *op) { return op->block && loop.body.contains(op->block); });
+					if (!invariant) {
+						++i;
+						continue;
+					}
+
+					block->insts.erase(block->insts.begin() + i);
+					InsertBeforeTerminator(loop.preheader, inst);
+					hoisted = true;
+				}
+			}
+		}
+		return hoisted;
+	}
+
+	// Constant a header phi is advanced by on every trip around the loop
+	std::optional<int> InductionStep(const Loop &loop, const IRValue *phi) {
+		if (!loop.preheader || !loop.latch || phi->op != IROp::PHI || phi->block != loop.header || phi->type != IRType::INT) {
+			return std::nullopt;
+		}
+
+		const auto *next = phi->operands[PredIndex(loop.header, loop.latch)];
+		const auto step = ConstantStep(*next);
+		if (!step || next->operands[0] != phi) {
+			return std::nullopt;
+		}
+		return static_cast<int>(*step);
+	}
+
+	// Products of an induction variable and a constant become induction
+	// variables of their own, advanced by an addition on the back edge
+	bool ReduceInductionProducts(IRFunction &fn) {
+		const DominatorTree dom(fn);
+
+		std::unordered_map<IRValue *, IRValue *> replaced;
+		for (const auto &loop : FindLoops(dom)) {
+			std::vector<IRValue *> products;
+			for (auto *block : dom.rpo) {
+				if (!loop.body.contains(block)) continue;
+
+				std::copy_if(block->insts.begin(), block->insts.end(), std::back_inserter(products), [&](IRValue *inst) {
+					return inst->op == IROp::MUL && inst->type == IRType::INT && !replaced.contains(inst);
+				});
+			}
+
+			for (auto *inst : products) {
+				for (std::size_t side = 0; side < 2; ++side) {
+					auto *counter = inst->operands[side], *factor = inst->operands[1 - side];
+					const auto step = InductionStep(loop, counter);
+					if (!step || factor->op != IROp::CONST || !std::holds_alternative<int>(factor->constant)) continue;
+
+					const auto preIdx = PredIndex(loop.header, loop.preheader);
+					const auto latchIdx = PredIndex(loop.header, loop.latch);
+
+					auto *start = fn.NewValue(IROp::MUL, IRType::INT);
+					start->operands = { counter->operands[preIdx], factor };
+					InsertBeforeTerminator(loop.preheader, start);
+
+					auto *product = fn.NewValue(IROp::PHI, IRType::INT, loop.header);
+					product->operands.resize(loop.header->preds.size());
+					loop.header->phis.push_back(product);
+
+					const auto stride = static_cast<std::uint32_t>(*step) * static_cast<std::uint32_t>(std::get<int>(factor->constant));
+					auto *next = fn.NewValue(IROp::ADD, IRType::INT, loop.latch);
+					next->operands = { product, fn.NewConstant(IRType::INT, static_cast<int>(stride)) };
+
+					// Ahead of the counter's own update so that can still fuse into LOOP
+					auto &latchInsts = loop.latch->insts;
+					auto at = std::find(latchInsts.begin(), latchInsts.end(), counter->operands[latchIdx]);
+					latchInsts.insert(at != latchInsts.end() ? at : latchInsts.end() - 1, next);
+
+					product->operands[preIdx] = start;
+					product->operands[latchIdx] = next;
+					replaced[inst] = product;
+					break;
+				}
+			}
+		}
+		ReplaceUses(fn, replaced);
+		return !replaced.empty();
+	}
+
+	// Bodies of counted loops with at most this many instructions get unrolled
+	constexpr std::size_t unrollBudget = 16;
+
+	// Runs factor copies of a small counted loop body per iteration while at
+	// least that many iterations are left. The original loop stays behind it
+	// for the rest and for limits so low that the unrolled bound wraps around
+	bool UnrollLoops(IRFunction &fn, std::uint32_t factor) {
+		if (factor < 2) return false;
+
+		const DominatorTree dom(fn);
+		bool unrolled = false;
+		for (const auto &loop : FindLoops(dom)) {
+			auto *header = loop.header, *body = loop.latch, *preheader = loop.preheader;
+			if (loop.body.size() != 2 || !body || !preheader || body->preds.size() != 1 || body->insts.size() > unrollBudget) continue;
+
+			// for (...; i < limit; i++) with nothing else in the header
+			auto *branch = header->Terminator();
+			if (header->insts.size() != 2 || branch->op != IROp::BRANCH || header->succs[0] != body) continue;
+			auto *cond = header->insts[0];
+			if (branch->operands[0] != cond || cond->op != IROp::LT || cond->type != IRType::INT) continue;
+			auto *counter = cond->operands[0], *limit = cond->operands[1];
+			if (InductionStep(loop, counter) != 1 || (limit->block && loop.body.contains(limit->block))) continue;
+			const bool condUsed = std::any_of(body->insts.begin(), body->insts.end(), [&](const IRValue *inst) {
+				return std::find(inst->operands.begin(), inst->operands.end(), cond) != inst->operands.end();
+			});
+			if (condUsed) continue;
+
+			const auto preIdx = PredIndex(header, preheader);
+			const auto latchIdx = PredIndex(header, body);
+
+			// Unrolled loop only while counter + factor - 1 < limit
+			auto *bound = fn.NewValue(IROp::SUB, IRType::INT);
+			bound->operands = { limit, fn.NewConstant(IRType::INT, static_cast<int>(factor - 1)) };
+			InsertBeforeTerminator(preheader, bound);
+			auto *wrapped = fn.NewValue(IROp::GT, IRType::INT);
+			wrapped->operands = { bound, limit };
+			InsertBeforeTerminator(preheader, wrapped);
+
+			auto *uHeader = fn.NewBlock();
+			auto *uBody = fn.NewBlock();
+			auto *entry = preheader->Terminator();
+			entry->op = IROp::BRANCH;
+			entry->operands = { wrapped };
+			preheader->succs.push_back(uHeader);
+			uHeader->preds = { preheader, uBody };
+			uHeader->succs = { uBody, header };
+			uBody->preds = { uHeader };
+			uBody->succs = { uHeader };
+			header->preds.push_back(uHeader);
+
+			std::unordered_map<const IRValue *, IRValue *> current;
+			std::vector<std::pair<IRValue *, IRValue *>> phis;
+			for (auto *phi : header->phis) {
+				auto *copy = fn.NewValue(IROp::PHI, phi->type, uHeader);
+				copy->operands = { phi->operands[preIdx], nullptr };
+				uHeader->phis.push_back(copy);
+				phi->operands.push_back(copy);
+				current[phi] = copy;
+				phis.emplace_back(phi, copy);
+			}
+
+			auto *uCond = fn.NewValue(IROp::LT, IRType::INT, uHeader);
+			uCond->operands = { current[counter], bound };
+			auto *uBranch = fn.NewValue(IROp::BRANCH, IRType::VOID, uHeader);
+			uBranch->operands = { uCond };
+			uHeader->insts = { uCond, uBranch };
+
+			for (std::uint32_t copyIdx = 0; copyIdx < factor; ++copyIdx) {
+				std::unordered_map<const IRValue *, IRValue *> cloned;
+				auto map = [&](IRValue *value) {
+					if (auto found = cloned.find(value); found != cloned.end()) return found->second;
+					if (auto found = current.find(value); found != current.end()) return found->second;
+					return value;
+				};
+				for (auto *inst : body->insts) {
+					if (inst->IsTerminator()) continue;
+
+					auto *clone = fn.NewValue(inst->op, inst->type, uBody);
+					clone->constant = inst->constant;
+					clone->callee = inst->callee;
+					clone->pure = inst->pure;
+					for (auto *op : inst->operands) {
+						clone->operands.push_back(map(op));
+					}
+					uBody->insts.push_back(clone);
+					cloned[inst] = clone;
+				}
+
+				std::unordered_map<const IRValue *, IRValue *> next;
+				for (auto &[phi, copy] : phis) {
+					next[phi] = map(phi->operands[latchIdx]);
+				}
+				current = std::move(next);
+			}
+			uBody->insts.push_back(fn.NewValue(IROp::JUMP, IRType::VOID, uBody));
+			for (auto &[phi, copy] : phis) {
+				copy->operands[1] = current[phi];
+			}
+			unrolled = true;
+		}
+		return unrolled;
+	}
+
+	// Phi copies are written at the end of a predecessor, which only works
+	// when it has no other successor
+	void SplitCriticalEdges(IRFunction &fn) {
+		const auto blockCount = fn.blocks.size();
+		for (std::size_t i = 0; i < blockCount; ++i) {
+			auto *block = fn.blocks[i].get();
+			if (block->succs.size() < 2) continue;
+
+			for (auto &succ : block->succs) {
+				if (succ->preds.size() < 2 || succ->phis.empty()) continue;
+
+				auto *edge = fn.NewBlock();
+				edge->insts.push_back(fn.NewValue(IROp::JUMP, IRType::VOID, edge));
+				edge->preds.push_back(block);
+				edge->succs.push_back(succ);
+				*std::find(succ->preds.begin(), succ->preds.end(), block) = edge;
+				succ = edge;
+			}
+		}
+	}
+}
+
+bool IRValue::IsTerminator() const {
+	return op == IROp::JUMP || op == IROp::BRANCH || op == IROp::RETURN || op == IROp::TAILCALL;
+}
+bool IRValue::HasSideEffects() const {
+	return (op == IROp::CALL && !pure) || op == IROp::NATIVECALL || IsTerminator();
+}
+
+IRBlock *IRFunction::NewBlock() {
+	blocks.push_back(std::make_unique<IRBlock>());
+	blocks.back()->id = nextBlockId++;
+	return blocks.back().get();
+}
+IRValue *IRFunction::NewValue(IROp op, IRType type, IRBlock *block) {
+	values.push_back(std::make_unique<IRValue>());
+	auto *value = values.back().get();
+	value->id = static_cast<std::uint32_t>(values.size() - 1);
+	value->op = op;
+	value->type = type;
+	value->block = block;
+	return value;
+}
+IRValue *IRFunction::NewConstant(IRType type, int value) {
+	auto *constant = NewValue(IROp::CONST, type);
+	if (type == IRType::FLOAT) {
+		constant->constant = static_cast<float>(value);
+	}
+	else {
+		constant->constant = value;
+	}
+	return constant;
+}
+
+void IRFunction::Print(std::ostream &out) const {
+	static const char *opNames[] = {
+		"const", "param", "phi", "add", "sub", "mul", "div", "mod", "eq", "lt", "gt", "itof", "ftoi",
+		"call", "nativecall", "jump", "branch", "return", "tailcall"
+	};
+	auto printOperand = [&](const IRValue *op) {
+		if (op->op != IROp::CONST) {
+			out << " v" << op->id;
+		}
+		else if (std::holds_alternative<int>(op->constant)) {
+			out << ' ' << std::get<int>(op->constant);
+		}
+		else {
+			out << ' ' << std::get<float>(op->constant) << 'f';
+		}
+	};
+	auto printValue = [&](const IRValue *value) {
+		out << "  ";
+		if (value->type != IRType::VOID && !value->IsTerminator()) {
+			out << 'v' << value->id << " = ";
+		}
+		out << opNames[static_cast<int>(value->op)];
+		if (value->callee) {
+			out << ' ' << value->callee->name.value;
+		}
+		for (const auto *op : value->operands) {
+			printOperand(op);
+		}
+		if (value->IsTerminator()) {
+			for (const auto *succ : value->block->succs) out << " b" << succ->id;
+		}
+		out << '\n';
+	};
+
+	out << func->GenerateSignature() << ':';
+	for (const auto *param : params) {
+		out << " v" << param->id;
+	}
+	out << '\n';
+	for (const auto &block : blocks) {
+		out << 'b' << block->id << ':';
+		for (const auto *pred : block->preds) out << " b" << pred->id;
+		out << '\n';
+		for (const auto *phi : block->phis) printValue(phi);
+		for (const auto *inst : block->insts) printValue(inst);
+	}
+}
+
+IRFunction BuildIR(Parser &parser, Scope &scope, FuncDeclStmt &stmt) {
+	return IRBuilder{ parser, scope }.Build(stmt);
+}
+
+bool IsPure(const IRFunction &fn, const IRPureSet &pure) {
+	const DominatorTree dom(fn);
+	for (const auto *block : dom.rpo) {
+		// Loops might never finish
+		for (const auto *succ : block->succs) {
+			if (dom.index.at(succ) <= dom.index.at(block)) return false;
+		}
+
+		for (const auto *inst : block->insts) {
+			switch (inst->op) {
+				case IROp::NATIVECALL:
+					return false;
+				case IROp::CALL:
+				case IROp::TAILCALL:
+					if (!pure.contains(inst->callee)) return false;
+					break;
+				case IROp::DIV:
+				case IROp::MOD:
+					if (!IsSpeculatable(*inst)) return false;
+					break;
+			}
+		}
+	}
+	return true;
+}
+
+void OptimizeIR(IRFunction &fn, const IRPureSet &pure, std::uint32_t unrollFactor) {
+	for (auto &value : fn.values) {
+		value->pure = value->op == IROp::CALL && pure.contains(value->callee);
+	}
+
+	auto simplify = [&]() {
+		bool changed = true;
+		while (changed) {
+			changed = FoldConstants(fn);
+			changed |= NumberValues(fn);
+			changed |= FoldBranches(fn);
+			changed |= RemoveUnreachableBlocks(fn);
+			changed |= RemoveTrivialPhis(fn);
+			changed |= RemoveDeadValues(fn);
+			changed |= MergeBlocks(fn);
+			changed |= HoistLoopInvariants(fn);
+			changed |= ReduceInductionProducts(fn);
+		}
+	};
+	simplify();
+
+	// Once, the unrolled copy is a counted loop too
+	if (UnrollLoops(fn, unrollFactor)) {
+		simplify();
+	}
+}
+
+std::uint32_t EmitIR(std::ostream &out, IRFunction &fn, const IREmitCall &emitCall) {
+	SplitCriticalEdges(fn);
+
+	// Reverse postorder with the true successor of a branch right after it.
+	// Returning blocks go last, the one returning nothing can then fall off
+	std::vector<IRBlock *> layout;
+	{
+		std::unordered_set<const IRBlock *> visited;
+		std::vector<IRBlock *> postorder;
+		std::function<void(IRBlock *)> visit = [&](IRBlock *block) {
+			visited.insert(block);
+			for (auto it = block->succs.rbegin(); it != block->succs.rend(); ++it) {
+				if (!visited.contains(*it)) visit(*it);
+			}
+			postorder.push_back(block);
+		};
+		visit(fn.blocks[0].get());
+		layout.assign(postorder.rbegin(), postorder.rend());
+
+		auto rank = [](const IRBlock *block) {
+			const auto *term = block->Terminator();
+			if (term->op != IROp::RETURN) return 0;
+			return term->operands.empty() ? 2 : 1;
+		};
+		std::stable_sort(layout.begin(), layout.end(), [&](const IRBlock *a, const IRBlock *b) { return rank(a) < rank(b); });
+	}
+	std::unordered_map<const IRBlock *, std::size_t> layoutIdx;
+	for (std::size_t i = 0; i < layout.size(); ++i) {
+		layoutIdx[layout[i]] = i;
+	}
+
+	std::unordered_map<const IRValue *, std::size_t> position, useCount;
+	std::unordered_map<const IRValue *, const IRValue *> user;
+	for (const auto *block : layout) {
+		for (const auto *phi : block->phis) {
+			for (const auto *op : phi->operands) {
+				useCount[op]++;
+				user[op] = phi;
+			}
+		}
+		for (std::size_t i = 0; i < block->insts.size(); ++i) {
+			position[block->insts[i]] = i;
+			for (const auto *op : block->insts[i]->operands) {
+				useCount[op]++;
+				user[op] = block->insts[i];
+			}
+		}
+	}
+
+	// Values used once, later in the same block, are computed right where
+	// they are used and never touch a slot. Calls keep their order. So are
+	// values used twice by the same binary operation, through a DUP
+	std::unordered_map<const IRValue *, const IRValue *> root;
+	auto isSquared = [&](const IRValue *value) {
+		const auto *valueUser = user[value];
+		return useCount[value] == 2 && valueUser->operands.size() == 2 && valueUser->operands[0] == value && valueUser->operands[1] == value;
+	};
+	for (const auto *block : layout) {
+		for (std::size_t i = block->insts.size(); i-- > 0;) {
+			const auto *value = block->insts[i];
+			if (value->IsTerminator() || value->type == IRType::VOID || (useCount[value] != 1 && !isSquared(value))) continue;
+
+			const auto *valueUser = user[value];
+			if (valueUser->op == IROp::PHI || valueUser->block != block) continue;
+
+			auto found = root.find(valueUser);
+			const auto *valueRoot = found != root.end() ? found->second : valueUser;
+			if (value->HasSideEffects()) {
+				const auto end = position[valueRoot];
+				const bool reordered = std::any_of(block->insts.begin() + i + 1, block->insts.begin() + end,
+					[](const IRValue *between) { return between->HasSideEffects(); });
+				if (reordered) continue;
+			}
+			root[value] = valueRoot;
+		}
+	}
+
+	auto needsSlot = [&](const IRValue *value) {
+		return value->op != IROp::CONST && !value->IsTerminator() && !root.contains(value) && useCount[value] > 0;
+	};
+	// Slot values read when emitting value, looking through inlined ones
+	std::function<void(const IRValue *, std::vector<const IRValue *> &)> slotOperands = [&](const IRValue *value, std::vector<const IRValue *> &ops) {
+		for (const auto *op : value->operands) {
+			if (op->op == IROp::CONST) continue;
+			if (root.contains(op)) {
+				slotOperands(op, ops);
+			}
+			else {
+				ops.push_back(op);
+			}
+		}
+	};
+
+	// Liveness over the values that own a slot
+	using ValueSet = std::unordered_set<const IRValue *>;
+	std::unordered_map<const IRBlock *, ValueSet> liveIn, liveOut, upward, defs, phiUses;
+	for (const auto *block : layout) {
+		auto &blockDefs = defs[block];
+		if (block == fn.blocks[0].get()) {
+			blockDefs.insert(fn.params.begin(), fn.params.end());
+		}
+		blockDefs.insert(block->phis.begin(), block->phis.end());
+
+		for (const auto *inst : block->insts) {
+			if (root.contains(inst)) continue;
+
+			std::vector<const IRValue *> ops;
+			slotOperands(inst, ops);
+			for (const auto *op : ops) {
+				if (!blockDefs.contains(op)) upward[block].insert(op);
+			}
+			blockDefs.insert(inst);
+		}
+
+		for (const auto *succ : block->succs) {
+			const auto predIdx = std::find(succ->preds.begin(), succ->preds.end(), block) - succ->preds.begin();
+			for (const auto *phi : succ->phis) {
+				if (phi->operands[predIdx]->op != IROp::CONST) phiUses[block].insert(phi->operands[predIdx]);
+			}
+		}
+	}
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (auto it = layout.rbegin(); it != layout.rend(); ++it) {
+			const auto *block = *it;
+			ValueSet out = phiUses[block];
+			for (const auto *succ : block->succs) {
+				for (const auto *value : liveIn[succ]) {
+					if (value->op != IROp::PHI || value->block != succ) out.insert(value);
+				}
+			}
+			ValueSet in = upward[block];
+			for (const auto *value : out) {
+				if (!defs[block].contains(value)) in.insert(value);
+			}
+
+			if (in != liveIn[block] || out != liveOut[block]) {
+				liveIn[block] = std::move(in);
+				liveOut[block] = std::move(out);
+				changed = true;
+			}
+		}
+	}
+
+	std::unordered_map<const IRValue *, ValueSet> interference;
+	auto interfere = [&](const IRValue *a, const IRValue *b) {
+		if (a == b) return;
+		interference[a].insert(b);
+		interference[b].insert(a);
+	};
+	for (const auto *block : layout) {
+		ValueSet live = liveOut[block];
+		for (auto it = block->insts.rbegin(); it != block->insts.rend(); ++it) {
+			const auto *inst = *it;
+			if (root.contains(inst)) continue;
+
+			if (needsSlot(inst)) {
+				live.erase(inst);
+				for (const auto *other : live) interfere(inst, other);
+			}
+			std::vector<const IRValue *> ops;
+			slotOperands(inst, ops);
+			live.insert(ops.begin(), ops.end());
+		}
+
+		// Phis and parameters are all defined when the block starts
+		std::vector<const IRValue *> startDefs(block->phis.begin(), block->phis.end());
+		if (block == fn.blocks[0].get()) {
+			startDefs.insert(startDefs.end(), fn.params.begin(), fn.params.end());
+		}
+		std::erase_if(startDefs, [&](const IRValue *value) { return !needsSlot(value); });
+		for (const auto *def : startDefs) {
+			for (const auto *other : live) interfere(def, other);
+			for (const auto *other : startDefs) interfere(def, other);
+		}
+	}
+
+	// Greedy coloring, parameters stay where the caller put them. Phis and
+	// the values flowing into them try to share a slot to save the copy
+	std::unordered_map<const IRValue *, std::uint32_t> slots;
+	std::uint32_t frameSize = 0;
+	for (const auto *param : fn.params) {
+		if (!needsSlot(param)) continue;
+		slots[param] = param->param;
+		frameSize = std::max(frameSize, param->param + 1);
+	}
+	auto assign = [&](const IRValue *value, const std::vector<const IRValue *> &hints) {
+		std::unordered_set<std::uint32_t> taken;
+		for (const auto *other : interference[value]) {
+			if (auto found = slots.find(other); found != slots.end()) taken.insert(found->second);
+		}
+
+		std::uint32_t slot = 0;
+		auto hint = std::find_if(hints.begin(), hints.end(), [&](const IRValue *other) {
+			return slots.contains(other) && !taken.contains(slots[other]);
+		});
+		if (hint != hints.end()) {
+			slot = slots[*hint];
+		}
+		else {
+			while (taken.contains(slot)) slot++;
+		}
+		slots[value] = slot;
+		frameSize = std::max(frameSize, slot + 1);
+	};
+	for (const auto *block : layout) {
+		for (const auto *phi : block->phis) {
+			if (needsSlot(phi)) assign(phi, { phi->operands.begin(), phi->operands.end() });
+		}
+	}
+	for (const auto *block : layout) {
+		for (const auto *inst : block->insts) {
+			if (!needsSlot(inst)) continue;
+
+			std::vector<const IRValue *> hints;
+			if (useCount[inst] == 1 && user[inst]->op == IROp::PHI) hints.push_back(user[inst]);
+			if (!inst->operands.empty()) hints.push_back(inst->operands[0]);
+			assign(inst, hints);
+		}
+	}
+
+	// Additions of a constant that can update their operand's slot in place
+	auto inPlaceStep = [&](const IRValue *inst) -> std::optional<int> {
+		const auto step = ConstantStep(*inst);
+		if (!step || !needsSlot(inst) || !slots.contains(inst->operands[0]) || slots[inst->operands[0]] != slots[inst]) {
+			return std::nullopt;
+		}
+		return static_cast<int>(*step);
+	};
+
+	// Blocks that jump back to the header of a counted loop, with the
+	// increment of the counter. Increment, compare and jump become one LOOP
+	std::unordered_map<const IRBlock *, const IRValue *> loopIncrements;
+	for (std::size_t i = 0; i < layout.size(); ++i) {
+		const auto *block = layout[i];
+		const auto *term = block->Terminator();
+		if (term->op != IROp::JUMP) continue;
+
+		const auto *header = block->succs[0];
+		if (header->insts.size() != 2 || header->insts[1]->op != IROp::BRANCH || layoutIdx[header->succs[0]] > i) continue;
+		const auto *cond = header->insts[0];
+		auto condRoot = root.find(cond);
+		if (cond->op != IROp::LT || cond->type != IRType::INT || condRoot == root.end() || condRoot->second != header->insts[1]) continue;
+
+		const auto *counter = cond->operands[0], *limit = cond->operands[1];
+		const bool limitReady = limit->op == IROp::CONST ? std::holds_alternative<int>(limit->constant) : slots.contains(limit) && limit != counter;
+		if (counter->op != IROp::PHI || counter->block != header || !limitReady) continue;
+
+		// Unrolled loops step by more than one, LOOP adds the last one
+		const auto *increment = counter->operands[PredIndex(header, block)];
+		const auto step = increment->block == block ? inPlaceStep(increment) : std::nullopt;
+		if (useCount[increment] != 1 || !step || *step < 1 || slots[increment] != slots[counter]) continue;
+
+		// Nothing after it may read the counter before it is incremented
+		auto at = std::find(block->insts.begin(), block->insts.end(), increment);
+		const bool readLater = std::any_of(at + 1, block->insts.end(), [&](const IRValue *inst) {
+			if (inst->IsTerminator() || root.contains(inst)) return false;
+
+			std::vector<const IRValue *> ops;
+			slotOperands(inst, ops);
+			return std::any_of(ops.begin(), ops.end(), [&](const IRValue *op) { return slots[op] == slots[increment]; });
+		});
+		if (!readLater) {
+			loopIncrements[block] = increment;
+		}
+	}
+
+	// Blocks that emit nothing at all, they fall through into what follows
+	std::vector<bool> emitsNothing(layout.size());
+	auto fallsInto = [&](std::size_t i, const IRBlock *target) {
+		for (std::size_t j = i + 1; j < layout.size(); ++j) {
+			if (layout[j] == target) return true;
+			if (!emitsNothing[j]) return false;
+		}
+		return target == nullptr;
+	};
+	for (std::size_t i = layout.size(); i-- > 1;) {
+		const auto *block = layout[i];
+		if (block->insts.size() != 1 || block->Terminator()->op != IROp::JUMP || loopIncrements.contains(block)) continue;
+
+		const auto *succ = block->succs[0];
+		const auto predIdx = PredIndex(succ, block);
+		const bool copies = std::any_of(succ->phis.begin(), succ->phis.end(), [&](const IRValue *phi) {
+			const auto *incoming = phi->operands[predIdx];
+			return needsSlot(phi) && !(slots.contains(incoming) && slots[incoming] == slots[phi]);
+		});
+		emitsNothing[i] = !copies && fallsInto(i, succ);
+	}
+
+	std::string code;
+	enum class FixupKind {
+		JUMP,	// pos is a SKIP/BACK, picked once the target is known
+		IF,		// pos is the operand of an IF
+		LOOP	// pos is the jump operand of a LOOP
+	};
+	struct Fixup {
+		std::size_t pos;
+		const IRBlock *target;	// null for the end of the body
+		FixupKind kind;
+	};
+	std::vector<Fixup> fixups;
+	std::unordered_map<const IRBlock *, std::size_t> blockStart;
+
+	auto put = [&](InstructionCode c) { code.push_back(static_cast<char>(GetCode(c))); };
+	auto putRaw = [&](const auto &operand) { code.append(reinterpret_cast<const char *>(&operand), sizeof(operand)); };
+	auto jumpTo = [&](const IRBlock *target) {
+		fixups.push_back({ code.size(), target, FixupKind::JUMP });
+		put(InstructionCode::SKIP);
+		putRaw(std::uint32_t{ 0 });
+	};
+	auto putStep = [&](std::uint32_t slot, int step) {
+		if (step == 1 || step == -1) {
+			put(step == 1 ? InstructionCode::INC : InstructionCode::DEC);
+			putRaw(slot);
+		}
+		else if (step) {
+			put(InstructionCode::INCBY);
+			putRaw(slot);
+			putRaw(step);
+		}
+	};
+	auto putCall = [&](const IRValue *call, bool tailCall) {
+		std::ostringstream callCode;
+		emitCall(callCode, *call->callee, static_cast<std::uint32_t>(call->operands.size()), tailCall, frameSize);
+		code += callCode.str();
+	};
+
+	std::function<void(const IRValue *)> emitValue, emitOp;
+	emitValue = [&](const IRValue *value) {
+		if (value->op == IROp::CONST) {
+			if (std::holds_alternative<float>(value->constant)) {
+				put(InstructionCode::FCONST);
+				putRaw(std::get<float>(value->constant));
+			}
+			else {
+				put(InstructionCode::ICONST);
+				putRaw(std::get<int>(value->constant));
+			}
+		}
+		else if (root.contains(value)) {
+			emitOp(value);
+		}
+		else {
+			put(value->type == IRType::FLOAT ? InstructionCode::FLOAD : InstructionCode::ILOAD);
+			putRaw(slots[value]);
+		}
+	};
+	emitOp = [&](const IRValue *value) {
+		if (value->operands.size() == 2 && value->operands[0] == value->operands[1] && root.contains(value->operands[0])) {
+			emitValue(value->operands[0]);
+			put(InstructionCode::DUP);
+		}
+		else {
+			for (const auto *op : value->operands) {
+				emitValue(op);
+			}
+		}
+
+		const bool floating = value->type == IRType::FLOAT;
+		switch (value->op) {
+			case IROp::ADD: put(floating ? InstructionCode::FADD : InstructionCode::IADD); break;
+			case IROp::SUB: put(floating ? InstructionCode::FSUB : InstructionCode::ISUB); break;
+			case IROp::MUL: put(floating ? InstructionCode::FMUL : InstructionCode::IMUL); break;
+			case IROp::DIV: put(floating ? InstructionCode::FDIV : InstructionCode::IDIV); break;
+			case IROp::MOD: put(InstructionCode::MOD); break;
+			case IROp::EQ: put(floating ? InstructionCode::FEQ : InstructionCode::IEQ); break;
+			case IROp::LT: put(floating ? InstructionCode::FLE : InstructionCode::ILE); break;
+			case IROp::GT: put(floating ? InstructionCode::FGE : InstructionCode::IGE); break;
+			case IROp::ITOF: put(InstructionCode::ITOF); break;
+			case IROp::FTOI: put(InstructionCode::FTOI); break;
+			case IROp::CALL:
+			case IROp::NATIVECALL:
+				putCall(value, false);
+				break;
+		}
+	};
+
+	for (std::size_t i = 0; i < layout.size(); ++i) {
+		const auto *block = layout[i];
+		blockStart[block] = code.size();
+
+		for (const auto *inst : block->insts) {
+			if (inst->IsTerminator() || root.contains(inst)) continue;
+			if (!useCount[inst] && !inst->HasSideEffects()) continue;
+			if (auto found = loopIncrements.find(block); found != loopIncrements.end() && found->second == inst) continue;
+
+			// Counters updated in place
+			if (auto step = inPlaceStep(inst)) {
+				putStep(slots[inst], *step);
+				continue;
+			}
+
+			emitOp(inst);
+			if (needsSlot(inst)) {
+				put(inst->type == IRType::FLOAT ? InstructionCode::FSTORE : InstructionCode::ISTORE);
+				putRaw(slots[inst]);
+			}
+			else if (inst->type != IRType::VOID) {
+				put(InstructionCode::POP);
+			}
+		}
+
+		const auto *term = block->Terminator();
+		switch (term->op) {
+			case IROp::JUMP: {
+				// Incoming values all go on the stack first, so phis that
+				// read each other still see the old values
+				const auto *succ = block->succs[0];
+				const auto predIdx = std::find(succ->preds.begin(), succ->preds.end(), block) - succ->preds.begin();
+				std::vector<const IRValue *> moved;
+				for (const auto *phi : succ->phis) {
+					const auto *incoming = phi->operands[predIdx];
+					if (!needsSlot(phi) || (slots.contains(incoming) && slots[incoming] == slots[phi])) continue;
+
+					emitValue(incoming);
+					moved.push_back(phi);
+				}
+				for (auto it = moved.rbegin(); it != moved.rend(); ++it) {
+					put((*it)->type == IRType::FLOAT ? InstructionCode::FSTORE : InstructionCode::ISTORE);
+					putRaw(slots[*it]);
+				}
+
+				if (auto found = loopIncrements.find(block); found != loopIncrements.end()) {
+					putStep(slots[found->second], *inPlaceStep(found->second) - 1);
+					emitValue(succ->insts[0]->operands[1]);
+					put(InstructionCode::LOOP);
+					putRaw(slots[found->second]);
+					fixups.push_back({ code.size(), succ->succs[0], FixupKind::LOOP });
+					putRaw(std::uint32_t{ 0 });
+
+					if (!fallsInto(i, succ->succs[1])) jumpTo(succ->succs[1]);
+					break;
+				}
+
+				if (!fallsInto(i, succ)) jumpTo(succ);
+				break;
+			}
+			case IROp::BRANCH: {
+				emitValue(term->operands[0]);
+				const auto *ifTrue = block->succs[0], *ifFalse = block->succs[1];
+				if (fallsInto(i, ifTrue) && layoutIdx[ifFalse] > i) {
+					put(InstructionCode::IF);
+					fixups.push_back({ code.size(), ifFalse, FixupKind::IF });
+					putRaw(std::uint32_t{ 0 });
+					break;
+				}
+
+				// IF only skips forward, so jump from a pair of SKIP/BACKs
+				put(InstructionCode::IF);
+				putRaw(static_cast<std::uint32_t>(1 + sizeof(std::uint32_t)));
+				jumpTo(ifTrue);
+				if (!fallsInto(i, ifFalse)) jumpTo(ifFalse);
+				break;
+			}
+			case IROp::RETURN:
+				if (!term->operands.empty()) {
+					emitValue(term->operands[0]);
+					// The declared type decides, the verifier checks it against the function table
+					put(fn.func->returnType->name.value == "float" ? InstructionCode::FRET : InstructionCode::IRET);
+				}
+				else if (!fallsInto(i, nullptr)) {
+					jumpTo(nullptr);
+				}
+				break;
+			case IROp::TAILCALL:
+				for (const auto *op : term->operands) {
+					emitValue(op);
+				}
+				putCall(term, true);
+				break;
+		}
+	}
+
+	for (const auto &fixup : fixups) {
+		const auto target = fixup.target ? blockStart[fixup.target] : code.size();
+		if (fixup.kind == FixupKind::IF) {
+			const std::uint32_t offset = static_cast<std::uint32_t>(target - (fixup.pos + sizeof(std::uint32_t)));
+			std::memcpy(code.data() + fixup.pos, &offset, sizeof(offset));
+			continue;
+		}
+		if (fixup.kind == FixupKind::LOOP) {
+			const std::uint32_t offset = static_cast<std::uint32_t>(fixup.pos + sizeof(std::uint32_t) - target);
+			std::memcpy(code.data() + fixup.pos, &offset, sizeof(offset));
+			continue;
+		}
+
+		const auto after = fixup.pos + 1 + sizeof(std::uint32_t);
+		const bool forward = target >= after;
+		const std::uint32_t offset = static_cast<std::uint32_t>(forward ? target - after : after - target);
+		code[fixup.pos] = static_cast<char>(GetCode(forward ? InstructionCode::SKIP : InstructionCode::BACK));
+		std::memcpy(code.data() + fixup.pos + 1, &offset, sizeof(offset));
+	}
+
+	out.write(code.data(), code.size());
+	return frameSize;
+}
\ No newline at end of file
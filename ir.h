@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <unordered_set>
+#include <vector>
+#include "parser.hpp"
+#include "native.h"
+
+// SSA form of a single function body, the AST is lowered into it and the
+// bytecode is generated from it. Optimizations work on this instead of
+// on the tree or on raw bytes.
+
+enum class IROp : std::uint8_t {
+	CONST,		// not placed in a block, emitted at every use
+	PARAM,		// not placed in a block, lives in its parameter slot
+	PHI,
+
+	ADD,
+	SUB,
+	MUL,
+	DIV,
+	MOD,
+	EQ,
+	LT,
+	GT,
+	ITOF,
+	FTOI,
+
+	CALL,
+	NATIVECALL,
+
+	// Terminators, always the last instruction of a block
+	JUMP,
+	BRANCH,		// true goes to succs[0], false to succs[1]
+	RETURN,		// returns its operand, nothing without one
+	TAILCALL,
+};
+
+enum class IRType : std::uint8_t {
+	VOID,
+	INT,
+	FLOAT
+};
+
+struct IRBlock;
+struct IRValue {
+	std::uint32_t id = 0;
+	IROp op = IROp::CONST;
+	IRType type = IRType::VOID;
+	IRBlock *block = nullptr;
+	std::vector<IRValue *> operands;	// phis list one per predecessor
+
+	VarType constant{};					// CONST
+	std::uint32_t param = 0;			// PARAM
+	const Function *callee = nullptr;	// CALL, NATIVECALL, TAILCALL
+	bool pure = false;					// CALL of a function in the pure set
+
+	bool IsTerminator() const;
+	bool HasSideEffects() const;
+};
+
+struct IRBlock {
+	std::uint32_t id = 0;
+	std::vector<IRValue *> phis;
+	std::vector<IRValue *> insts;		// terminator last
+	std::vector<IRBlock *> preds, succs;
+
+	IRValue *Terminator() const { return insts.empty() ? nullptr : insts.back(); }
+};
+
+struct IRFunction {
+	const Function *func = nullptr;
+	std::vector<std::unique_ptr<IRBlock>> blocks;	// entry first
+	std::vector<std::unique_ptr<IRValue>> values;	// owns everything, placed or not
+	std::vector<IRValue *> params;
+	std::uint32_t nextBlockId = 0;
+
+	IRBlock *NewBlock();
+	IRValue *NewValue(IROp op, IRType type, IRBlock *block = nullptr);
+	IRValue *NewConstant(IRType type, int value);
+
+	void Print(std::ostream &out) const;
+};
+
+// Lowers a function definition, scope is the function's own parser scope
+IRFunction BuildIR(Parser &parser, Scope &scope, FuncDeclStmt &stmt);
+
+// Functions that always return and do nothing but compute the result,
+// calls to them can be moved or dropped like arithmetic
+using IRPureSet = std::unordered_set<const Function *>;
+
+// Whether fn belongs in the pure set, given the functions already in it.
+// Loops, recursion and divisions that might trap all disqualify it
+bool IsPure(const IRFunction &fn, const IRPureSet &pure);
+
+// Folds constants and branches, drops unreachable blocks and unused values,
+// hoists loop invariant values into the block before the loop and turns
+// products of induction variables into additions. Small counted loops are
+// unrolled unrollFactor times, 1 leaves them alone
+void OptimizeIR(IRFunction &fn, const IRPureSet &pure = {}, std::uint32_t unrollFactor = 1);
+
+// Writes one call, frameSize is the first slot the function does not use
+using IREmitCall = std::function<void(std::ostream &out, const Function &callee, std::uint32_t params, bool tailCall, std::uint32_t frameSize)>;
+
+// Assigns slots to values and writes the body, returns the frame size
+std::uint32_t EmitIR(std::ostream &out, IRFunction &fn, const IREmitCall &emitCall);
\ No newline at end of file
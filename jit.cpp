@@ -0,0 +1,834 @@
+#include "jit.h"
+#include "interpreter.h"
+#include "stencil.h"
+#include "x64.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+namespace {
+	// Native stack compiled code may use per VM entry, calls past it are interpreted
+	constexpr std::uintptr_t stackBudget = 1 << 20;
+
+	// Splits a body into instructions, false when it ends inside one
+	bool Decode(const Program::FunctionCode &func, std::vector<JitInstruction> &insts) {
+		std::size_t pos = 0;
+		while (pos < func.size) {
+			auto inst = DecodeInstruction(func.code, func.size, pos);
+			if (!inst) {
+				return false;
+			}
+			pos = inst->next;
+			insts.push_back(inst.value());
+		}
+		return true;
+	}
+
+#ifdef JIT_X86_64
+	using namespace x64;
+
+	// Operand stack value the generated code has not pushed yet
+	struct Operand {
+		enum Kind : std::uint8_t {
+			STACK,	// already on the machine stack
+			EAX,	// computed, at most one pending value is in eax
+			ECX,	// right operand moved out of eax
+			IMM,
+			LOCAL,
+		} kind = STACK;
+		std::int32_t value = 0;	// constant or slot
+	};
+#endif
+}
+
+bool JitAvailable(JitMode mode) {
+#ifdef JIT_X86_64
+	return mode != JitMode::OFF;
+#else
+	return mode == JitMode::STENCIL;
+#endif
+}
+
+std::optional<JitInstruction> DecodeInstruction(const char *code, std::size_t size, std::size_t pos) {
+	if (pos >= size) {
+		return std::nullopt;
+	}
+	JitInstruction inst;
+	const auto encoded = static_cast<InstructionCode>(code[pos]);
+	inst.pos = static_cast<std::uint32_t>(pos);
+
+	const auto operands = OperandSize(encoded);
+	if (pos + 1 + operands > size) {
+		return std::nullopt;
+	}
+	inst.code = ReadOperands(encoded, code + pos + 1, inst.a, inst.b);
+	inst.next = static_cast<std::uint32_t>(pos + 1 + operands);
+	return inst;
+}
+
+std::optional<std::uint32_t> JumpTarget(const JitInstruction &inst, std::uint32_t size) {
+	std::uint64_t target = 0;
+	switch (inst.code) {
+		case InstructionCode::SKIP:
+		case InstructionCode::IF:
+		case InstructionCode::WHILE:
+		case InstructionCode::FOR:
+			target = static_cast<std::uint64_t>(inst.next) + inst.a;
+			break;
+		case InstructionCode::BACK:
+			target = inst.a > inst.next ? 0 : inst.next - inst.a;
+			break;
+		case InstructionCode::LOOP:
+			target = inst.b > inst.next ? 0 : inst.next - inst.b;
+			break;
+		default:
+			return std::nullopt;
+	}
+	return static_cast<std::uint32_t>(std::min<std::uint64_t>(target, size));
+}
+
+bool IntParams(const std::string &signature) {
+	const auto open = signature.find('(');
+	std::size_t begin = open + 1;
+	while (begin < signature.size() && signature[begin] != ')') {
+		auto end = signature.find_first_of(",)", begin);
+		if (end == std::string::npos || signature.compare(begin, end - begin, "int") != 0) {
+			return false;
+		}
+		begin = signature[end] == ',' ? end + 1 : end;
+	}
+	return true;
+}
+
+std::vector<ReturnKind> FindReturnKinds(const Program &program) {
+	const auto count = program.FunctionCount();
+	std::vector<ReturnKind> kinds(count);
+
+	// A function returns what the functions it tail calls return
+	std::vector<std::vector<std::uint32_t>> tailCallees(count);
+	for (std::uint32_t i = 0; i < count; ++i) {
+		const auto *func = program.GetFunction(i);
+		std::vector<JitInstruction> insts;
+		if (!func || !Decode(*func, insts)) {
+			continue;
+		}
+
+		for (const auto &inst : insts) {
+			if (inst.code == InstructionCode::IRET) {
+				kinds[i].value = true;
+			}
+			else if (inst.code == InstructionCode::FRET) {
+				kinds[i].value = kinds[i].isFloat = true;
+			}
+			else if (inst.code == InstructionCode::TAILCALL && inst.a < count) {
+				tailCallees[i].push_back(inst.a);
+			}
+		}
+	}
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (std::uint32_t i = 0; i < count; ++i) {
+			for (auto callee : tailCallees[i]) {
+				auto &kind = kinds[i];
+				const auto &other = kinds[callee];
+				if ((other.value && !kind.value) || (other.isFloat && !kind.isFloat)) {
+					kind.value |= other.value;
+					kind.isFloat |= other.isFloat;
+					changed = true;
+				}
+			}
+		}
+	}
+	return kinds;
+}
+
+Jit::Jit(VM &vm, const Program &program, JitMode mode, std::uint32_t threshold) : vm(vm), program(program), mode(mode), threshold(threshold) {
+	const auto count = program.FunctionCount();
+	functions.resize(count);
+	code.resize(count);
+	stencils.resize(count);
+	context.code = code.data();
+	context.jit = this;
+
+	const auto kinds = FindReturnKinds(program);
+	for (std::uint32_t i = 0; i < count; ++i) {
+		std::vector<JitInstruction> insts;
+		if (const auto *func = program.GetFunction(i); !func || !Decode(*func, insts)) {
+			functions[i].unsupported = true;
+		}
+		functions[i].returnsValue = kinds[i].value;
+		functions[i].returnsFloat = kinds[i].isFloat;
+	}
+}
+
+Jit::~Jit() {
+#ifdef JIT_X86_64
+	for (auto [page, size] : pages) {
+		x64::Unmap(page, size);
+	}
+#endif
+}
+
+bool Jit::IsCompiled(std::uint32_t funcIdx) const {
+	return mode == JitMode::STENCIL ? stencils[funcIdx] != nullptr : code[funcIdx] != nullptr;
+}
+
+bool Jit::HasStackLeft() const {
+	char marker = 0;
+	return reinterpret_cast<std::uintptr_t>(&marker) >= context.stackLimit;
+}
+
+bool Jit::TryCall(std::uint32_t funcIdx, std::span<const VarType> args, std::optional<VarType> &ret) {
+	auto &state = functions[funcIdx];
+	if (!IsCompiled(funcIdx)) {
+		if (state.unsupported || ++state.calls < threshold) {
+			return false;
+		}
+		if (!Compile(funcIdx)) {
+			state.unsupported = true;
+			return false;
+		}
+	}
+	if (args.size() != program.GetFunction(funcIdx)->arity) {
+		return false;
+	}
+
+	// Compiled frames live on this thread's stack, deep recursion carries on in the interpreter
+	if (activeCalls == 0) {
+		char marker = 0;
+		const auto sp = reinterpret_cast<std::uintptr_t>(&marker);
+		context.stackLimit = sp > stackBudget ? sp - stackBudget : 0;
+	}
+	else if (!HasStackLeft()) {
+		return false;
+	}
+	if (mode == JitMode::STENCIL && arenaTop + stencils[funcIdx]->Slots() > arena.size()) {
+		return false;
+	}
+
+	// Machine code takes arguments the way they lie on its own stack, last one first
+	entryArgs.resize(args.size());
+	stencilArgs.resize(args.size());
+	for (std::size_t i = 0; i < args.size(); ++i) {
+		const auto *value = std::get_if<int>(&args[i]);
+		if (!value) {
+			return false;
+		}
+		entryArgs[args.size() - 1 - i] = stencilArgs[i] = *value;
+	}
+
+	using Entry = int (*)(Context *ctx, const std::int64_t *args);
+	int value = 0;
+	++activeCalls;
+	try {
+		if (mode == JitMode::STENCIL) {
+			value = RunStencils(funcIdx, stencilArgs.data());
+		}
+		else {
+			value = reinterpret_cast<Entry>(code[funcIdx])(&context, entryArgs.data());
+		}
+	}
+	catch (...) {
+		--activeCalls;
+		throw;
+	}
+	--activeCalls;
+
+	if (context.failed) {
+		context.failed = 0;
+		std::rethrow_exception(std::exchange(error, nullptr));
+	}
+	ret = state.returnsValue ? std::optional<VarType>{ value } : std::nullopt;
+	return true;
+}
+
+int Jit::CallFromJit(Context *ctx, std::uint32_t funcIdx, const std::int64_t *args) {
+	auto &jit = *ctx->jit;
+	try {
+		const auto arity = jit.program.GetFunction(funcIdx)->arity;
+		std::vector<VarType> values(arity);
+		for (std::uint32_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = jit.vm.Call(FunctionHandle{ funcIdx, arity }, values);
+		if (const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr) {
+			return *value;
+		}
+	}
+	catch (...) {
+		jit.error = std::current_exception();
+		ctx->failed = 1;
+	}
+	return 0;
+}
+
+// Memoized calls always go through the VM, which owns the caches
+int Jit::MemoFromJit(Context *ctx, std::uint32_t funcIdx, const std::int64_t *args) {
+	auto &jit = *ctx->jit;
+	try {
+		const auto arity = jit.program.GetFunction(funcIdx)->arity;
+		std::vector<VarType> values(arity);
+		for (std::uint32_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = jit.vm.CallMemoized(FunctionHandle{ funcIdx, arity }, values);
+		if (const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr) {
+			return *value;
+		}
+	}
+	catch (...) {
+		jit.error = std::current_exception();
+		ctx->failed = 1;
+	}
+	return 0;
+}
+
+int Jit::NativeFromJit(Context *ctx, std::uint32_t nativeIdx, const std::int64_t *args) {
+	auto &jit = *ctx->jit;
+	try {
+		const auto &native = jit.program.GetNative(nativeIdx);
+		const auto arity = native.paramTypes.size();
+		std::vector<VarType> values(arity);
+		for (std::size_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = native.fn(values.data());
+		if (const auto *value = std::get_if<int>(&ret)) {
+			return *value;
+		}
+	}
+	catch (...) {
+		jit.error = std::current_exception();
+		ctx->failed = 1;
+	}
+	return 0;
+}
+
+bool Jit::Compile(std::uint32_t funcIdx) {
+	const auto *func = program.GetFunction(funcIdx);
+	const auto arity = func->arity;
+	const auto size = static_cast<std::uint32_t>(func->size);
+	if (!IntParams(program.GetSignature(FunctionHandle{ funcIdx, arity }))) {
+		return false;
+	}
+
+	std::vector<JitInstruction> insts;
+	if (!Decode(*func, insts)) {
+		return false;
+	}
+
+	// Check everything is supported, find the frame size and the jump targets
+	std::vector<bool> starts(size + 1), targets(size + 1);
+	starts[size] = true;
+	for (const auto &inst : insts) {
+		starts[inst.pos] = true;
+	}
+
+	std::uint32_t frameSize = arity;
+	for (const auto &inst : insts) {
+		switch (inst.code) {
+			case InstructionCode::NOP:
+			case InstructionCode::ELSE:
+			case InstructionCode::ENDIF:
+			case InstructionCode::SKIP:
+			case InstructionCode::BACK:
+			case InstructionCode::ICONST:
+			case InstructionCode::ILOAD:
+			case InstructionCode::ISTORE:
+			case InstructionCode::POP:
+			case InstructionCode::DUP:
+			case InstructionCode::IADD:
+			case InstructionCode::ISUB:
+			case InstructionCode::IMUL:
+			case InstructionCode::IDIV:
+			case InstructionCode::MOD:
+			case InstructionCode::INC:
+			case InstructionCode::DEC:
+			case InstructionCode::INCBY:
+			case InstructionCode::LOOP:
+			case InstructionCode::IEQ:
+			case InstructionCode::ILE:
+			case InstructionCode::IGE:
+			case InstructionCode::IRET:
+			case InstructionCode::IF:
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR:
+				break;
+			case InstructionCode::FUNCTIONCALL:
+			case InstructionCode::MEMOCALL:
+			case InstructionCode::TAILCALL: {
+				const auto *callee = inst.a < functions.size() ? program.GetFunction(inst.a) : nullptr;
+				if (!callee || callee->arity != inst.b || functions[inst.a].returnsFloat) {
+					return false;
+				}
+				break;
+			}
+			case InstructionCode::NATIVECALL: {
+				const auto &native = program.GetNative(inst.a);
+				const bool intParams = std::all_of(native.paramTypes.begin(), native.paramTypes.end(), [](const std::string &type) { return type == "int"; });
+				if (!intParams || native.paramTypes.size() != inst.b || (native.returnType != "int" && native.returnType != "void")) {
+					return false;
+				}
+				break;
+			}
+			default:
+				return false;
+		}
+
+		if (IsSlotInstruction(inst.code)) {
+			frameSize = std::max(frameSize, inst.a + 1);
+		}
+		if (auto target = JumpTarget(inst, size)) {
+			if (!starts[target.value()]) {
+				return false;
+			}
+			targets[target.value()] = true;
+		}
+	}
+	if (frameSize > (1u << 20)) {
+		return false;
+	}
+	if (mode == JitMode::STENCIL) {
+		return CompileStencils(funcIdx, insts, targets, frameSize);
+	}
+	return CompileNative(funcIdx, insts, targets, frameSize);
+}
+
+bool Jit::CompileNative(std::uint32_t funcIdx, const std::vector<JitInstruction> &insts, const std::vector<bool> &targets, std::uint32_t frameSize) {
+#ifdef JIT_X86_64
+	const auto arity = program.GetFunction(funcIdx)->arity;
+	const auto size = static_cast<std::uint32_t>(program.GetFunction(funcIdx)->size);
+
+
+	// Frame: saved rbp, rbx and r12, then the locals, then the operand stack
+	const std::int32_t frameBytes = static_cast<std::int32_t>((frameSize * sizeof(std::int32_t) + 15) & ~15u);
+	const auto localDisp = [&](std::int32_t slot) { return -16 - frameBytes + slot * static_cast<std::int32_t>(sizeof(std::int32_t)); };
+	const auto codeOffset = static_cast<std::int32_t>(offsetof(Context, code));
+	const auto limitOffset = static_cast<std::int32_t>(offsetof(Context, stackLimit));
+	const auto failedOffset = static_cast<std::int32_t>(offsetof(Context, failed));
+	const auto tailArgsOffset = static_cast<std::int32_t>(offsetof(Context, tailArgs));
+
+	Assembler as;
+	std::vector<Assembler::Label> labels(size + 1);
+	Assembler::Label bodyStart, epilogue;
+
+	// Values stay pending as long as possible so constants and locals
+	// become instruction operands instead of pushes and pops
+	std::vector<Operand> pending;
+	auto spill = [&]() {
+		for (const auto &operand : pending) {
+			switch (operand.kind) {
+				case Operand::EAX: as.Emit({ 0x50 }); break;						// push rax
+				case Operand::IMM: as.Emit({ 0x68 }); as.Imm32(operand.value); break;	// push imm32
+				case Operand::LOCAL: as.Frame({ 0xFF }, 6, localDisp(operand.value)); break;	// push qword [local]
+				default: break;
+			}
+		}
+		pending.clear();
+	};
+	auto pop = [&]() {
+		if (pending.empty()) {
+			return Operand{};
+		}
+		auto operand = pending.back();
+		pending.pop_back();
+		return operand;
+	};
+	auto freeEax = [&]() {
+		if (std::any_of(pending.begin(), pending.end(), [](const Operand &operand) { return operand.kind == Operand::EAX; })) {
+			spill();
+		}
+	};
+	// Pending loads of slot have to happen before it is written
+	auto spillIfReads = [&](std::int32_t slot) {
+		if (std::any_of(pending.begin(), pending.end(), [&](const Operand &operand) { return operand.kind == Operand::LOCAL && operand.value == slot; })) {
+			spill();
+		}
+	};
+	auto toEax = [&](const Operand &operand) {
+		switch (operand.kind) {
+			case Operand::STACK: as.Emit({ 0x58 }); break;						// pop rax
+			case Operand::IMM: as.Emit({ 0xB8 }); as.Imm32(operand.value); break;	// mov eax, imm32
+			case Operand::LOCAL: as.Frame({ 0x8B }, 0, localDisp(operand.value)); break;	// mov eax, [local]
+			default: break;
+		}
+	};
+	// Left operand into eax, the right one stays an immediate, a local or ecx
+	auto binaryOperands = [&]() {
+		auto right = pop(), left = pop();
+		if (right.kind == Operand::STACK) {
+			as.Emit({ 0x59, 0x58 });		// pop rcx, pop rax
+			right.kind = Operand::ECX;
+		}
+		else if (right.kind == Operand::EAX) {
+			as.Emit({ 0x89, 0xC1 });		// mov ecx, eax
+			right.kind = Operand::ECX;
+			toEax(left);
+		}
+		else if (left.kind != Operand::EAX) {
+			freeEax();
+			toEax(left);
+		}
+		return right;
+	};
+	// eax op= right for add, sub, imul and cmp
+	auto arith = [&](InstructionCode c, const Operand &right) {
+		struct Encoding { std::vector<std::uint8_t> imm, mem, ecx; };
+		static const Encoding add{ { 0x05 }, { 0x03 }, { 0x01, 0xC8 } };
+		static const Encoding sub{ { 0x2D }, { 0x2B }, { 0x29, 0xC8 } };
+		static const Encoding mul{ { 0x69, 0xC0 }, { 0x0F, 0xAF }, { 0x0F, 0xAF, 0xC1 } };
+		static const Encoding cmp{ { 0x3D }, { 0x3B }, { 0x39, 0xC8 } };
+		const auto &enc = c == InstructionCode::IADD ? add : c == InstructionCode::ISUB ? sub : c == InstructionCode::IMUL ? mul : cmp;
+
+		if (right.kind == Operand::IMM) {
+			as.Emit(enc.imm);
+			as.Imm32(right.value);
+		}
+		else if (right.kind == Operand::LOCAL) {
+			as.Frame(enc.mem, 0, localDisp(right.value));
+		}
+		else {
+			as.Emit(enc.ecx);
+		}
+	};
+	// rdi context, esi index, rdx arguments, stack aligned for the C++ side
+	auto callHelper = [&](int (*helper)(Context *, std::uint32_t, const std::int64_t *), std::uint32_t idx) {
+		as.Emit({ 0x48, 0x89, 0xDF });				// mov rdi, rbx
+		as.Emit({ 0xBE }); as.Imm32(static_cast<std::int32_t>(idx));	// mov esi, idx
+		as.Emit({ 0x48, 0x89, 0xE2 });				// mov rdx, rsp
+		as.Emit({ 0x48, 0xB8 }); as.Imm64(reinterpret_cast<std::uint64_t>(helper));	// mov rax, helper
+		as.Emit({ 0x49, 0x89, 0xE4 });				// mov r12, rsp
+		as.Emit({ 0x48, 0x83, 0xE4, 0xF0 });		// and rsp, -16
+		as.Emit({ 0xFF, 0xD0 });					// call rax
+		as.Emit({ 0x4C, 0x89, 0xE4 });				// mov rsp, r12
+	};
+	auto checkFailed = [&]() {
+		as.Context({ 0x80 }, 7, failedOffset); as.Emit({ 0x00 });	// cmp byte [failed], 0
+		as.JumpIf(NOT_EQUAL, epilogue);
+	};
+	auto loadEntry = [&](std::uint32_t callee) {
+		as.Context({ 0x48, 0x8B }, 0, codeOffset);	// mov rax, [code]
+		as.Emit({ 0x48, 0x8B, 0x80 }); as.Imm32(static_cast<std::int32_t>(callee * sizeof(void *)));	// mov rax, [rax + callee]
+		as.Emit({ 0x48, 0x85, 0xC0 });				// test rax, rax
+	};
+	auto dropArgs = [&](std::uint32_t params) {
+		if (params) {
+			as.Emit({ 0x48, 0x81, 0xC4 }); as.Imm32(static_cast<std::int32_t>(params * sizeof(std::int64_t)));	// add rsp, params
+		}
+	};
+	auto leave = [&]() {
+		as.Emit({ 0x48, 0x8D, 0x65, 0xF0 });		// lea rsp, [rbp - 16]
+		as.Emit({ 0x41, 0x5C, 0x5B, 0x5D });		// pop r12, pop rbx, pop rbp
+	};
+	// Calls compiled callees directly while there is stack left, the VM otherwise
+	auto emitCall = [&](std::uint32_t callee, std::uint32_t params) {
+		Assembler::Label slow, done;
+		loadEntry(callee);
+		as.JumpIf(EQUAL, slow);
+		as.Context({ 0x48, 0x3B }, 4, limitOffset);	// cmp rsp, [stackLimit]
+		as.JumpIf(BELOW, slow);
+		as.Emit({ 0x48, 0x89, 0xDF });				// mov rdi, rbx
+		as.Emit({ 0x48, 0x89, 0xE6 });				// mov rsi, rsp
+		as.Emit({ 0xFF, 0xD0 });					// call rax
+		as.Jump(done);
+		as.Bind(slow);
+		callHelper(&Jit::CallFromJit, callee);
+		as.Bind(done);
+		as.Patch(slow);
+		as.Patch(done);
+		checkFailed();
+		dropArgs(params);
+	};
+
+	// Prologue, arguments are copied into the first locals
+	as.Emit({ 0x55, 0x48, 0x89, 0xE5 });			// push rbp, mov rbp, rsp
+	as.Emit({ 0x53, 0x41, 0x54 });					// push rbx, push r12
+	as.Emit({ 0x48, 0x81, 0xEC }); as.Imm32(frameBytes);	// sub rsp, frameBytes
+	as.Emit({ 0x48, 0x89, 0xFB });					// mov rbx, rdi
+	for (std::uint32_t i = 0; i < arity; ++i) {
+		as.Emit({ 0x8B, 0x86 }); as.Imm32(static_cast<std::int32_t>((arity - 1 - i) * sizeof(std::int64_t)));	// mov eax, [rsi + arg]
+		as.Frame({ 0x89 }, 0, localDisp(i));		// mov [local], eax
+	}
+	as.Bind(bodyStart);
+
+	for (std::size_t i = 0; i < insts.size(); ++i) {
+		const auto &inst = insts[i];
+		if (targets[inst.pos]) {
+			spill();
+			as.Bind(labels[inst.pos]);
+		}
+
+		const auto slot = static_cast<std::int32_t>(inst.a);
+		switch (inst.code) {
+			case InstructionCode::SKIP:
+			case InstructionCode::BACK:
+				spill();
+				as.Jump(labels[JumpTarget(inst, size).value()]);
+				break;
+			case InstructionCode::ICONST:
+				pending.push_back(Operand{ Operand::IMM, slot });
+				break;
+			case InstructionCode::ILOAD:
+				pending.push_back(Operand{ Operand::LOCAL, slot });
+				break;
+			case InstructionCode::ISTORE: {
+				auto value = pop();
+				spillIfReads(slot);
+				switch (value.kind) {
+					case Operand::EAX:
+						as.Frame({ 0x89 }, 0, localDisp(slot));		// mov [local], eax
+						break;
+					case Operand::IMM:
+						as.Frame({ 0xC7 }, 0, localDisp(slot));		// mov dword [local], imm32
+						as.Imm32(value.value);
+						break;
+					case Operand::LOCAL:
+						if (value.value != slot) {
+							as.Frame({ 0x8B }, 1, localDisp(value.value));	// mov ecx, [other]
+							as.Frame({ 0x89 }, 1, localDisp(slot));			// mov [local], ecx
+						}
+						break;
+					default:
+						as.Emit({ 0x59 });								// pop rcx
+						as.Frame({ 0x89 }, 1, localDisp(slot));			// mov [local], ecx
+						break;
+				}
+				break;
+			}
+			case InstructionCode::POP:
+				if (pending.empty()) {
+					as.Emit({ 0x48, 0x83, 0xC4, 0x08 });	// add rsp, 8
+				}
+				else {
+					pending.pop_back();
+				}
+				break;
+			case InstructionCode::DUP: {
+				auto top = pop();
+				if (top.kind == Operand::IMM || top.kind == Operand::LOCAL) {
+					pending.push_back(top);
+					pending.push_back(top);
+					break;
+				}
+				if (top.kind == Operand::EAX) {
+					pending.push_back(top);
+					spill();
+				}
+				else {
+					as.Emit({ 0x48, 0x8B, 0x04, 0x24 });	// mov rax, [rsp]
+				}
+				pending.push_back(Operand{ Operand::EAX });
+				break;
+			}
+
+			case InstructionCode::IADD:
+			case InstructionCode::ISUB:
+			case InstructionCode::IMUL: {
+				auto right = binaryOperands();
+				arith(inst.code, right);
+				pending.push_back(Operand{ Operand::EAX });
+				break;
+			}
+			case InstructionCode::IDIV:
+			case InstructionCode::MOD: {
+				auto right = binaryOperands();
+				if (right.kind == Operand::IMM) {
+					as.Emit({ 0xB9 }); as.Imm32(right.value);	// mov ecx, imm32
+					right.kind = Operand::ECX;
+				}
+				as.Emit({ 0x99 });								// cdq
+				if (right.kind == Operand::LOCAL) {
+					as.Frame({ 0xF7 }, 7, localDisp(right.value));	// idiv dword [local]
+				}
+				else {
+					as.Emit({ 0xF7, 0xF9 });					// idiv ecx
+				}
+				if (inst.code == InstructionCode::MOD) {
+					as.Emit({ 0x89, 0xD0 });					// mov eax, edx
+				}
+				pending.push_back(Operand{ Operand::EAX });
+				break;
+			}
+			case InstructionCode::INC:
+			case InstructionCode::DEC:
+			case InstructionCode::INCBY: {
+				const int step = inst.code == InstructionCode::INC ? 1 : inst.code == InstructionCode::DEC ? -1 : static_cast<int>(inst.b);
+				spillIfReads(slot);
+				as.Frame({ 0x81 }, 0, localDisp(slot));		// add dword [local], imm32
+				as.Imm32(step);
+				break;
+			}
+			case InstructionCode::LOOP: {
+				auto limit = pop();
+				if (limit.kind == Operand::EAX) {
+					as.Emit({ 0x89, 0xC1 });					// mov ecx, eax
+				}
+				else if (limit.kind == Operand::LOCAL) {
+					as.Frame({ 0x8B }, 1, localDisp(limit.value));	// mov ecx, [limit]
+				}
+				else if (limit.kind == Operand::STACK) {
+					as.Emit({ 0x59 });							// pop rcx
+				}
+				if (limit.kind != Operand::IMM) {
+					limit.kind = Operand::ECX;
+				}
+				spill();
+				as.Frame({ 0x8B }, 0, localDisp(slot));		// mov eax, [counter]
+				as.Emit({ 0x83, 0xC0, 0x01 });				// add eax, 1
+				as.Frame({ 0x89 }, 0, localDisp(slot));		// mov [counter], eax
+				arith(InstructionCode::IEQ, limit);
+				as.JumpIf(LESS, labels[JumpTarget(inst, size).value()]);
+				break;
+			}
+
+			case InstructionCode::IEQ:
+			case InstructionCode::ILE:
+			case InstructionCode::IGE: {
+				const Cond cond = inst.code == InstructionCode::IEQ ? EQUAL : inst.code == InstructionCode::ILE ? LESS : GREATER;
+				auto right = binaryOperands();
+				arith(inst.code, right);
+
+				// A compare feeding a branch jumps on the flags directly
+				const auto *next = i + 1 < insts.size() ? &insts[i + 1] : nullptr;
+				const bool branch = next && !targets[next->pos] &&
+					(next->code == InstructionCode::IF || next->code == InstructionCode::WHILE || next->code == InstructionCode::FOR);
+				if (branch) {
+					spill();
+					as.JumpIf(Invert(cond), labels[JumpTarget(*next, size).value()]);
+					++i;
+					break;
+				}
+				as.Emit({ 0x0F, static_cast<std::uint8_t>(0x90 | cond), 0xC0 });	// setcc al
+				as.Emit({ 0x0F, 0xB6, 0xC0 });				// movzx eax, al
+				pending.push_back(Operand{ Operand::EAX });
+				break;
+			}
+			case InstructionCode::IF:
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR: {
+				auto &target = labels[JumpTarget(inst, size).value()];
+				auto cond = pop();
+				spill();
+				switch (cond.kind) {
+					case Operand::IMM:
+						if (!cond.value) {
+							as.Jump(target);
+						}
+						break;
+					case Operand::LOCAL:
+						as.Frame({ 0x83 }, 7, localDisp(cond.value)); as.Emit({ 0x00 });	// cmp dword [local], 0
+						as.JumpIf(EQUAL, target);
+						break;
+					default:
+						if (cond.kind == Operand::STACK) {
+							as.Emit({ 0x58 });						// pop rax
+						}
+						as.Emit({ 0x85, 0xC0 });					// test eax, eax
+						as.JumpIf(EQUAL, target);
+						break;
+				}
+				break;
+			}
+
+			case InstructionCode::IRET:
+				toEax(pop());
+				pending.clear();
+				as.Jump(epilogue);
+				break;
+			case InstructionCode::FUNCTIONCALL:
+				spill();
+				emitCall(inst.a, inst.b);
+				if (functions[inst.a].returnsValue) {
+					pending.push_back(Operand{ Operand::EAX });
+				}
+				break;
+			case InstructionCode::TAILCALL: {
+				spill();
+				if (inst.a == funcIdx) {
+					// Arguments replace the locals, then start over
+					for (std::uint32_t arg = 0; arg < inst.b; ++arg) {
+						as.Emit({ 0x8B, 0x84, 0x24 }); as.Imm32(static_cast<std::int32_t>((inst.b - 1 - arg) * sizeof(std::int64_t)));	// mov eax, [rsp + arg]
+						as.Frame({ 0x89 }, 0, localDisp(arg));	// mov [local], eax
+					}
+					as.Emit({ 0x48, 0x8D, 0xA5 }); as.Imm32(-16 - frameBytes);	// lea rsp, [rbp - 16 - frameBytes]
+					as.Jump(bodyStart);
+					break;
+				}
+				if (inst.b > maxTailArgs) {
+					emitCall(inst.a, inst.b);
+					as.Jump(epilogue);
+					break;
+				}
+
+				// Compiled callees reuse this frame's place on the stack, the
+				// arguments wait in the context until their prologue copies them
+				Assembler::Label slow;
+				loadEntry(inst.a);
+				as.JumpIf(EQUAL, slow);
+				for (std::uint32_t arg = 0; arg < inst.b; ++arg) {
+					const auto disp = static_cast<std::int32_t>(arg * sizeof(std::int64_t));
+					as.Emit({ 0x48, 0x8B, 0x8C, 0x24 }); as.Imm32(disp);	// mov rcx, [rsp + arg]
+					as.Context({ 0x48, 0x89 }, 1, tailArgsOffset + disp);		// mov [tailArgs + arg], rcx
+				}
+				as.Context({ 0x48, 0x8D }, 6, tailArgsOffset);	// lea rsi, [tailArgs]
+				as.Emit({ 0x48, 0x89, 0xDF });				// mov rdi, rbx
+				leave();
+				as.Emit({ 0xFF, 0xE0 });					// jmp rax
+				as.Bind(slow);
+				as.Patch(slow);
+				callHelper(&Jit::CallFromJit, inst.a);
+				as.Jump(epilogue);
+				break;
+			}
+			case InstructionCode::MEMOCALL:
+				spill();
+				callHelper(&Jit::MemoFromJit, inst.a);
+				checkFailed();
+				dropArgs(inst.b);
+				if (functions[inst.a].returnsValue) {
+					pending.push_back(Operand{ Operand::EAX });
+				}
+				break;
+			case InstructionCode::NATIVECALL:
+				spill();
+				callHelper(&Jit::NativeFromJit, inst.a);
+				checkFailed();
+				dropArgs(inst.b);
+				if (program.GetNative(inst.a).returnsValue) {
+					pending.push_back(Operand{ Operand::EAX });
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Falling off the end returns nothing
+	as.Bind(labels[size]);
+	as.Emit({ 0x31, 0xC0 });						// xor eax, eax
+	as.Bind(epilogue);
+	leave();
+	as.Emit({ 0xC3 });								// ret
+
+	for (const auto &label : labels) {
+		as.Patch(label);
+	}
+	as.Patch(bodyStart);
+	as.Patch(epilogue);
+
+	std::size_t mapped = 0;
+	void *page = Map(as.Bytes(), mapped);
+	if (!page) {
+		return false;
+	}
+	pages.emplace_back(page, mapped);
+	code[funcIdx] = page;
+	return true;
+#else
+	return false;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+#include "bytecode.h"
+#include "native.h"
+
+class VM;
+class Program;
+struct StencilFunction;
+
+// Where hot functions run, everything starts out in the interpreter
+enum class JitMode : std::uint8_t {
+	OFF,		// interpreter only, for comparisons
+	BASELINE,	// x86-64 machine code translated instruction by instruction, hot loops are traced
+	STENCIL,	// prebuilt C++ stencils chained per function, see stencil.h
+};
+
+// Whether this build can run mode, the VM interprets everything otherwise.
+// BASELINE needs x86-64 Linux, STENCIL runs anywhere
+bool JitAvailable(JitMode mode);
+
+// One instruction of a function body, short forms decode to the wide one
+struct JitInstruction {
+	InstructionCode code = InstructionCode::NOP;
+	std::uint32_t pos = 0, next = 0;	// offsets of this and of the following instruction
+	std::uint32_t a = 0, b = 0;			// immediate operands
+};
+// Instruction starting at pos of a body, none when it does not fit
+std::optional<JitInstruction> DecodeInstruction(const char *code, std::size_t size, std::size_t pos);
+// Where a jump lands, running past the end of the body returns
+std::optional<std::uint32_t> JumpTarget(const JitInstruction &inst, std::uint32_t size);
+
+// What a function returns, including whatever the functions it tail calls return
+struct ReturnKind {
+	bool value = false;
+	bool isFloat = false;
+};
+std::vector<ReturnKind> FindReturnKinds(const Program &program);
+// Whether every parameter of a signature like "foo(int,int)" is an int
+bool IntParams(const std::string &signature);
+
+// Compiles hot functions of one program. A function is compiled once it
+// was called threshold times, as long as it only uses integers and
+// instructions the compilers know, everything else stays in the
+// interpreter. One instance per VM, compiled code calls back into it for
+// natives and for functions that are not compiled.
+class Jit {
+public:
+	static constexpr std::uint32_t defaultThreshold = 100;
+	static constexpr std::uint32_t maxTailArgs = 16;
+
+	// Read and written by generated code, keep it standard layout
+	struct Context {
+		void *const *code = nullptr;			// entry per function, null while interpreted
+		std::uintptr_t stackLimit = 0;			// calls below this stack address go through the VM
+		std::uint8_t failed = 0;				// a script error is waiting in error
+		Jit *jit = nullptr;
+		std::int64_t tailArgs[maxTailArgs]{};	// arguments of a tail call between compiled functions
+	};
+private:
+	struct FunctionState {
+		std::uint32_t calls = 0;
+		bool unsupported = false;
+		bool returnsValue = false;
+		bool returnsFloat = false;
+	};
+
+	VM &vm;
+	const Program &program;
+	JitMode mode;
+	std::uint32_t threshold;
+	Context context;
+	std::exception_ptr error;
+	std::size_t activeCalls = 0;			// compiled frames currently on the stack
+	std::vector<std::int64_t> entryArgs;
+	std::vector<int> stencilArgs;
+	std::vector<FunctionState> functions;
+
+	// BASELINE
+	std::vector<void *> code;
+	std::vector<std::pair<void *, std::size_t>> pages;
+
+	// STENCIL, frames of running functions live in the arena
+	std::vector<std::unique_ptr<StencilFunction>> stencils;
+	std::vector<int> arena;
+	std::size_t arenaTop = 0;
+
+	bool IsCompiled(std::uint32_t funcIdx) const;
+	bool HasStackLeft() const;
+	bool Compile(std::uint32_t funcIdx);
+	bool CompileNative(std::uint32_t funcIdx, const std::vector<JitInstruction> &insts, const std::vector<bool> &targets, std::uint32_t frameSize);
+	bool CompileStencils(std::uint32_t funcIdx, const std::vector<JitInstruction> &insts, const std::vector<bool> &targets, std::uint32_t frameSize);
+	int RunStencils(std::uint32_t funcIdx, const int *args);
+
+	// Called from generated code, errors are stored instead of thrown
+	static int CallFromJit(Context *ctx, std::uint32_t funcIdx, const std::int64_t *args);
+	static int NativeFromJit(Context *ctx, std::uint32_t nativeIdx, const std::int64_t *args);
+	static int MemoFromJit(Context *ctx, std::uint32_t funcIdx, const std::int64_t *args);
+public:
+	Jit(VM &vm, const Program &program, JitMode mode, std::uint32_t threshold = defaultThreshold);
+	Jit(const Jit &) = delete;
+	Jit &operator=(const Jit &) = delete;
+	~Jit();
+
+	// Counts a call and runs func compiled once it is hot. False leaves
+	// the call to the interpreter, script errors are rethrown
+	bool TryCall(std::uint32_t funcIdx, std::span<const VarType> args, std::optional<VarType> &ret);
+
+	// Calls made by stencils, args in declaration order
+	int StencilCall(std::uint32_t funcIdx, const int *args);
+	int StencilNative(std::uint32_t nativeIdx, const int *args);
+	int StencilMemo(std::uint32_t funcIdx, const int *args);
+	bool ReturnsValue(std::uint32_t funcIdx) const { return functions[funcIdx].returnsValue; }
+};
\ No newline at end of file
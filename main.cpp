@@ -7,34 +7,123 @@
 #include "parser.hpp"
 #include "bytecode.h"
 #include "interpreter.h"
+#include "batch.h"
+#include "aot.h"
+#include "closure.h"
+#include "embed.h"
 
 int main(int argc, char** argv) {
+	// c_compiler [source] [--batch <entry> <args file> [--threads N]] [--interp | --stencil | --closures] [--aot <out.s>] [--cache <dir>]
+	std::string sourcePath = "testcode.c";
+	std::string batchEntry, batchArgsPath, aotPath, cacheDir;
+	unsigned threads = 0;
+	// --interp keeps hot functions out of the JIT, --stencil picks the stencil tier, for comparisons.
+	// --closures runs main on the syntax tree without generating bytecode
+	JitMode jitMode = JitMode::BASELINE;
+	bool closures = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--batch" && i + 2 < argc) {
+			batchEntry = argv[++i];
+			batchArgsPath = argv[++i];
+		}
+		else if (arg == "--threads" && i + 1 < argc) {
+			threads = std::stoi(argv[++i]);
+		}
+		else if (arg == "--interp") {
+			jitMode = JitMode::OFF;
+		}
+		else if (arg == "--stencil") {
+			jitMode = JitMode::STENCIL;
+		}
+		else if (arg == "--closures") {
+			closures = true;
+		}
+		else if (arg == "--aot" && i + 1 < argc) {
+			aotPath = argv[++i];
+		}
+		else if (arg == "--cache" && i + 1 < argc) {
+			// Compiled images are kept in dir, later starts of the same script skip compiling
+			cacheDir = argv[++i];
+		}
+		else {
+			sourcePath = arg;
+		}
+	}
+
 	std::stringstream ss{};
-	std::ifstream fp("testcode.c");
+	std::ifstream fp(sourcePath);
 	std::string tmp;
 	while (std::getline(fp, tmp)) {
 		ss << tmp << '\n';
 	}
 
-	auto parser = Parser(ss.str());
-	
-	parser.Parse();
-	std::fstream file("tmp.bin", std::ios_base::binary | std::ios_base::out);
-	GenerateBytecode(file, parser.GetGlobalScope().block, parser);
-	file.close();
+	const auto source = ss.str();
+
+	if (closures) {
+		auto parser = Parser(source);
+		parser.Parse();
 
-	file.open("tmp.bin", std::ios_base::binary | std::ios_base::in);
-	PrintBytecode(file);
-	file.clear();
-	file.seekg(0, std::ios::beg);
-	
+		// Building the closures replaces writing and loading the image, so it is timed too
+		std::cout << "Closures returned: ";
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		ClosureProgram program{ parser };
+		auto var = program.Run("main()");
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+		std::cout << (var ? std::get<int>(var.value()) : -1);
+		std::cout << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(timeEnd - timeStart).count() << "ms\n";
+		return 0;
+	}
+	// Only the entry point and what it calls end up in the image, ahead of time builds keep everything
+	CompileOptions options;
+	if (aotPath.empty()) {
+		options.roots = { batchEntry.empty() ? "main" : batchEntry };
+	}
+
+	std::shared_ptr<const Program> program;
+	if (!cacheDir.empty()) {
+		program = CompileCached(source, ImageCache{ cacheDir }, {}, options);
+	}
+	else {
+		auto parser = Parser(source);
+		parser.Parse();
+
+		std::fstream file("tmp.bin", std::ios_base::binary | std::ios_base::out);
+		GenerateBytecode(file, parser.GetGlobalScope().block, parser, options);
+		file.close();
+
+		file.open("tmp.bin", std::ios_base::binary | std::ios_base::in);
+		program = std::make_shared<const Program>(file);
+	}
+
+	if (!aotPath.empty()) {
+		std::ofstream out(aotPath);
+		for (const auto &signature : WriteAssembly(out, *program)) {
+			std::cerr << "Not compiled: " << signature << '\n';
+		}
+		return 0;
+	}
+	if (!batchEntry.empty()) {
+		std::ifstream argsFile(batchArgsPath);
+		auto argSets = ReadBatchArgs(argsFile, *program, batchEntry);
+
+		auto timeStart = std::chrono::high_resolution_clock::now();
+		auto results = RunBatch(program, batchEntry, argSets, threads, jitMode);
+		auto timeEnd = std::chrono::high_resolution_clock::now();
+
+		WriteBatchResults(std::cout, results);
+		std::cerr << results.size() << " calls in " << std::chrono::duration_cast<std::chrono::milliseconds>(timeEnd - timeStart).count() << "ms\n";
+		return 0;
+	}
+
+	PrintBytecode(program->GetImage());
 
 	std::cout << "Interp returned: ";
 	auto timeStart = std::chrono::high_resolution_clock::now();
-	std::cout << InterpretCode(file);
+	VM vm{ program, jitMode };
+	auto var = vm.Run("main()");
 	auto timeEnd = std::chrono::high_resolution_clock::now();
+	std::cout << (var ? std::get<int>(var.value()) : -1);
 	std::cout << " in " << std::chrono::duration_cast<std::chrono::milliseconds>(timeEnd - timeStart).count() << "ms\n";
-
-	file.close();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,28 @@
+#include "native.h"
+
+std::string NativeFunction::GenerateSignature() const {
+	std::string out = name + "(";
+	for (auto it = paramTypes.begin(); it != paramTypes.end(); ++it) {
+		out += *it;
+		if (it != paramTypes.end() - 1) {
+			out += ',';
+		}
+	}
+	out += ')';
+
+	return out;
+}
+
+void NativeRegistry::Register(std::string name, std::string returnType, std::vector<std::string> paramTypes, NativeFn fn) {
+	const bool returnsValue = returnType != "void";
+	functions.push_back(NativeFunction{ std::move(name), std::move(returnType), std::move(paramTypes), fn, returnsValue });
+}
+
+const NativeFunction *NativeRegistry::Find(const std::string &signature) const {
+	for (const auto &func : functions) {
+		if (func.GenerateSignature() == signature) {
+			return &func;
+		}
+	}
+	return nullptr;
+}
\ No newline at end of file
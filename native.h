@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <variant>
+
+using VarType = std::variant<int, float>;
+
+// Host function callable from scripts. args points straight at the
+// caller's operand stack, one slot per parameter in declaration order.
+using NativeFn = VarType (*)(const VarType *args);
+
+struct NativeFunction {
+	std::string name;
+	std::string returnType;
+	std::vector<std::string> paramTypes;
+	NativeFn fn = nullptr;
+	bool returnsValue = false;	// returnType is not void, set by Register
+
+	// Same format as Function::GenerateSignature
+	[[nodiscard]] std::string GenerateSignature() const;
+};
+
+// Natives have to be registered before compiling scripts that use them
+// and the same registry has to be given when loading the program
+class NativeRegistry {
+	std::vector<NativeFunction> functions;
+public:
+	void Register(std::string name, std::string returnType, std::vector<std::string> paramTypes, NativeFn fn);
+
+	const std::vector<NativeFunction> &GetFunctions() const { return functions; }
+	const NativeFunction *Find(const std::string &signature) const;
+};
\ No newline at end of file
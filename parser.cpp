@@ -434,6 +434,7 @@ std::unique_ptr<ForStmt> Parser::ParseFor() {
 }
 std::unique_ptr<BlockStmt> Parser::ParseBlock() {
 	std::unique_ptr<BlockStmt> ret = std::make_unique<BlockStmt>();
+	ret->scope = currentScope;
 
 	std::unique_ptr<Statement> stmt;
 	while (stmt = ParseStmt()) {
@@ -451,7 +452,10 @@ std::unique_ptr<FuncDeclStmt> Parser::ParseFunc() {
 	auto ident = tokenizer.Get();
 	assert(ident.type == TokenType::IDENT); tokenizer.Next();
 	assert(tokenizer.Next().type == TokenType::OPEN_PARENTH);
-	assert(currentScope->FindFunc(ident) == nullptr);
+
+	// Only a prototype may come before the definition
+	auto *declared = currentScope->FindFunc(ident);
+	assert(declared == nullptr || !declared->defined);
 
 	currentScope->children.push_back(std::make_unique<Scope>());
 	currentScope->children.back()->parent = currentScope;
@@ -470,18 +474,31 @@ std::unique_ptr<FuncDeclStmt> Parser::ParseFunc() {
 	}
 	assert(tokenizer.Next().type == TokenType::CLOSED_PARENTH);
 
+	std::vector<Variable> vars;
+	for (auto &param : params) {
+		vars.push_back(param->var);
+	}
+
 	if (tokenizer.Get().type == TokenType::SEMICOLON) {
 		tokenizer.Next();
 
+		if (!declared) {
+			currentScope->parent->funcs.push_back(std::make_unique<Function>(false, retType, ident, vars));
+		}
+		currentScope = currentScope->parent;
 		return std::make_unique<FuncDeclStmt>(retType, ident, &params);
 	}
 
-	std::vector<Variable> vars;
 	for (auto &param : params) {
-		vars.push_back(param->var);
 		currentScope->vars.push_back(std::make_unique<Variable>(param->var));
 	}
-	currentScope->parent->funcs.push_back(std::make_unique<Function>(true, retType, ident, vars));
+	if (declared) {
+		declared->defined = true;
+		declared->params = vars;
+	}
+	else {
+		currentScope->parent->funcs.push_back(std::make_unique<Function>(true, retType, ident, vars));
+	}
 	
 	assert(tokenizer.Next().type == TokenType::OPEN_BRACE);
 	auto definition = ParseBlock();
@@ -509,6 +526,12 @@ std::unique_ptr<Statement> Parser::ParseStmt(bool checkSemicolon) {
 		case TokenType::WHILE: return ParseWhile();
 		case TokenType::OPEN_BRACE: return ParseBlock();
 		case TokenType::RETURN: return ParseReturn();
+		case TokenType::INLINE: {
+			tokenizer.Next();
+			auto func = ParseFunc();
+			currentScope->FindFunc(func->name)->AddMod(Modifiers::INLINE);
+			return func;
+		}
 	}
 
 	if (tokenizer.Get().type >= TokenType::TYPES_BEGIN && tokenizer.Get().type <= TokenType::TYPES_END || (currentScope->FindType(tokenizer.Get()))) {
@@ -581,6 +604,21 @@ const Type *Parser::GetType() {
 	return currentScope->FindType(typeName);
 }
 
+void Parser::DeclareNative(const std::string &name, const std::string &returnType, const std::vector<std::string> &paramTypes) {
+	auto *retType = globalScope.FindType({ TokenType::IDENT, 0, 0, returnType });
+	assert(retType);
+	assert(globalScope.FindFunc({ TokenType::IDENT, 0, 0, name }) == nullptr);
+
+	std::vector<Variable> params;
+	for (const auto &paramType : paramTypes) {
+		auto *type = globalScope.FindType({ TokenType::IDENT, 0, 0, paramType });
+		assert(type);
+		params.push_back(Variable{ type, { TokenType::IDENT, 0, 0, "arg" + std::to_string(params.size()) } });
+	}
+
+	globalScope.funcs.push_back(std::make_unique<Function>(true, retType, Token{ TokenType::IDENT, 0, 0, name }, params, true));
+}
+
 void Parser::Parse() {
 	std::unique_ptr<Statement> stmt{};
 	while ((stmt = std::move(ParseStmt()))) {
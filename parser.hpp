@@ -12,6 +12,7 @@
 #include "tokenizer.hpp"
 
 struct Type;
+struct Scope;
 
 enum class Modifiers : std::uint8_t {
 	CONST = 1 << 1,
@@ -79,6 +80,17 @@ struct Function {
 	Type *returnType = nullptr;
 	Token name;
 	std::vector<Variable> params;
+	bool native = false;	// implemented by the host, see NativeRegistry
+	Modifiers mods = static_cast<Modifiers>(0);
+
+	void AddMod(Modifiers mod) {
+		using MODUNDER = std::underlying_type_t<Modifiers>;
+		mods = static_cast<Modifiers>(static_cast<MODUNDER>(mods) | static_cast<MODUNDER>(mod));
+	}
+	bool IsMod(Modifiers mod) const {
+		using MODUNDER = std::underlying_type_t<Modifiers>;
+		return (static_cast<MODUNDER>(mods) & static_cast<MODUNDER>(mod)) != 0;
+	}
 
 	[[nodiscard]] std::string GenerateSignature() const;
 };
@@ -155,6 +167,7 @@ struct Statement {
 };
 struct BlockStmt: Statement {
 	std::vector<std::unique_ptr<Statement>> stmts;
+	Scope *scope = nullptr;	// where the block's locals were declared
 
 	BlockStmt() : Statement(StatementType::BLOCK) {}
 	void AddStmt(std::unique_ptr<Statement> &stmt) {
@@ -281,6 +294,9 @@ class Parser {
 public:
 	Parser(std::string_view code);
 
+	// Makes a host function callable from the parsed code
+	void DeclareNative(const std::string &name, const std::string &returnType, const std::vector<std::string> &paramTypes);
+
 	void Parse();
 	void PrintAST(std::size_t off = 0) const;
 
@@ -0,0 +1,555 @@
+#include "stencil.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <utility>
+
+namespace {
+	// Slots of the arena that holds the frames of running stencil functions
+	constexpr std::size_t arenaSize = 1 << 18;
+
+	enum class Src : std::uint8_t {
+		STACK,
+		LOCAL,
+		IMM,
+	};
+	enum class Dst : std::uint8_t {
+		PUSH,
+		LOCAL,
+		BRANCH,	// jump to target when the result is zero
+	};
+
+	template<Src S>
+	inline int Read(StencilFrame &f, std::int32_t hole) {
+		if constexpr (S == Src::STACK) {
+			return *--f.sp;
+		}
+		else if constexpr (S == Src::LOCAL) {
+			return f.locals[hole];
+		}
+		else {
+			return hole;
+		}
+	}
+	inline int Wrap(std::int64_t value) {
+		return static_cast<int>(static_cast<std::uint32_t>(value));
+	}
+
+	template<InstructionCode Op>
+	inline int Apply(int a, int b) {
+		if constexpr (Op == InstructionCode::IADD) {
+			return Wrap(static_cast<std::int64_t>(a) + b);
+		}
+		else if constexpr (Op == InstructionCode::ISUB) {
+			return Wrap(static_cast<std::int64_t>(a) - b);
+		}
+		else if constexpr (Op == InstructionCode::IMUL) {
+			return Wrap(static_cast<std::int64_t>(a) * b);
+		}
+		else if constexpr (Op == InstructionCode::IDIV) {
+			return a / b;
+		}
+		else if constexpr (Op == InstructionCode::MOD) {
+			return a % b;
+		}
+		else if constexpr (Op == InstructionCode::IEQ) {
+			return a == b;
+		}
+		else if constexpr (Op == InstructionCode::ILE) {
+			return a < b;
+		}
+		else {
+			return a > b;
+		}
+	}
+
+	// x and y are the operands, z the destination slot
+	template<InstructionCode Op, Src L, Src R, Dst D>
+	const Stencil *Binary(const Stencil *s, StencilFrame &f) {
+		const int b = Read<R>(f, s->y);
+		const int a = Read<L>(f, s->x);
+		const int value = Apply<Op>(a, b);
+		if constexpr (D == Dst::PUSH) {
+			*f.sp++ = value;
+		}
+		else if constexpr (D == Dst::LOCAL) {
+			f.locals[s->z] = value;
+		}
+		else {
+			return value ? s + 1 : s->target;
+		}
+		return s + 1;
+	}
+
+	// Stencils with a single operand in x
+	template<Src S>
+	struct Push {
+		static const Stencil *Run(const Stencil *s, StencilFrame &f) {
+			*f.sp++ = Read<S>(f, s->x);
+			return s + 1;
+		}
+	};
+	template<Src S>
+	struct Store {
+		static const Stencil *Run(const Stencil *s, StencilFrame &f) {
+			f.locals[s->z] = Read<S>(f, s->x);
+			return s + 1;
+		}
+	};
+	template<Src S>
+	struct Test {
+		static const Stencil *Run(const Stencil *s, StencilFrame &f) {
+			return Read<S>(f, s->x) ? s + 1 : s->target;
+		}
+	};
+	// x is the limit, z the counter
+	template<Src S>
+	struct Loop {
+		static const Stencil *Run(const Stencil *s, StencilFrame &f) {
+			const int limit = Read<S>(f, s->x);
+			int &counter = f.locals[s->z];
+			counter = Wrap(static_cast<std::int64_t>(counter) + 1);
+			return counter < limit ? s->target : s + 1;
+		}
+	};
+	template<Src S>
+	struct Return {
+		static const Stencil *Run(const Stencil *s, StencilFrame &f) {
+			f.ret = Read<S>(f, s->x);
+			return nullptr;
+		}
+	};
+
+	const Stencil *End(const Stencil *, StencilFrame &f) {
+		f.ret = 0;
+		return nullptr;
+	}
+	const Stencil *Jump(const Stencil *s, StencilFrame &) {
+		return s->target;
+	}
+	const Stencil *Pop(const Stencil *s, StencilFrame &f) {
+		--f.sp;
+		return s + 1;
+	}
+	const Stencil *Dup(const Stencil *s, StencilFrame &f) {
+		*f.sp = f.sp[-1];
+		++f.sp;
+		return s + 1;
+	}
+	// x is the step, z the slot
+	const Stencil *AddTo(const Stencil *s, StencilFrame &f) {
+		f.locals[s->z] = Wrap(static_cast<std::int64_t>(f.locals[s->z]) + s->x);
+		return s + 1;
+	}
+	// x is the callee, y the argument count, z whether it returns a value
+	const Stencil *Call(const Stencil *s, StencilFrame &f) {
+		f.sp -= s->y;
+		const int value = f.jit->StencilCall(s->x, f.sp);
+		if (s->z) {
+			*f.sp++ = value;
+		}
+		return s + 1;
+	}
+	const Stencil *Memo(const Stencil *s, StencilFrame &f) {
+		f.sp -= s->y;
+		const int value = f.jit->StencilMemo(s->x, f.sp);
+		if (s->z) {
+			*f.sp++ = value;
+		}
+		return s + 1;
+	}
+	const Stencil *Native(const Stencil *s, StencilFrame &f) {
+		f.sp -= s->y;
+		const int value = f.jit->StencilNative(s->x, f.sp);
+		if (s->z) {
+			*f.sp++ = value;
+		}
+		return s + 1;
+	}
+	const Stencil *TailCall(const Stencil *s, StencilFrame &f) {
+		f.sp -= s->y;
+		f.tailArgs = f.sp;
+		f.tailCallee = static_cast<std::uint32_t>(s->x);
+		return nullptr;
+	}
+	// Arguments replace the locals, z is the frame size, target the entry
+	const Stencil *TailSelf(const Stencil *s, StencilFrame &f) {
+		std::copy(f.sp - s->y, f.sp, f.locals);
+		f.sp = f.locals + s->z;
+		return s->target;
+	}
+
+	template<InstructionCode Op, Src L, Src R>
+	StencilFn PickDst(Dst d) {
+		switch (d) {
+			case Dst::PUSH: return &Binary<Op, L, R, Dst::PUSH>;
+			case Dst::LOCAL: return &Binary<Op, L, R, Dst::LOCAL>;
+			default: return &Binary<Op, L, R, Dst::BRANCH>;
+		}
+	}
+	template<InstructionCode Op, Src L>
+	StencilFn PickRight(Src r, Dst d) {
+		switch (r) {
+			case Src::STACK: return PickDst<Op, L, Src::STACK>(d);
+			case Src::LOCAL: return PickDst<Op, L, Src::LOCAL>(d);
+			default: return PickDst<Op, L, Src::IMM>(d);
+		}
+	}
+	template<InstructionCode Op>
+	StencilFn PickLeft(Src l, Src r, Dst d) {
+		switch (l) {
+			case Src::STACK: return PickRight<Op, Src::STACK>(r, d);
+			case Src::LOCAL: return PickRight<Op, Src::LOCAL>(r, d);
+			default: return PickRight<Op, Src::IMM>(r, d);
+		}
+	}
+	StencilFn PickBinary(InstructionCode op, Src l, Src r, Dst d) {
+		switch (op) {
+			case InstructionCode::IADD: return PickLeft<InstructionCode::IADD>(l, r, d);
+			case InstructionCode::ISUB: return PickLeft<InstructionCode::ISUB>(l, r, d);
+			case InstructionCode::IMUL: return PickLeft<InstructionCode::IMUL>(l, r, d);
+			case InstructionCode::IDIV: return PickLeft<InstructionCode::IDIV>(l, r, d);
+			case InstructionCode::MOD: return PickLeft<InstructionCode::MOD>(l, r, d);
+			case InstructionCode::IEQ: return PickLeft<InstructionCode::IEQ>(l, r, d);
+			case InstructionCode::ILE: return PickLeft<InstructionCode::ILE>(l, r, d);
+			default: return PickLeft<InstructionCode::IGE>(l, r, d);
+		}
+	}
+	template<template<Src> class Kind>
+	StencilFn PickSrc(Src src) {
+		switch (src) {
+			case Src::STACK: return &Kind<Src::STACK>::Run;
+			case Src::LOCAL: return &Kind<Src::LOCAL>::Run;
+			default: return &Kind<Src::IMM>::Run;
+		}
+	}
+
+	bool IsBinary(InstructionCode c) {
+		switch (c) {
+			case InstructionCode::IADD:
+			case InstructionCode::ISUB:
+			case InstructionCode::IMUL:
+			case InstructionCode::IDIV:
+			case InstructionCode::MOD:
+			case InstructionCode::IEQ:
+			case InstructionCode::ILE:
+			case InstructionCode::IGE:
+				return true;
+			default:
+				return false;
+		}
+	}
+	bool IsBranch(InstructionCode c) {
+		return c == InstructionCode::IF || c == InstructionCode::WHILE || c == InstructionCode::FOR;
+	}
+}
+
+bool Jit::CompileStencils(std::uint32_t funcIdx, const std::vector<JitInstruction> &insts, const std::vector<bool> &targets, std::uint32_t frameSize) {
+	const auto size = static_cast<std::uint32_t>(program.GetFunction(funcIdx)->size);
+	std::vector<std::size_t> indexAt(size + 1, insts.size());
+	for (std::size_t i = 0; i < insts.size(); ++i) {
+		indexAt[insts[i].pos] = i;
+	}
+
+	// Operand stack depth has to be the same on every path into an
+	// instruction, the deepest point sizes the frame
+	auto fn = std::make_unique<StencilFunction>();
+	fn->frameSize = frameSize;
+	std::vector<int> depths(insts.size() + 1, -1);
+	std::vector<std::size_t> work{ 0 };
+	depths[0] = 0;
+	auto reach = [&](std::size_t idx, int depth) {
+		if (depths[idx] < 0) {
+			depths[idx] = depth;
+			work.push_back(idx);
+		}
+		return depths[idx] == depth;
+	};
+	while (!work.empty()) {
+		const auto idx = work.back();
+		work.pop_back();
+		if (idx == insts.size()) {
+			continue;
+		}
+
+		const auto &inst = insts[idx];
+		int pops = 0, pushes = 0;
+		bool fallsThrough = true;
+		switch (inst.code) {
+			case InstructionCode::ICONST:
+			case InstructionCode::ILOAD:
+				pushes = 1;
+				break;
+			case InstructionCode::DUP:
+				pops = 1;
+				pushes = 2;
+				break;
+			case InstructionCode::ISTORE:
+			case InstructionCode::POP:
+			case InstructionCode::IF:
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR:
+			case InstructionCode::LOOP:
+				pops = 1;
+				break;
+			case InstructionCode::IRET:
+				pops = 1;
+				fallsThrough = false;
+				break;
+			case InstructionCode::SKIP:
+			case InstructionCode::BACK:
+				fallsThrough = false;
+				break;
+			case InstructionCode::FUNCTIONCALL:
+			case InstructionCode::MEMOCALL:
+				pops = static_cast<int>(inst.b);
+				pushes = functions[inst.a].returnsValue;
+				break;
+			case InstructionCode::NATIVECALL:
+				pops = static_cast<int>(inst.b);
+				pushes = program.GetNative(inst.a).returnsValue;
+				break;
+			case InstructionCode::TAILCALL:
+				pops = static_cast<int>(inst.b);
+				fallsThrough = false;
+				break;
+			default:
+				if (IsBinary(inst.code)) {
+					pops = 2;
+					pushes = 1;
+				}
+				break;
+		}
+
+		const int depth = depths[idx];
+		if (depth < pops) {
+			return false;
+		}
+		fn->maxStack = std::max(fn->maxStack, static_cast<std::uint32_t>(depth - pops + pushes));
+		if (fallsThrough && !reach(idx + 1, depth - pops + pushes)) {
+			return false;
+		}
+		if (auto target = JumpTarget(inst, size); target && !reach(indexAt[target.value()], depth - pops + pushes)) {
+			return false;
+		}
+	}
+
+	// Constants and loads fold into the stencil that consumes them, a
+	// result can go straight into a local or into a branch
+	auto &code = fn->code;
+	std::vector<std::size_t> stencilAt(size + 1);
+	std::vector<std::pair<std::size_t, std::uint32_t>> jumps;	// stencil, bytecode target
+	auto emit = [&](StencilFn run, std::int32_t x = 0, std::int32_t y = 0, std::int32_t z = 0) {
+		code.push_back(Stencil{ run, x, y, z });
+	};
+	auto jumpTo = [&](const JitInstruction &inst) {
+		jumps.emplace_back(code.size() - 1, JumpTarget(inst, size).value());
+	};
+	auto fusable = [&](std::size_t idx) {
+		return idx < insts.size() && !targets[insts[idx].pos];
+	};
+	auto operand = [&](std::size_t idx, Src &src, std::int32_t &hole) {
+		if (idx >= insts.size() || (insts[idx].code != InstructionCode::ICONST && insts[idx].code != InstructionCode::ILOAD)) {
+			return false;
+		}
+		src = insts[idx].code == InstructionCode::ICONST ? Src::IMM : Src::LOCAL;
+		hole = static_cast<std::int32_t>(insts[idx].a);
+		return true;
+	};
+
+	for (std::size_t i = 0; i < insts.size();) {
+		const auto &inst = insts[i];
+		stencilAt[inst.pos] = code.size();
+
+		// Binary operation with up to two folded operands
+		Src left = Src::STACK, right = Src::STACK;
+		std::int32_t x = 0, y = 0;
+		std::size_t op = i;
+		if (operand(i, left, x) && fusable(i + 1) && operand(i + 1, right, y) && fusable(i + 2) && IsBinary(insts[i + 2].code)) {
+			op = i + 2;
+		}
+		else if (operand(i, right, y) && fusable(i + 1) && IsBinary(insts[i + 1].code)) {
+			left = Src::STACK;
+			op = i + 1;
+		}
+		else {
+			left = right = Src::STACK;
+		}
+		if (IsBinary(insts[op].code)) {
+			const auto c = insts[op].code;
+			if (fusable(op + 1) && insts[op + 1].code == InstructionCode::ISTORE) {
+				emit(PickBinary(c, left, right, Dst::LOCAL), x, y, static_cast<std::int32_t>(insts[op + 1].a));
+				i = op + 2;
+			}
+			else if (fusable(op + 1) && IsBranch(insts[op + 1].code)) {
+				emit(PickBinary(c, left, right, Dst::BRANCH), x, y);
+				jumpTo(insts[op + 1]);
+				i = op + 2;
+			}
+			else {
+				emit(PickBinary(c, left, right, Dst::PUSH), x, y);
+				i = op + 1;
+			}
+			continue;
+		}
+
+		// Consumers of a single value, folding a constant or a load into them
+		Src src = Src::STACK;
+		std::int32_t hole = 0;
+		std::size_t consumer = i;
+		if (operand(i, src, hole) && fusable(i + 1)) {
+			consumer = i + 1;
+		}
+		const auto &use = insts[consumer];
+		const auto slot = static_cast<std::int32_t>(use.a);
+		switch (use.code) {
+			case InstructionCode::ISTORE:
+				emit(PickSrc<Store>(src), hole, 0, slot);
+				i = consumer + 1;
+				continue;
+			case InstructionCode::IF:
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR:
+				emit(PickSrc<Test>(src), hole);
+				jumpTo(use);
+				i = consumer + 1;
+				continue;
+			case InstructionCode::LOOP:
+				emit(PickSrc<Loop>(src), hole, 0, slot);
+				jumpTo(use);
+				i = consumer + 1;
+				continue;
+			case InstructionCode::IRET:
+				emit(PickSrc<Return>(src), hole);
+				i = consumer + 1;
+				continue;
+			default:
+				break;
+		}
+		if (src != Src::STACK) {
+			emit(PickSrc<Push>(src), hole);
+			++i;
+			continue;
+		}
+
+		switch (inst.code) {
+			case InstructionCode::SKIP:
+			case InstructionCode::BACK:
+				emit(&Jump);
+				jumpTo(inst);
+				break;
+			case InstructionCode::POP:
+				emit(&Pop);
+				break;
+			case InstructionCode::DUP:
+				emit(&Dup);
+				break;
+			case InstructionCode::INC:
+				emit(&AddTo, 1, 0, static_cast<std::int32_t>(inst.a));
+				break;
+			case InstructionCode::DEC:
+				emit(&AddTo, -1, 0, static_cast<std::int32_t>(inst.a));
+				break;
+			case InstructionCode::INCBY:
+				emit(&AddTo, static_cast<std::int32_t>(inst.b), 0, static_cast<std::int32_t>(inst.a));
+				break;
+			case InstructionCode::FUNCTIONCALL:
+				emit(&Call, static_cast<std::int32_t>(inst.a), static_cast<std::int32_t>(inst.b), functions[inst.a].returnsValue);
+				break;
+			case InstructionCode::MEMOCALL:
+				emit(&Memo, static_cast<std::int32_t>(inst.a), static_cast<std::int32_t>(inst.b), functions[inst.a].returnsValue);
+				break;
+			case InstructionCode::NATIVECALL:
+				emit(&Native, static_cast<std::int32_t>(inst.a), static_cast<std::int32_t>(inst.b), program.GetNative(inst.a).returnsValue);
+				break;
+			case InstructionCode::TAILCALL:
+				if (inst.a == funcIdx) {
+					emit(&TailSelf, 0, static_cast<std::int32_t>(inst.b), static_cast<std::int32_t>(frameSize));
+					jumps.emplace_back(code.size() - 1, 0);
+				}
+				else {
+					emit(&TailCall, static_cast<std::int32_t>(inst.a), static_cast<std::int32_t>(inst.b));
+				}
+				break;
+			default:
+				break;
+		}
+		++i;
+	}
+	stencilAt[size] = code.size();
+	emit(&End);
+
+	for (auto [stencil, target] : jumps) {
+		code[stencil].target = &code[stencilAt[target]];
+	}
+	if (arena.empty()) {
+		arena.resize(arenaSize);
+	}
+	stencils[funcIdx] = std::move(fn);
+	return true;
+}
+
+int Jit::RunStencils(std::uint32_t funcIdx, const int *args) {
+	const auto *fn = stencils[funcIdx].get();
+	const auto base = arenaTop;
+	arenaTop += fn->Slots();
+
+	StencilFrame frame{ arena.data() + base, arena.data() + base + fn->frameSize, this };
+	std::copy(args, args + program.GetFunction(funcIdx)->arity, frame.locals);
+	try {
+		while (true) {
+			for (const Stencil *s = fn->code.data(); s; s = s->fn(s, frame)) {}
+			if (!frame.tailArgs) {
+				break;
+			}
+
+			// Tail calls between stencil functions take over the frame
+			const auto callee = frame.tailCallee;
+			const auto *tailArgs = std::exchange(frame.tailArgs, nullptr);
+			const auto *next = stencils[callee].get();
+			if (!next || base + next->Slots() > arena.size()) {
+				frame.ret = StencilCall(callee, tailArgs);
+				break;
+			}
+			std::copy(tailArgs, tailArgs + program.GetFunction(callee)->arity, frame.locals);
+			arenaTop = base + next->Slots();
+			frame.sp = frame.locals + next->frameSize;
+			fn = next;
+		}
+	}
+	catch (...) {
+		arenaTop = base;
+		throw;
+	}
+	arenaTop = base;
+	return frame.ret;
+}
+
+int Jit::StencilCall(std::uint32_t funcIdx, const int *args) {
+	const auto &fn = stencils[funcIdx];
+	if (fn && arenaTop + fn->Slots() <= arena.size() && HasStackLeft()) {
+		return RunStencils(funcIdx, args);
+	}
+
+	// Through the VM, which counts the call and may compile the callee
+	const auto arity = program.GetFunction(funcIdx)->arity;
+	const std::vector<VarType> values(args, args + arity);
+	const auto ret = vm.Call(FunctionHandle{ funcIdx, arity }, values);
+	const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr;
+	return value ? *value : 0;
+}
+
+int Jit::StencilMemo(std::uint32_t funcIdx, const int *args) {
+	const auto arity = program.GetFunction(funcIdx)->arity;
+	const std::vector<VarType> values(args, args + arity);
+	const auto ret = vm.CallMemoized(FunctionHandle{ funcIdx, arity }, values);
+	const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr;
+	return value ? *value : 0;
+}
+
+int Jit::StencilNative(std::uint32_t nativeIdx, const int *args) {
+	const auto &native = program.GetNative(nativeIdx);
+	const std::vector<VarType> values(args, args + native.paramTypes.size());
+	const auto ret = native.fn(values.data());
+	const auto *value = std::get_if<int>(&ret);
+	return value ? *value : 0;
+}
\ No newline at end of file
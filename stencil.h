@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class Jit;
+
+// Copy-and-patch without a machine code step: every stencil is a C++
+// template instance compiled along with the rest of the program,
+// specialized on where its operands come from and where its result goes.
+// A function becomes an array of stencils with their holes (slots,
+// constants, jump targets) patched in, and runs by chaining from one
+// stencil to the next with nothing left to decode. Nothing in here is
+// specific to an architecture.
+
+struct StencilFrame {
+	int *locals = nullptr;
+	int *sp = nullptr;		// next free operand slot, the stack starts right after the locals
+	Jit *jit = nullptr;
+	int ret = 0;
+	// Tail call to make once the current function returned
+	const int *tailArgs = nullptr;
+	std::uint32_t tailCallee = 0;
+};
+
+struct Stencil;
+// Runs one stencil, returns the next one or null once the function returned
+using StencilFn = const Stencil *(*)(const Stencil *self, StencilFrame &frame);
+
+struct Stencil {
+	StencilFn fn = nullptr;
+	std::int32_t x = 0, y = 0, z = 0;	// holes, mostly left operand, right operand and destination
+	const Stencil *target = nullptr;	// jump hole
+};
+
+struct StencilFunction {
+	std::vector<Stencil> code;
+	std::uint32_t frameSize = 0;		// locals
+	std::uint32_t maxStack = 0;			// operand stack slots
+
+	std::uint32_t Slots() const { return frameSize + maxStack; }
+};
\ No newline at end of file
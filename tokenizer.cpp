@@ -3,7 +3,7 @@
 #include <unordered_map>
 
 namespace {
-	std::unordered_map<std::string, TokenType> keywords = {
+	const std::unordered_map<std::string, TokenType> keywords = {
 		{ "void", TokenType::TYPE_VOID },
 		{ "bool", TokenType::TYPE_BOOL },
 		{ "char", TokenType::TYPE_CHAR },
@@ -16,6 +16,7 @@ namespace {
 		{ "struct", TokenType::TYPE_STRUCT },
 		{ "const", TokenType::CONST },
 		{ "unsigned", TokenType::UNSIGNED },
+		{ "inline", TokenType::INLINE },
 		{ "return", TokenType::RETURN },
 
 		{ "if", TokenType::IF },
@@ -97,7 +98,7 @@ Tokenizer::Tokenizer(std::string_view view) {
 				};
 
 				TokenType type = TokenType::IDENT;
-				if (keywords.contains(word)) { type = keywords[word]; }
+				if (keywords.contains(word)) { type = keywords.at(word); }
 				toks.emplace_back(type, lineCtr, charCtr, word);
 				charCtr += word.size();
 			}
@@ -125,17 +126,17 @@ Tokenizer::Tokenizer(std::string_view view) {
 
 		if (keywords.contains(word)) {
 			if (word.size() > 1) {
-				toks.emplace_back(keywords[word], lineCtr, charCtr++, word);
+				toks.emplace_back(keywords.at(word), lineCtr, charCtr++, word);
 				idx++;
 			}
 			else {
-				toks.emplace_back(keywords[word], lineCtr, charCtr, word);
+				toks.emplace_back(keywords.at(word), lineCtr, charCtr, word);
 			}
 			continue;
 		}
 		word.pop_back();
 		if (keywords.contains(word)) {
-			toks.emplace_back(keywords[word], lineCtr, charCtr, word);
+			toks.emplace_back(keywords.at(word), lineCtr, charCtr, word);
 		}
 	}
 
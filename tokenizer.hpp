@@ -45,6 +45,7 @@ enum class TokenType: std::uint8_t {
 
 	CONST,
 	UNSIGNED,
+	INLINE,
 
 	ASSIGN,
 	NOT,
@@ -0,0 +1,894 @@
+#include "trace.h"
+#include "interpreter.h"
+#include "x64.h"
+#include <algorithm>
+#include <climits>
+#include <numeric>
+#include <utility>
+
+namespace {
+	bool IsBranch(InstructionCode c) {
+		return c == InstructionCode::IF || c == InstructionCode::WHILE || c == InstructionCode::FOR;
+	}
+
+#ifdef JIT_X86_64
+	using namespace x64;
+
+	// Operand stack value the trace has not pushed yet
+	struct Operand {
+		enum Kind : std::uint8_t {
+			STACK,	// already on the machine stack
+			EAX,	// computed, at most one pending value is in eax
+			ECX,	// right operand moved out of eax
+			IMM,
+			SLOT,	// packed local, in its register or in memory
+		} kind = STACK;
+		std::int32_t value = 0;	// constant or packed slot
+	};
+
+	// Compile time arithmetic, none where the machine would trap
+	std::optional<std::int32_t> Fold(InstructionCode c, std::int32_t a, std::int32_t b) {
+		const auto ua = static_cast<std::uint32_t>(a), ub = static_cast<std::uint32_t>(b);
+		switch (c) {
+			case InstructionCode::IADD: return static_cast<std::int32_t>(ua + ub);
+			case InstructionCode::ISUB: return static_cast<std::int32_t>(ua - ub);
+			case InstructionCode::IMUL: return static_cast<std::int32_t>(ua * ub);
+			case InstructionCode::IEQ: return a == b;
+			case InstructionCode::ILE: return a < b;
+			case InstructionCode::IGE: return a > b;
+			case InstructionCode::IDIV:
+			case InstructionCode::MOD:
+				if (b == 0 || (a == INT_MIN && b == -1)) {
+					return std::nullopt;
+				}
+				return c == InstructionCode::IDIV ? a / b : a % b;
+			default:
+				return std::nullopt;
+		}
+	}
+#endif
+}
+
+Tracer::Tracer(VM &vm, const Program &program) : vm(vm), program(program), returnKinds(FindReturnKinds(program)) {}
+
+Tracer::~Tracer() {
+#ifdef JIT_X86_64
+	for (auto &[header, loop] : loops) {
+		if (loop.trace) {
+			x64::Unmap(loop.trace->code, loop.trace->mapped);
+		}
+		for (const auto &trace : loop.replaced) {
+			x64::Unmap(trace->code, trace->mapped);
+		}
+	}
+#endif
+}
+
+std::optional<std::uint32_t> Tracer::BackEdge(const CustomIStream &in, std::size_t frame, std::vector<VarType> &stack, std::vector<VarType> &vars, std::size_t base) {
+	// The recorded loop closes in Record, nothing else runs in its frame meanwhile
+	if (recordCode && frame <= recordFrame) {
+		return std::nullopt;
+	}
+
+	const char *header = in.data() + in.tell();
+	if (header != lastHeader) {
+		lastHeader = header;
+		lastLoop = &loops[header];
+	}
+	auto &loop = *lastLoop;
+	const auto pos = static_cast<std::uint32_t>(in.tell());
+	const auto stackSize = stack.size();
+	if (loop.trace) {
+		auto &trace = *loop.trace;
+		std::uint32_t depth = 0;
+		auto exit = Run(trace, vars, base, stack, depth);
+		if (!exit || exit.value() == pos || recordCode || trace.paths.size() >= maxPaths) {
+			return exit;
+		}
+		// The interpreter continues at the exit, record from there
+		auto &hits = trace.exitHits[exit.value()];
+		if (hits != coldExit && ++hits == hotExit) {
+			StartRecording(in, exit.value(), depth, frame, stackSize);
+		}
+		return exit;
+	}
+	if (recordCode || loop.aborts >= maxAborts || ++loop.hits < hotLoop) {
+		return std::nullopt;
+	}
+
+	loop.hits = 0;
+	StartRecording(in, pos, 0, frame, stackSize);
+	return std::nullopt;
+}
+
+void Tracer::StartRecording(const CustomIStream &in, std::uint32_t start, std::uint32_t depth, std::size_t frame, std::size_t stackSize) {
+	recordCode = in.data();
+	recordHeader = static_cast<std::uint32_t>(in.tell());
+	recordStart = start;
+	recordDepth = depth;
+	recordSize = static_cast<std::uint32_t>(in.length());
+	recordFrame = frame;
+	recordStack = stackSize;
+	steps.clear();
+}
+
+void Tracer::Record(const CustomIStream &in, std::size_t frame, std::size_t stackSize) {
+	if (frame > recordFrame) {
+		return;		// inside a call the loop makes
+	}
+	const auto pos = static_cast<std::uint32_t>(in.tell());
+	if (frame < recordFrame || in.data() != recordCode) {
+		Abort();
+		return;
+	}
+
+	if (steps.empty() && pos != recordStart) {
+		Abort();
+		return;
+	}
+	if (!steps.empty()) {
+		// Only paths the last instruction can take, and no other loop
+		const auto &last = steps.back();
+		const auto target = JumpTarget(last, recordSize);
+		const bool falls = pos == last.next && last.code != InstructionCode::SKIP && last.code != InstructionCode::BACK;
+		if (!falls && pos != target) {
+			Abort();
+			return;
+		}
+		if (pos == recordHeader) {
+			if (stackSize != recordStack) {
+				Abort();
+				return;
+			}
+			Finish(true);
+			return;
+		}
+		if (pos < last.pos) {
+			Abort();
+			return;
+		}
+	}
+
+	const auto inst = DecodeInstruction(recordCode, recordSize, pos);
+	if (!inst || steps.size() >= maxTraceLength) {
+		Abort();
+		return;
+	}
+	bool supported = true;
+	switch (inst->code) {
+		case InstructionCode::NOP:
+		case InstructionCode::ELSE:
+		case InstructionCode::ENDIF:
+		case InstructionCode::SKIP:
+		case InstructionCode::BACK:
+		case InstructionCode::ICONST:
+		case InstructionCode::ILOAD:
+		case InstructionCode::ISTORE:
+		case InstructionCode::POP:
+		case InstructionCode::DUP:
+		case InstructionCode::IADD:
+		case InstructionCode::ISUB:
+		case InstructionCode::IMUL:
+		case InstructionCode::IDIV:
+		case InstructionCode::MOD:
+		case InstructionCode::INC:
+		case InstructionCode::DEC:
+		case InstructionCode::INCBY:
+		case InstructionCode::IEQ:
+		case InstructionCode::ILE:
+		case InstructionCode::IGE:
+			break;
+		case InstructionCode::IF:
+		case InstructionCode::WHILE:
+		case InstructionCode::FOR:
+		case InstructionCode::LOOP:
+			supported = stackSize > recordStack;
+			break;
+		case InstructionCode::FUNCTIONCALL:
+		case InstructionCode::MEMOCALL: {
+			const auto *callee = inst->a < returnKinds.size() ? program.GetFunction(inst->a) : nullptr;
+			supported = callee && callee->arity == inst->b && !returnKinds[inst->a].isFloat;
+			break;
+		}
+		case InstructionCode::NATIVECALL: {
+			const auto &native = program.GetNative(inst->a);
+			supported = native.paramTypes.size() == inst->b && (native.returnType == "int" || native.returnType == "void") &&
+				std::all_of(native.paramTypes.begin(), native.paramTypes.end(), [](const std::string &type) { return type == "int"; });
+			break;
+		}
+		default:
+			supported = false;
+			break;
+	}
+	if (!supported) {
+		Abort();
+		return;
+	}
+	steps.push_back(inst.value());
+}
+
+void Tracer::Abort() {
+	if (recordCode) {
+		Finish(false);
+	}
+}
+
+void Tracer::Finish(bool closed) {
+	auto &loop = loops[recordCode + recordHeader];
+	const bool exitPath = recordStart != recordHeader;
+	std::unique_ptr<Trace> trace;
+	if (closed) {
+		auto paths = exitPath ? loop.trace->paths : std::vector<Path>{};
+		paths.push_back(Path{ recordStart, recordDepth, std::move(steps) });
+		trace = Compile(std::move(paths));
+	}
+
+	if (trace) {
+		if (loop.trace) {
+			loop.replaced.push_back(std::move(loop.trace));
+		}
+		loop.trace = std::move(trace);
+	}
+	else if (exitPath) {
+		loop.trace->exitHits[recordStart] = coldExit;
+	}
+	else {
+		++loop.aborts;
+	}
+	recordCode = nullptr;
+	steps.clear();
+}
+
+std::optional<std::uint32_t> Tracer::Run(Trace &trace, std::vector<VarType> &vars, std::size_t base, std::vector<VarType> &stack, std::uint32_t &depth) {
+	// The trace was compiled for integers in every local it touches
+	if (vars.size() < base + trace.frameSize) {
+		vars.resize(base + trace.frameSize);
+	}
+	const auto packed = trace.slots.size();
+	std::vector<int> nested;
+	auto &values = trace.running ? nested : trace.values;
+	values.resize(packed + 1 + trace.maxExitDepth);
+	for (std::size_t i = 0; i < packed; ++i) {
+		const auto *value = std::get_if<int>(&vars[base + trace.slots[i]]);
+		if (!value) {
+			return std::nullopt;
+		}
+		values[i] = *value;
+	}
+
+	using Entry = std::uint32_t (*)(int *values);
+	const bool running = std::exchange(trace.running, true);
+	const auto exit = reinterpret_cast<Entry>(trace.code)(values.data());
+	trace.running = running;
+
+	for (std::size_t i = 0; i < packed; ++i) {
+		vars[base + trace.slots[i]] = values[i];
+	}
+	if (failed) {
+		failed = 0;
+		std::rethrow_exception(std::exchange(error, nullptr));
+	}
+	depth = static_cast<std::uint32_t>(values[packed]);
+	stack.insert(stack.end(), values.begin() + packed + 1, values.begin() + packed + 1 + depth);
+	return exit;
+}
+
+int Tracer::CallFromTrace(Tracer *tracer, std::uint32_t funcIdx, const std::int64_t *args) {
+	try {
+		const auto arity = tracer->program.GetFunction(funcIdx)->arity;
+		auto &values = tracer->callArgs;
+		values.resize(arity);
+		for (std::uint32_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = tracer->vm.Call(FunctionHandle{ funcIdx, arity }, values);
+		if (const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr) {
+			return *value;
+		}
+	}
+	catch (...) {
+		tracer->error = std::current_exception();
+		tracer->failed = 1;
+	}
+	return 0;
+}
+
+int Tracer::MemoFromTrace(Tracer *tracer, std::uint32_t funcIdx, const std::int64_t *args) {
+	try {
+		const auto arity = tracer->program.GetFunction(funcIdx)->arity;
+		auto &values = tracer->callArgs;
+		values.resize(arity);
+		for (std::uint32_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = tracer->vm.CallMemoized(FunctionHandle{ funcIdx, arity }, values);
+		if (const auto *value = ret ? std::get_if<int>(&ret.value()) : nullptr) {
+			return *value;
+		}
+	}
+	catch (...) {
+		tracer->error = std::current_exception();
+		tracer->failed = 1;
+	}
+	return 0;
+}
+
+int Tracer::NativeFromTrace(Tracer *tracer, std::uint32_t nativeIdx, const std::int64_t *args) {
+	try {
+		const auto &native = tracer->program.GetNative(nativeIdx);
+		const auto arity = native.paramTypes.size();
+		std::vector<VarType> values(arity);
+		for (std::size_t i = 0; i < arity; ++i) {
+			values[i] = static_cast<int>(args[arity - 1 - i]);
+		}
+
+		const auto ret = native.fn(values.data());
+		if (const auto *value = std::get_if<int>(&ret)) {
+			return *value;
+		}
+	}
+	catch (...) {
+		tracer->error = std::current_exception();
+		tracer->failed = 1;
+	}
+	return 0;
+}
+
+std::unique_ptr<Tracer::Trace> Tracer::Compile(std::vector<Path> paths) {
+#ifdef JIT_X86_64
+	auto trace = std::make_unique<Trace>();
+
+	// Locals get packed in order of appearance, the most used ones live in
+	// registers for the whole trace. Calls keep only callee saved ones
+	std::unordered_map<std::uint32_t, std::int32_t> packed;
+	std::vector<std::uint32_t> uses;
+	bool calls = false;
+	for (const auto &path : paths) {
+		for (const auto &inst : path.steps) {
+			calls |= inst.code == InstructionCode::FUNCTIONCALL || inst.code == InstructionCode::MEMOCALL || inst.code == InstructionCode::NATIVECALL;
+			if (!IsSlotInstruction(inst.code)) {
+				continue;
+			}
+			auto [it, added] = packed.try_emplace(inst.a, static_cast<std::int32_t>(trace->slots.size()));
+			if (added) {
+				trace->slots.push_back(inst.a);
+				trace->frameSize = std::max(trace->frameSize, inst.a + 1);
+				uses.push_back(0);
+			}
+			++uses[it->second];
+		}
+	}
+	if (trace->frameSize > (1u << 20)) {
+		return nullptr;
+	}
+
+	std::vector<Reg> pool{ RBX, R12, R13, R14, R15 };
+	if (!calls) {
+		pool.insert(pool.end(), { RSI, RDI, R8, R9, R10, R11 });
+	}
+	std::vector<std::size_t> order(trace->slots.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return uses[a] > uses[b]; });
+	std::vector<int> registers(trace->slots.size(), -1);
+	for (std::size_t i = 0; i < order.size() && i < pool.size(); ++i) {
+		registers[order[i]] = pool[i];
+	}
+
+	Assembler as;
+	Assembler::Label leave;
+	std::vector<Assembler::Label> starts(paths.size());
+	auto &loopStart = starts[0];
+	struct Exit {
+		Assembler::Label label;
+		std::uint32_t pos = 0, depth = 0;	// bytecode offset to continue at, values on the machine stack
+	};
+	std::vector<Exit> exits;
+	std::vector<std::pair<Assembler::Label, std::int32_t>> failures;	// failed call, machine stack to drop
+
+	const auto disp = [](std::int32_t slot) { return slot * static_cast<std::int32_t>(sizeof(std::int32_t)); };
+	// Instruction with a packed local as its rm operand
+	auto slotOp = [&](const std::vector<std::uint8_t> &opcode, std::uint8_t reg, std::int32_t slot) {
+		if (registers[slot] >= 0) {
+			as.Registers(opcode, reg, static_cast<std::uint8_t>(registers[slot]));
+		}
+		else {
+			as.Frame(opcode, reg, disp(slot));
+		}
+	};
+	auto rmOp = [&](const std::vector<std::uint8_t> &opcode, std::uint8_t reg, const Operand &operand) {
+		if (operand.kind == Operand::SLOT) {
+			slotOp(opcode, reg, operand.value);
+		}
+		else {
+			as.Registers(opcode, reg, operand.kind == Operand::EAX ? RAX : RCX);
+		}
+	};
+	// Operand stack values of the trace, pending or pushed
+	std::size_t depth = 0;
+	std::size_t machineDepth = 0;
+
+	// Guards go down another recorded path where there is one, the
+	// operand stack is all on the machine stack by then
+	auto exitLabel = [&](std::uint32_t pos) -> Assembler::Label & {
+		for (std::size_t i = 0; i < paths.size(); ++i) {
+			if (paths[i].start == pos && paths[i].depth == depth) {
+				return starts[i];
+			}
+		}
+		exits.push_back(Exit{ {}, pos, static_cast<std::uint32_t>(depth) });
+		trace->maxExitDepth = std::max(trace->maxExitDepth, exits.back().depth);
+		return exits.back().label;
+	};
+	auto exitIf = [&](Cond cond, std::uint32_t pos) {
+		as.JumpIf(cond, exitLabel(pos));
+	};
+	auto exitAlways = [&](std::uint32_t pos) {
+		as.Jump(exitLabel(pos));
+	};
+
+	// Values stay pending like in the baseline compiler, constants known
+	// to be in locals since the start of the iteration fold right in
+	std::vector<Operand> pending;
+	std::vector<std::optional<std::int32_t>> known(trace->slots.size());
+	auto spill = [&]() {
+		for (const auto &operand : pending) {
+			switch (operand.kind) {
+				case Operand::EAX: as.Emit({ 0x50 }); break;						// push rax
+				case Operand::IMM: as.Emit({ 0x68 }); as.Imm32(operand.value); break;	// push imm32
+				case Operand::SLOT:
+					if (registers[operand.value] >= 0) {
+						as.Short(0x50, static_cast<std::uint8_t>(registers[operand.value]));	// push reg
+					}
+					else {
+						as.Frame({ 0x8B }, RCX, disp(operand.value));	// mov ecx, [local]
+						as.Emit({ 0x51 });								// push rcx
+					}
+					break;
+				default: break;
+			}
+			++machineDepth;
+		}
+		pending.clear();
+	};
+	auto pop = [&]() {
+		if (pending.empty()) {
+			return Operand{};
+		}
+		auto operand = pending.back();
+		pending.pop_back();
+		return operand;
+	};
+	auto freeEax = [&]() {
+		if (std::any_of(pending.begin(), pending.end(), [](const Operand &operand) { return operand.kind == Operand::EAX; })) {
+			spill();
+		}
+	};
+	auto spillIfReads = [&](std::int32_t slot) {
+		if (std::any_of(pending.begin(), pending.end(), [&](const Operand &operand) { return operand.kind == Operand::SLOT && operand.value == slot; })) {
+			spill();
+		}
+	};
+	auto toEax = [&](const Operand &operand) {
+		switch (operand.kind) {
+			case Operand::STACK: as.Emit({ 0x58 }); --machineDepth; break;		// pop rax
+			case Operand::IMM: as.Emit({ 0xB8 }); as.Imm32(operand.value); break;	// mov eax, imm32
+			case Operand::SLOT: slotOp({ 0x8B }, RAX, operand.value); break;	// mov eax, local
+			default: break;
+		}
+	};
+	auto binaryOperands = [&]() {
+		auto right = pop(), left = pop();
+		if (right.kind == Operand::STACK) {
+			as.Emit({ 0x59, 0x58 });		// pop rcx, pop rax
+			machineDepth -= 2;
+			right.kind = Operand::ECX;
+		}
+		else if (right.kind == Operand::EAX) {
+			as.Emit({ 0x89, 0xC1 });		// mov ecx, eax
+			right.kind = Operand::ECX;
+			toEax(left);
+		}
+		else if (left.kind != Operand::EAX) {
+			freeEax();
+			toEax(left);
+		}
+		return right;
+	};
+	auto arith = [&](InstructionCode c, const Operand &right) {
+		struct Encoding { std::vector<std::uint8_t> imm, rm; };
+		static const Encoding add{ { 0x05 }, { 0x03 } };
+		static const Encoding sub{ { 0x2D }, { 0x2B } };
+		static const Encoding mul{ { 0x69, 0xC0 }, { 0x0F, 0xAF } };
+		static const Encoding cmp{ { 0x3D }, { 0x3B } };
+		const auto &enc = c == InstructionCode::IADD ? add : c == InstructionCode::ISUB ? sub : c == InstructionCode::IMUL ? mul : cmp;
+
+		if (right.kind == Operand::IMM) {
+			as.Emit(enc.imm);
+			as.Imm32(right.value);
+		}
+		else {
+			rmOp(enc.rm, RAX, right);
+		}
+	};
+	auto store = [&](std::int32_t slot, const Operand &value) {
+		const int reg = registers[slot];
+		if (value.kind == Operand::IMM) {
+			if (reg >= 0) {
+				as.Short(0xB8, static_cast<std::uint8_t>(reg));	// mov reg, imm32
+			}
+			else {
+				as.Frame({ 0xC7 }, 0, disp(slot));				// mov dword [local], imm32
+			}
+			as.Imm32(value.value);
+			return;
+		}
+		if (value.kind == Operand::SLOT && value.value == slot) {
+			return;
+		}
+
+		std::uint8_t source = RCX;
+		if (value.kind == Operand::EAX) {
+			source = RAX;
+		}
+		else if (value.kind == Operand::SLOT && registers[value.value] >= 0) {
+			source = static_cast<std::uint8_t>(registers[value.value]);
+		}
+		else if (value.kind == Operand::SLOT) {
+			as.Frame({ 0x8B }, RCX, disp(value.value));		// mov ecx, [other]
+		}
+		else if (value.kind == Operand::STACK) {
+			as.Emit({ 0x59 });									// pop rcx
+			--machineDepth;
+		}
+		if (reg >= 0) {
+			as.Registers({ 0x89 }, source, static_cast<std::uint8_t>(reg));	// mov reg, source
+		}
+		else {
+			as.Frame({ 0x89 }, source, disp(slot));			// mov [local], source
+		}
+	};
+	auto callHelper = [&](int (*helper)(Tracer *, std::uint32_t, const std::int64_t *), std::uint32_t idx, std::uint32_t params) {
+		// Six saved registers and the return address, the stack is aligned with an odd number of values on it
+		const bool pad = machineDepth % 2 == 0;
+		as.Emit({ 0x48, 0xBF }); as.Imm64(reinterpret_cast<std::uint64_t>(this));	// mov rdi, this
+		as.Emit({ 0xBE }); as.Imm32(static_cast<std::int32_t>(idx));	// mov esi, idx
+		as.Emit({ 0x48, 0x89, 0xE2 });				// mov rdx, rsp
+		if (pad) {
+			as.Emit({ 0x48, 0x83, 0xEC, 0x08 });	// sub rsp, 8
+		}
+		as.Emit({ 0x48, 0xB8 }); as.Imm64(reinterpret_cast<std::uint64_t>(helper));	// mov rax, helper
+		as.Emit({ 0xFF, 0xD0 });					// call rax
+		if (pad) {
+			as.Emit({ 0x48, 0x83, 0xC4, 0x08 });	// add rsp, 8
+		}
+		as.Emit({ 0x48, 0xB9 }); as.Imm64(reinterpret_cast<std::uint64_t>(&failed));	// mov rcx, &failed
+		as.Emit({ 0x80, 0x39, 0x00 });				// cmp byte [rcx], 0
+		failures.emplace_back(Assembler::Label{}, static_cast<std::int32_t>(machineDepth * sizeof(std::int64_t)));
+		as.JumpIf(NOT_EQUAL, failures.back().first);
+		if (params) {
+			as.Emit({ 0x48, 0x81, 0xC4 }); as.Imm32(static_cast<std::int32_t>(params * sizeof(std::int64_t)));	// add rsp, params
+			machineDepth -= params;
+		}
+	};
+
+	// Prologue, rbp points at the packed locals
+	as.Emit({ 0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });	// push rbp, rbx, r12, r13, r14, r15
+	as.Emit({ 0x48, 0x89, 0xFD });					// mov rbp, rdi
+	for (std::size_t slot = 0; slot < registers.size(); ++slot) {
+		if (registers[slot] >= 0) {
+			as.Frame({ 0x8B }, static_cast<std::uint8_t>(registers[slot]), disp(static_cast<std::int32_t>(slot)));	// mov reg, [local]
+		}
+	}
+
+	// The first path falls in from the prologue, every path ends going around the loop again
+	for (std::size_t p = 0; p < paths.size(); ++p) {
+		const auto &steps = paths[p].steps;
+		as.Bind(starts[p]);
+		std::fill(known.begin(), known.end(), std::nullopt);
+		depth = machineDepth = paths[p].depth;
+
+		for (std::size_t i = 0; i < steps.size(); ++i) {
+			const auto &inst = steps[i];
+			// Where the recorded iteration went after each instruction
+			const auto after = [&](std::size_t step) { return step + 1 < steps.size() ? steps[step + 1].pos : recordHeader; };
+
+			std::size_t pops = 0, pushes = 0;
+			switch (inst.code) {
+				case InstructionCode::ISTORE: case InstructionCode::POP: case InstructionCode::IF:
+				case InstructionCode::WHILE: case InstructionCode::FOR: case InstructionCode::LOOP:
+					pops = 1; break;
+				case InstructionCode::DUP: pops = 1; pushes = 2; break;
+				case InstructionCode::ICONST: case InstructionCode::ILOAD: pushes = 1; break;
+				case InstructionCode::IADD: case InstructionCode::ISUB: case InstructionCode::IMUL: case InstructionCode::IDIV:
+				case InstructionCode::MOD: case InstructionCode::IEQ: case InstructionCode::ILE: case InstructionCode::IGE:
+					pops = 2; pushes = 1; break;
+				case InstructionCode::FUNCTIONCALL: case InstructionCode::MEMOCALL:
+					pops = inst.b; pushes = returnKinds[inst.a].value; break;
+				case InstructionCode::NATIVECALL:
+					pops = inst.b; pushes = program.GetNative(inst.a).returnsValue; break;
+				default: break;
+			}
+			if (pops > depth) {
+				return nullptr;		// reads values from before the loop
+			}
+			depth = depth - pops + pushes;
+
+			const auto slot = static_cast<std::int32_t>(IsSlotInstruction(inst.code) ? packed[inst.a] : 0);
+			switch (inst.code) {
+				case InstructionCode::ICONST:
+					pending.push_back(Operand{ Operand::IMM, static_cast<std::int32_t>(inst.a) });
+					break;
+				case InstructionCode::ILOAD:
+					pending.push_back(known[slot] ? Operand{ Operand::IMM, known[slot].value() } : Operand{ Operand::SLOT, slot });
+					break;
+				case InstructionCode::ISTORE: {
+					auto value = pop();
+					spillIfReads(slot);
+					store(slot, value);
+					known[slot] = value.kind == Operand::IMM ? std::optional{ value.value } : std::nullopt;
+					break;
+				}
+				case InstructionCode::POP:
+					if (pending.empty()) {
+						as.Emit({ 0x48, 0x83, 0xC4, 0x08 });	// add rsp, 8
+						--machineDepth;
+					}
+					else {
+						pending.pop_back();
+					}
+					break;
+				case InstructionCode::DUP: {
+					auto top = pop();
+					if (top.kind == Operand::IMM || top.kind == Operand::SLOT) {
+						pending.push_back(top);
+						pending.push_back(top);
+						break;
+					}
+					if (top.kind == Operand::EAX) {
+						pending.push_back(top);
+						spill();
+					}
+					else {
+						as.Emit({ 0x48, 0x8B, 0x04, 0x24 });	// mov rax, [rsp]
+					}
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+
+				case InstructionCode::IADD:
+				case InstructionCode::ISUB:
+				case InstructionCode::IMUL:
+				case InstructionCode::IDIV:
+				case InstructionCode::MOD:
+				case InstructionCode::IEQ:
+				case InstructionCode::ILE:
+				case InstructionCode::IGE: {
+					if (pending.size() >= 2 && pending[pending.size() - 2].kind == Operand::IMM && pending.back().kind == Operand::IMM) {
+						if (auto value = Fold(inst.code, pending[pending.size() - 2].value, pending.back().value)) {
+							pending.pop_back();
+							pending.back().value = value.value();
+							break;
+						}
+					}
+
+					auto right = binaryOperands();
+					if (inst.code == InstructionCode::IDIV || inst.code == InstructionCode::MOD) {
+						if (right.kind == Operand::IMM) {
+							as.Emit({ 0xB9 }); as.Imm32(right.value);	// mov ecx, imm32
+							right.kind = Operand::ECX;
+						}
+						as.Emit({ 0x99 });								// cdq
+						rmOp({ 0xF7 }, 7, right);						// idiv right
+						if (inst.code == InstructionCode::MOD) {
+							as.Emit({ 0x89, 0xD0 });					// mov eax, edx
+						}
+						pending.push_back(Operand{ Operand::EAX });
+						break;
+					}
+					arith(inst.code, right);
+					if (inst.code == InstructionCode::IADD || inst.code == InstructionCode::ISUB || inst.code == InstructionCode::IMUL) {
+						pending.push_back(Operand{ Operand::EAX });
+						break;
+					}
+
+					// A compare feeding a branch guards on the flags directly
+					const Cond cond = inst.code == InstructionCode::IEQ ? EQUAL : inst.code == InstructionCode::ILE ? LESS : GREATER;
+					if (i + 1 < steps.size() && IsBranch(steps[i + 1].code)) {
+						const auto &branch = steps[++i];
+						const auto target = JumpTarget(branch, recordSize).value();
+						--depth;
+						spill();
+						if (target != branch.next) {
+							if (after(i) == branch.next) {
+								exitIf(Invert(cond), target);
+							}
+							else {
+								exitIf(cond, branch.next);
+							}
+						}
+						break;
+					}
+					as.Emit({ 0x0F, static_cast<std::uint8_t>(0x90 | cond), 0xC0 });	// setcc al
+					as.Emit({ 0x0F, 0xB6, 0xC0 });				// movzx eax, al
+					pending.push_back(Operand{ Operand::EAX });
+					break;
+				}
+				case InstructionCode::INC:
+				case InstructionCode::DEC:
+				case InstructionCode::INCBY: {
+					const int step = inst.code == InstructionCode::INC ? 1 : inst.code == InstructionCode::DEC ? -1 : static_cast<int>(inst.b);
+					spillIfReads(slot);
+					slotOp({ 0x81 }, 0, slot);					// add local, imm32
+					as.Imm32(step);
+					if (known[slot]) {
+						known[slot] = static_cast<std::int32_t>(static_cast<std::uint32_t>(known[slot].value()) + static_cast<std::uint32_t>(step));
+					}
+					break;
+				}
+
+				case InstructionCode::IF:
+				case InstructionCode::WHILE:
+				case InstructionCode::FOR: {
+					const auto target = JumpTarget(inst, recordSize).value();
+					const bool stays = after(i) == inst.next;
+					auto cond = pop();
+					spill();
+					if (target == inst.next) {
+						if (cond.kind == Operand::STACK) {
+							as.Emit({ 0x48, 0x83, 0xC4, 0x08 });	// add rsp, 8
+							--machineDepth;
+						}
+						break;
+					}
+					if (cond.kind == Operand::IMM) {
+						if ((cond.value != 0) != stays) {
+							exitAlways(stays ? target : inst.next);
+						}
+						break;
+					}
+					if (cond.kind == Operand::SLOT && registers[cond.value] >= 0) {
+						const auto reg = static_cast<std::uint8_t>(registers[cond.value]);
+						as.Registers({ 0x85 }, reg, reg);			// test reg, reg
+					}
+					else if (cond.kind == Operand::SLOT) {
+						as.Frame({ 0x83 }, 7, disp(cond.value)); as.Emit({ 0x00 });	// cmp dword [local], 0
+					}
+					else {
+						toEax(cond);
+						as.Emit({ 0x85, 0xC0 });					// test eax, eax
+					}
+					exitIf(stays ? EQUAL : NOT_EQUAL, stays ? target : inst.next);
+					break;
+				}
+				case InstructionCode::LOOP: {
+					const auto target = JumpTarget(inst, recordSize).value();
+					const bool stays = after(i) == target;
+					auto limit = pop();
+					if (limit.kind == Operand::EAX) {
+						as.Emit({ 0x89, 0xC1 });					// mov ecx, eax
+						limit.kind = Operand::ECX;
+					}
+					else if (limit.kind == Operand::STACK) {
+						as.Emit({ 0x59 });							// pop rcx
+						--machineDepth;
+						limit.kind = Operand::ECX;
+					}
+					else if (limit.kind == Operand::SLOT && limit.value == slot) {
+						slotOp({ 0x8B }, RCX, slot);				// mov ecx, counter
+						limit.kind = Operand::ECX;
+					}
+					spill();
+
+					if (known[slot] && limit.kind == Operand::IMM) {
+						const auto counter = static_cast<std::int32_t>(static_cast<std::uint32_t>(known[slot].value()) + 1);
+						known[slot] = counter;
+						store(slot, Operand{ Operand::IMM, counter });
+						if ((counter < limit.value) != stays) {
+							exitAlways(stays ? inst.next : target);
+						}
+						break;
+					}
+					known[slot].reset();
+
+					std::uint8_t counter = RAX;
+					if (registers[slot] >= 0) {
+						counter = static_cast<std::uint8_t>(registers[slot]);
+						as.Registers({ 0x83 }, 0, counter); as.Emit({ 0x01 });	// add counter, 1
+					}
+					else {
+						as.Frame({ 0x83 }, 0, disp(slot)); as.Emit({ 0x01 });	// add dword [counter], 1
+						as.Frame({ 0x8B }, RAX, disp(slot));		// mov eax, [counter]
+					}
+					if (limit.kind == Operand::IMM) {
+						as.Registers({ 0x81 }, 7, counter); as.Imm32(limit.value);	// cmp counter, imm32
+					}
+					else {
+						rmOp({ 0x3B }, counter, limit);				// cmp counter, limit
+					}
+					exitIf(stays ? GREATER_EQUAL : LESS, stays ? inst.next : target);
+					break;
+				}
+
+				case InstructionCode::FUNCTIONCALL:
+					spill();
+					callHelper(&Tracer::CallFromTrace, inst.a, inst.b);
+					if (returnKinds[inst.a].value) {
+						pending.push_back(Operand{ Operand::EAX });
+					}
+					break;
+				case InstructionCode::MEMOCALL:
+					spill();
+					callHelper(&Tracer::MemoFromTrace, inst.a, inst.b);
+					if (returnKinds[inst.a].value) {
+						pending.push_back(Operand{ Operand::EAX });
+					}
+					break;
+				case InstructionCode::NATIVECALL:
+					spill();
+					callHelper(&Tracer::NativeFromTrace, inst.a, inst.b);
+					if (program.GetNative(inst.a).returnsValue) {
+						pending.push_back(Operand{ Operand::EAX });
+					}
+					break;
+				default:
+					break;
+			}
+		}
+		if (depth != 0) {
+			return nullptr;
+		}
+		spill();
+		as.Jump(loopStart);
+	}
+
+	// Exits store the operand stack after the locals and hand the bytecode offset to continue at back in eax
+	const auto stackDisp = disp(static_cast<std::int32_t>(trace->slots.size()));
+	for (auto &exit : exits) {
+		as.Bind(exit.label);
+		for (auto value = exit.depth; value-- > 0;) {
+			as.Emit({ 0x59 });							// pop rcx
+			as.Frame({ 0x89 }, RCX, stackDisp + disp(static_cast<std::int32_t>(value + 1)));	// mov [value], ecx
+		}
+		as.Frame({ 0xC7 }, 0, stackDisp); as.Imm32(static_cast<std::int32_t>(exit.depth));	// mov dword [count], depth
+		as.Emit({ 0xB8 }); as.Imm32(static_cast<std::int32_t>(exit.pos));	// mov eax, pos
+		as.Jump(leave);
+	}
+	for (auto &[label, drop] : failures) {
+		as.Bind(label);
+		if (drop) {
+			as.Emit({ 0x48, 0x81, 0xC4 }); as.Imm32(drop);	// add rsp, drop
+		}
+		as.Emit({ 0xB8 }); as.Imm32(static_cast<std::int32_t>(errorExit));	// mov eax, errorExit
+		as.Jump(leave);
+	}
+	as.Bind(leave);
+	for (std::size_t slot = 0; slot < registers.size(); ++slot) {
+		if (registers[slot] >= 0) {
+			as.Frame({ 0x89 }, static_cast<std::uint8_t>(registers[slot]), disp(static_cast<std::int32_t>(slot)));	// mov [local], reg
+		}
+	}
+	as.Emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0x5D, 0xC3 });	// pop r15, r14, r13, r12, rbx, rbp, ret
+
+	for (const auto &start : starts) {
+		as.Patch(start);
+	}
+	as.Patch(leave);
+	for (const auto &exit : exits) {
+		as.Patch(exit.label);
+	}
+	for (const auto &[label, drop] : failures) {
+		as.Patch(label);
+	}
+
+	trace->paths = std::move(paths);
+	trace->code = Map(as.Bytes(), trace->mapped);
+	if (!trace->code) {
+		return nullptr;
+	}
+	return trace;
+#else
+	return nullptr;
+#endif
+}
\ No newline at end of file
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "jit.h"
+
+class CustomIStream;
+
+// Compiles hot loops of interpreted functions. Taken back edges are
+// counted per loop header, once a loop is hot the interpreter records one
+// iteration as it runs it and that path becomes straight machine code
+// looping on itself. Branches the recorded iteration took are guards, a
+// guard that fails leaves the trace and the interpreter carries on right
+// there. Exits taken often get the path from there back to the header
+// recorded as well, and the loop is compiled again with the guard going
+// down that path instead. Traces keep the locals they use in registers and
+// only ever see integers, the locals are checked on entry.
+class Tracer {
+public:
+	static constexpr std::uint32_t hotLoop = 50;			// taken back edges before a loop is recorded
+	static constexpr std::size_t maxTraceLength = 500;		// instructions
+	static constexpr std::uint32_t maxAborts = 3;			// failed recordings before a loop is left alone
+	static constexpr std::uint32_t hotExit = 20;			// times an exit is taken before its path is recorded
+	static constexpr std::size_t maxPaths = 8;
+	static constexpr std::uint32_t errorExit = ~0u;
+private:
+	// Recorded instructions from start until the loop header comes around again
+	struct Path {
+		std::uint32_t start = 0;
+		std::uint32_t depth = 0;			// operand stack values of the loop it starts with
+		std::vector<JitInstruction> steps;
+	};
+	struct Trace {
+		void *code = nullptr;
+		std::size_t mapped = 0;
+		std::vector<Path> paths;			// the first one starts at the header
+		std::vector<std::uint32_t> slots;	// locals used, the compiled code sees them packed in this order
+		std::uint32_t frameSize = 0;		// highest local used plus one
+		std::uint32_t maxExitDepth = 0;
+		// Packed locals, then what an exit leaves on the operand stack: the count and the values
+		std::vector<int> values;
+		bool running = false;
+		std::unordered_map<std::uint32_t, std::uint32_t> exitHits;	// by bytecode offset, coldExit once recording failed
+	};
+	static constexpr std::uint32_t coldExit = ~0u;
+	struct Loop {
+		std::uint32_t hits = 0;
+		std::uint32_t aborts = 0;
+		std::unique_ptr<Trace> trace;
+		std::vector<std::unique_ptr<Trace>> replaced;	// could still be running further up the stack
+	};
+
+	VM &vm;
+	const Program &program;
+	std::vector<ReturnKind> returnKinds;
+	std::unordered_map<const char *, Loop> loops;	// keyed by the header's address in the image
+	const char *lastHeader = nullptr;
+	Loop *lastLoop = nullptr;
+
+	// Recording, code is null when not recording
+	const char *recordCode = nullptr;
+	std::uint32_t recordHeader = 0, recordStart = 0, recordDepth = 0, recordSize = 0;
+	std::size_t recordFrame = 0, recordStack = 0;
+	std::vector<JitInstruction> steps;
+
+	std::vector<VarType> callArgs;		// VM::Call copies them before anything else runs
+	std::uint8_t failed = 0;			// set by generated code, a script error is waiting in error
+	std::exception_ptr error;
+
+	void StartRecording(const CustomIStream &in, std::uint32_t start, std::uint32_t depth, std::size_t frame, std::size_t stackSize);
+	// Ends the recording, compiling the loop again when the path got back to the header
+	void Finish(bool closed);
+	std::unique_ptr<Trace> Compile(std::vector<Path> paths);
+	std::optional<std::uint32_t> Run(Trace &trace, std::vector<VarType> &vars, std::size_t base, std::vector<VarType> &stack, std::uint32_t &depth);
+
+	// Called from generated code, errors are stored instead of thrown
+	static int CallFromTrace(Tracer *tracer, std::uint32_t funcIdx, const std::int64_t *args);
+	static int MemoFromTrace(Tracer *tracer, std::uint32_t funcIdx, const std::int64_t *args);
+	static int NativeFromTrace(Tracer *tracer, std::uint32_t nativeIdx, const std::int64_t *args);
+public:
+	Tracer(VM &vm, const Program &program);
+	Tracer(const Tracer &) = delete;
+	Tracer &operator=(const Tracer &) = delete;
+	~Tracer();
+
+	bool Recording() const { return recordCode != nullptr; }
+
+	// A back edge to in's position was just taken in frame, with base the
+	// frame's first local. Runs the loop's trace if there is one and
+	// returns where to continue, starts recording once the loop is hot
+	std::optional<std::uint32_t> BackEdge(const CustomIStream &in, std::size_t frame, std::vector<VarType> &stack, std::vector<VarType> &vars, std::size_t base);
+	// The interpreter is about to run the instruction at in's position
+	void Record(const CustomIStream &in, std::size_t frame, std::size_t stackSize);
+	// Drops a recording the VM could not finish, like after a script error
+	void Abort();
+};
\ No newline at end of file
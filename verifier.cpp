@@ -0,0 +1,157 @@
+#include "verifier.h"
+#include <string>
+#include <vector>
+
+namespace {
+	struct Instruction {
+		std::size_t pos = 0, next = 0;
+		InstructionCode code = InstructionCode::NOP;
+		std::uint32_t a = 0, b = 0;
+	};
+
+	std::string Rejected(std::size_t offset, const std::string &why) {
+		return "offset " + std::to_string(offset) + ", " + why;
+	}
+}
+
+void VerifyFunction(std::span<const char> code, const ImageFunction &func, std::span<const CallTarget> functions, std::span<const CallTarget> natives) {
+	const bool returnsValue = func.returns != ValueKind::NONE;
+	constexpr auto notStart = ~std::size_t{ 0 };
+	// Calls copy the arguments into the first slots
+	if (func.frameSize < func.arity) {
+		throw Rejected(0, "frame of " + std::to_string(func.frameSize) + " slots for " + std::to_string(func.arity) + " parameters");
+	}
+
+	// Decoded in order, only these offsets and the end are valid targets
+	std::vector<Instruction> insts;
+	std::vector<std::size_t> indexAt(code.size() + 1, notStart);
+	for (std::size_t pos = 0; pos < code.size();) {
+		const auto byte = static_cast<std::uint8_t>(code[pos]);
+		if (byte < GetCode(InstructionCode::NOP) || byte > GetCode(InstructionCode::MEMOCALL_S)) {
+			throw Rejected(pos, "unknown instruction " + std::to_string(byte));
+		}
+
+		Instruction inst{ pos, pos + 1 };
+		const auto operands = OperandSize(static_cast<InstructionCode>(byte));
+		if (operands > code.size() - inst.next) {
+			throw Rejected(pos, "truncated instruction");
+		}
+		inst.code = ReadOperands(static_cast<InstructionCode>(byte), code.data() + inst.next, inst.a, inst.b);
+		inst.next += operands;
+
+		if (IsSlotInstruction(inst.code) && inst.a >= func.frameSize) {
+			throw Rejected(pos, "slot " + std::to_string(inst.a) + " outside a frame of " + std::to_string(func.frameSize));
+		}
+		switch (inst.code) {
+			case InstructionCode::FUNCTIONCALL:
+			case InstructionCode::MEMOCALL:
+			case InstructionCode::TAILCALL:
+			case InstructionCode::NATIVECALL: {
+				const auto targets = inst.code == InstructionCode::NATIVECALL ? natives : functions;
+				if (inst.a >= targets.size()) {
+					throw Rejected(pos, "call to missing function #" + std::to_string(inst.a));
+				}
+				if (inst.b != targets[inst.a].arity) {
+					throw Rejected(pos, std::to_string(inst.b) + " arguments for a function taking " + std::to_string(targets[inst.a].arity));
+				}
+				// The callee's result becomes ours
+				if (inst.code == InstructionCode::TAILCALL && targets[inst.a].returns != func.returns) {
+					throw Rejected(pos, "tail call to a function with another return kind");
+				}
+				break;
+			}
+			case InstructionCode::IRET:
+			case InstructionCode::FRET:
+				if (!returnsValue) {
+					throw Rejected(pos, "value returned from a function returning nothing");
+				}
+				if ((inst.code == InstructionCode::FRET) != (func.returns == ValueKind::FLOAT)) {
+					throw Rejected(pos, inst.code == InstructionCode::FRET ? "float returned from a function returning int" : "int returned from a function returning float");
+				}
+				break;
+			default:
+				break;
+		}
+
+		indexAt[pos] = insts.size();
+		insts.push_back(inst);
+		pos = inst.next;
+	}
+	indexAt[code.size()] = insts.size();
+
+	// Stack height before each instruction, the end included. Paths meeting
+	// at an instruction have to agree, so one visit per instruction is enough
+	std::vector<std::int64_t> heights(insts.size() + 1, -1);
+	std::vector<std::size_t> pending{ 0 };
+	heights[0] = 0;
+	auto reach = [&](const Instruction &from, std::int64_t target, std::int64_t height) {
+		if (target < 0 || target > static_cast<std::int64_t>(code.size()) || indexAt[target] == notStart) {
+			throw Rejected(from.pos, "jump to " + std::to_string(target) + ", not an instruction of the body");
+		}
+
+		const auto idx = indexAt[target];
+		if (heights[idx] < 0) {
+			heights[idx] = height;
+			pending.push_back(idx);
+		}
+		else if (heights[idx] != height) {
+			throw Rejected(target, "reached with " + std::to_string(heights[idx]) + " and " + std::to_string(height) + " values on the stack");
+		}
+	};
+
+	while (!pending.empty()) {
+		const auto idx = pending.back();
+		pending.pop_back();
+		if (idx == insts.size()) {
+			if (returnsValue) {
+				throw Rejected(code.size(), "end reached in a function returning a value");
+			}
+			continue;
+		}
+
+		const auto &inst = insts[idx];
+		bool returns = false;
+		if (inst.code == InstructionCode::FUNCTIONCALL || inst.code == InstructionCode::MEMOCALL) {
+			returns = functions[inst.a].returns != ValueKind::NONE;
+		}
+		else if (inst.code == InstructionCode::NATIVECALL) {
+			returns = natives[inst.a].returns != ValueKind::NONE;
+		}
+		const auto effect = GetStackEffect(inst.code, inst.b, returns);
+		const auto height = heights[idx];
+		if (height < effect.pops) {
+			throw Rejected(inst.pos, "pops " + std::to_string(effect.pops) + " values from a stack of " + std::to_string(height));
+		}
+		const auto after = height - effect.pops + effect.pushes;
+		if (after > func.maxStack) {
+			throw Rejected(inst.pos, "stack deeper than the " + std::to_string(func.maxStack) + " values declared");
+		}
+
+		const auto next = static_cast<std::int64_t>(inst.next);
+		switch (inst.code) {
+			case InstructionCode::SKIP:
+				reach(inst, next + inst.a, after);
+				break;
+			case InstructionCode::BACK:
+				reach(inst, next - inst.a, after);
+				break;
+			case InstructionCode::IF:
+			case InstructionCode::WHILE:
+			case InstructionCode::FOR:
+				reach(inst, next, after);
+				reach(inst, next + inst.a, after);
+				break;
+			case InstructionCode::LOOP:
+				reach(inst, next, after);
+				reach(inst, next - inst.b, after);
+				break;
+			case InstructionCode::IRET:
+			case InstructionCode::FRET:
+			case InstructionCode::TAILCALL:
+				break;
+			default:
+				reach(inst, next, after);
+				break;
+		}
+	}
+}
\ No newline at end of file
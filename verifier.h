@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include "bytecode.h"
+
+// What call sites are checked against, one per FUNCTIONS or NATIVES entry
+struct CallTarget {
+	std::uint32_t arity = 0;
+	ValueKind returns = ValueKind::NONE;
+};
+
+// Load time check of one function body, after which the interpreter can
+// trust it. Every instruction has to be known and complete, jumps have to
+// land on an instruction of the body or its end, and every call has to
+// name an existing target with its arity. The operand stack has to have
+// one height at each instruction whatever path led there, never go below
+// empty and never exceed func.maxStack, slots have to be below
+// func.frameSize, which has room for the parameters. IRET and FRET have
+// to match the kind func declares and are only allowed in functions
+// returning a value, which in turn may not fall off the end, the only
+// way to return nothing. A tail call has to return the kind func does.
+// Throws a message with the offset of the first violation.
+void VerifyFunction(std::span<const char> code, const ImageFunction &func, std::span<const CallTarget> functions, std::span<const CallTarget> natives);
\ No newline at end of file
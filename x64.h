@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#if defined(__linux__) && defined(__x86_64__)
+#define JIT_X86_64
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef JIT_X86_64
+// Just enough of an x86-64 encoder for the compilers in jit.cpp and trace.cpp
+namespace x64 {
+	enum Reg : std::uint8_t {
+		RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+		R8, R9, R10, R11, R12, R13, R14, R15,
+	};
+
+	enum Cond : std::uint8_t {
+		BELOW = 0x2,
+		EQUAL = 0x4,
+		NOT_EQUAL = 0x5,
+		LESS = 0xC,
+		GREATER_EQUAL = 0xD,
+		LESS_EQUAL = 0xE,
+		GREATER = 0xF,
+	};
+	inline Cond Invert(Cond cond) { return static_cast<Cond>(cond ^ 1); }
+
+	class Assembler {
+	public:
+		struct Label {
+			std::int64_t offset = -1;
+			std::vector<std::size_t> uses;	// rel32 fields to patch once bound
+		};
+	private:
+		std::vector<std::uint8_t> bytes;
+
+		// REX prefix for 32 bit operations on r8 to r15
+		void Rex(std::uint8_t reg, std::uint8_t rm) {
+			if (reg >= R8 || rm >= R8) {
+				bytes.push_back(static_cast<std::uint8_t>(0x40 | (reg >= R8) << 2 | (rm >= R8)));
+			}
+		}
+	public:
+		void Emit(std::initializer_list<std::uint8_t> code) { bytes.insert(bytes.end(), code); }
+		void Emit(const std::vector<std::uint8_t> &code) { bytes.insert(bytes.end(), code.begin(), code.end()); }
+		void Imm32(std::int32_t value) {
+			const auto at = bytes.size();
+			bytes.resize(at + sizeof(value));
+			std::memcpy(bytes.data() + at, &value, sizeof(value));
+		}
+		void Imm64(std::uint64_t value) {
+			const auto at = bytes.size();
+			bytes.resize(at + sizeof(value));
+			std::memcpy(bytes.data() + at, &value, sizeof(value));
+		}
+		// Instruction with a [rbp + disp32] operand, reg is the ModRM reg field
+		void Frame(const std::vector<std::uint8_t> &opcode, std::uint8_t reg, std::int32_t disp) {
+			Rex(reg, RBP);
+			Emit(opcode);
+			bytes.push_back(static_cast<std::uint8_t>(0x85 | (reg & 7) << 3));
+			Imm32(disp);
+		}
+		// Same with [rbx + disp32], rbx holds the context
+		void Context(const std::vector<std::uint8_t> &opcode, std::uint8_t reg, std::int32_t disp) {
+			Emit(opcode);
+			bytes.push_back(static_cast<std::uint8_t>(0x83 | reg << 3));
+			Imm32(disp);
+		}
+		// 32 bit instruction between two registers, rm is the ModRM rm field
+		void Registers(const std::vector<std::uint8_t> &opcode, std::uint8_t reg, std::uint8_t rm) {
+			Rex(reg, rm);
+			Emit(opcode);
+			bytes.push_back(static_cast<std::uint8_t>(0xC0 | (reg & 7) << 3 | (rm & 7)));
+		}
+		// Opcodes that encode their register, push, pop and mov imm32
+		void Short(std::uint8_t opcode, std::uint8_t reg) {
+			Rex(0, reg);
+			bytes.push_back(static_cast<std::uint8_t>(opcode | (reg & 7)));
+		}
+
+		void Bind(Label &label) { label.offset = static_cast<std::int64_t>(bytes.size()); }
+		void Jump(Label &label) {
+			Emit({ 0xE9 });
+			label.uses.push_back(bytes.size());
+			Imm32(0);
+		}
+		void JumpIf(Cond cond, Label &label) {
+			Emit({ 0x0F, static_cast<std::uint8_t>(0x80 | cond) });
+			label.uses.push_back(bytes.size());
+			Imm32(0);
+		}
+		void Patch(const Label &label) {
+			for (auto use : label.uses) {
+				const auto rel = static_cast<std::int32_t>(label.offset - static_cast<std::int64_t>(use + sizeof(std::int32_t)));
+				std::memcpy(bytes.data() + use, &rel, sizeof(rel));
+			}
+		}
+
+		const std::vector<std::uint8_t> &Bytes() const { return bytes; }
+	};
+
+	// Copies code into its own pages, written while writable and then only
+	// executable. Null on failure, size is what Unmap needs
+	inline void *Map(const std::vector<std::uint8_t> &bytes, std::size_t &size) {
+		const auto pageSize = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+		size = (bytes.size() + pageSize - 1) / pageSize * pageSize;
+		void *page = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (page == MAP_FAILED) {
+			return nullptr;
+		}
+		std::memcpy(page, bytes.data(), bytes.size());
+		if (mprotect(page, size, PROT_READ | PROT_EXEC) != 0) {
+			munmap(page, size);
+			return nullptr;
+		}
+		return page;
+	}
+	inline void Unmap(void *page, std::size_t size) {
+		munmap(page, size);
+	}
+}
+#endif
\ No newline at end of file